@@ -0,0 +1,191 @@
+/*
+ vdbconv
+ Copyright 2014-2017 Peter Pearson.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ You may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ ---------
+*/
+
+#include "bounds_manifest.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const unsigned int kBoundsManifestVersion = 2;
+
+BoundsManifest::BoundsManifest()
+{
+
+}
+
+bool BoundsManifest::load(const std::string& path, const std::string& settingsKey)
+{
+	m_aFrames.clear();
+	m_settingsKey = settingsKey;
+
+	FILE* pFile = fopen(path.c_str(), "r");
+
+	if (!pFile)
+		return false;
+
+	// the settings line has the grid names in it, so can be fairly long
+	char szLine[4096];
+
+	unsigned int version = 0;
+	if (!fgets(szLine, 4096, pFile) || sscanf(szLine, "vdbconv_bounds %u", &version) != 1)
+	{
+		fprintf(stderr, "Invalid bounds manifest file: %s\n", path.c_str());
+		fclose(pFile);
+		return false;
+	}
+
+	// older versions don't have the settings, and only have mtimes in seconds, so need working out again
+	if (version != kBoundsManifestVersion)
+	{
+		fclose(pFile);
+		return false;
+	}
+
+	std::string fileSettingsKey;
+	if (fgets(szLine, 4096, pFile) && strncmp(szLine, "settings ", 9) == 0)
+	{
+		fileSettingsKey = szLine + 9;
+		fileSettingsKey.erase(fileSettingsKey.find_last_not_of("\r\n") + 1);
+	}
+
+	if (fileSettingsKey != m_settingsKey)
+	{
+		fprintf(stderr, "Bounds manifest: %s was written with different grid settings, so the bounds will be worked out again.\n",
+				path.c_str());
+		fclose(pFile);
+		return false;
+	}
+
+	while (fgets(szLine, 4096, pFile))
+	{
+		unsigned int frame = 0;
+		long long sourceMTime = 0;
+		int min[3];
+		int max[3];
+
+		// we don't need the global line, as it's worked out from the frames
+		if (sscanf(szLine, "frame %u %lld %d %d %d %d %d %d", &frame, &sourceMTime,
+				   &min[0], &min[1], &min[2], &max[0], &max[1], &max[2]) != 8)
+		{
+			continue;
+		}
+
+		FrameEntry& entry = m_aFrames[frame];
+		entry.sourceMTime = sourceMTime;
+		entry.bounds.min = openvdb::Vec3f((float)min[0], (float)min[1], (float)min[2]);
+		entry.bounds.max = openvdb::Vec3f((float)max[0], (float)max[1], (float)max[2]);
+	}
+
+	fclose(pFile);
+
+	return true;
+}
+
+bool BoundsManifest::save(const std::string& path) const
+{
+	char szPID[32];
+	sprintf(szPID, ".%d.tmp", (int)getpid());
+
+	std::string tempPath = path + szPID;
+
+	FILE* pFile = fopen(tempPath.c_str(), "w");
+
+	if (!pFile)
+	{
+		fprintf(stderr, "Couldn't open file: %s for writing.\n", tempPath.c_str());
+		return false;
+	}
+
+	fprintf(pFile, "vdbconv_bounds %u\n", kBoundsManifestVersion);
+	fprintf(pFile, "settings %s\n", m_settingsKey.c_str());
+
+	GridBounds globalBounds;
+
+	std::map<unsigned int, FrameEntry>::const_iterator itFrame = m_aFrames.begin();
+	for (; itFrame != m_aFrames.end(); ++itFrame)
+	{
+		const FrameEntry& entry = itFrame->second;
+
+		fprintf(pFile, "frame %u %lld %d %d %d %d %d %d\n", itFrame->first, (long long)entry.sourceMTime,
+				(int)entry.bounds.min.x(), (int)entry.bounds.min.y(), (int)entry.bounds.min.z(),
+				(int)entry.bounds.max.x(), (int)entry.bounds.max.y(), (int)entry.bounds.max.z());
+
+		globalBounds.mergeBounds(entry.bounds);
+	}
+
+	// just for reference
+	fprintf(pFile, "global %d %d %d %d %d %d\n", (int)globalBounds.min.x(), (int)globalBounds.min.y(), (int)globalBounds.min.z(),
+			(int)globalBounds.max.x(), (int)globalBounds.max.y(), (int)globalBounds.max.z());
+
+	fclose(pFile);
+
+	if (rename(tempPath.c_str(), path.c_str()) != 0)
+	{
+		fprintf(stderr, "Couldn't write bounds manifest file: %s\n", path.c_str());
+		remove(tempPath.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+const BoundsManifest::FrameEntry* BoundsManifest::getFrameEntry(unsigned int frame, int64_t sourceMTime) const
+{
+	std::map<unsigned int, FrameEntry>::const_iterator itFind = m_aFrames.find(frame);
+
+	if (itFind == m_aFrames.end() || itFind->second.sourceMTime != sourceMTime)
+		return NULL;
+
+	return &itFind->second;
+}
+
+void BoundsManifest::setFrameEntry(unsigned int frame, int64_t sourceMTime, const GridBounds& bounds)
+{
+	FrameEntry& entry = m_aFrames[frame];
+	entry.sourceMTime = sourceMTime;
+	entry.bounds = bounds;
+}
+
+GridBounds BoundsManifest::getGlobalBounds(unsigned int startFrame, unsigned int endFrame) const
+{
+	GridBounds globalBounds;
+
+	std::map<unsigned int, FrameEntry>::const_iterator itFrame = m_aFrames.lower_bound(startFrame);
+	for (; itFrame != m_aFrames.end() && itFrame->first <= endFrame; ++itFrame)
+	{
+		globalBounds.mergeBounds(itFrame->second.bounds);
+	}
+
+	return globalBounds;
+}
+
+int64_t BoundsManifest::getFileModificationTime(const std::string& path)
+{
+	struct stat fileStat;
+
+	if (stat(path.c_str(), &fileStat) != 0)
+		return 0;
+
+#ifdef __APPLE__
+	return (int64_t)fileStat.st_mtimespec.tv_sec * 1000000000LL + (int64_t)fileStat.st_mtimespec.tv_nsec;
+#else
+	return (int64_t)fileStat.st_mtim.tv_sec * 1000000000LL + (int64_t)fileStat.st_mtim.tv_nsec;
+#endif
+}
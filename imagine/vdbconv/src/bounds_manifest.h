@@ -0,0 +1,71 @@
+/*
+ vdbconv
+ Copyright 2014-2017 Peter Pearson.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ You may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ ---------
+*/
+
+#ifndef BOUNDS_MANIFEST_H
+#define BOUNDS_MANIFEST_H
+
+#include <map>
+#include <string>
+
+#include <stdint.h>
+
+#include "grid_bounds.h"
+
+// sidecar file storing the bounds of each frame of a sequence, along with the modification time of
+// the source file they were worked out from. This means the global bounds of a sequence only need to be
+// worked out once, and can be shared between multiple nodes converting different parts of the sequence.
+// The bounds depend on which grids are converted, so the manifest also stores a key for the settings they
+// were worked out with, and its frames are only used with the same settings.
+class BoundsManifest
+{
+public:
+	BoundsManifest();
+
+	struct FrameEntry
+	{
+		FrameEntry() : sourceMTime(0)
+		{
+		}
+
+		int64_t		sourceMTime;
+		GridBounds	bounds;
+	};
+
+	// if the manifest was written with a different settings key, its frames are discarded, and will be
+	// replaced when it's next saved
+	bool load(const std::string& path, const std::string& settingsKey);
+	// the manifest is written to a temp file first and then renamed, so that other processes
+	// reading it at the same time never see a partially-written file
+	bool save(const std::string& path) const;
+
+	// returns NULL if there's no entry for the frame, or it's out of date with the source file
+	const FrameEntry* getFrameEntry(unsigned int frame, int64_t sourceMTime) const;
+	void setFrameEntry(unsigned int frame, int64_t sourceMTime, const GridBounds& bounds);
+
+	// the union of the bounds of all frames within the range
+	GridBounds getGlobalBounds(unsigned int startFrame, unsigned int endFrame) const;
+
+	// in nanoseconds, as several frames can be written within the same second. returns 0 if the file doesn't exist
+	static int64_t getFileModificationTime(const std::string& path);
+
+protected:
+	std::string							m_settingsKey;
+	std::map<unsigned int, FrameEntry>	m_aFrames;
+};
+
+#endif // BOUNDS_MANIFEST_H
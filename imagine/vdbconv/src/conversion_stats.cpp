@@ -0,0 +1,278 @@
+/*
+ vdbconv
+ Copyright 2014-2017 Peter Pearson.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ You may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ ---------
+*/
+
+#include "conversion_stats.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+
+namespace
+{
+
+const char* kPhaseNames[eConversionPhaseCount] = { "bounds", "read", "resample", "extract", "mipLevels", "encode", "write" };
+
+// the number of voxels in the subcell with any non-zero components
+unsigned int countNonZeroVoxels(const SparseGrid::SparseSubCell& subCell)
+{
+	unsigned int numComponents = subCell.getNumComponents();
+	unsigned int numVoxels = subCell.getNumValues() / numComponents;
+
+	unsigned int count = 0;
+
+	if (subCell.getRawFloatData())
+	{
+		const float* pValues = subCell.getRawFloatData();
+		for (unsigned int voxel = 0; voxel < numVoxels; voxel++)
+		{
+			for (unsigned int component = 0; component < numComponents; component++)
+			{
+				if (pValues[voxel * numComponents + component] != 0.0f)
+				{
+					count++;
+					break;
+				}
+			}
+		}
+	}
+	else if (subCell.getRawHalfData())
+	{
+		const half* pValues = subCell.getRawHalfData();
+		for (unsigned int voxel = 0; voxel < numVoxels; voxel++)
+		{
+			for (unsigned int component = 0; component < numComponents; component++)
+			{
+				// either sign of zero
+				if (pValues[voxel * numComponents + component].bits() & 0x7fff)
+				{
+					count++;
+					break;
+				}
+			}
+		}
+	}
+
+	return count;
+}
+
+} // namespace
+
+ConversionStats::ConversionStats() : m_overlappingPhases(false), m_halfConversionNanoseconds(0), m_bytesRead(0), m_bytesWritten(0),
+	m_numSparseGrids(0), m_numSubCells(0), m_numAllocatedSubCells(0), m_subCellMemorySize(0), m_gridMemorySize(0),
+	m_maxGridMemorySize(0)
+{
+	m_startWallTime = getWallTime();
+	m_startCPUTime = getProcessCPUTime();
+
+	for (unsigned int i = 0; i < kOccupancyBuckets; i++)
+	{
+		m_occupancyHistogram[i] = 0;
+	}
+}
+
+void ConversionStats::addPhaseTime(ConversionPhase phase, double wallSeconds, double cpuSeconds)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	PhaseStats& phaseStats = m_phases[phase];
+	phaseStats.count++;
+	phaseStats.wallSeconds += wallSeconds;
+	phaseStats.cpuSeconds += cpuSeconds;
+}
+
+void ConversionStats::addHalfConversionTime(double seconds)
+{
+	m_halfConversionNanoseconds += (uint64_t)(seconds * 1.0e9);
+}
+
+void ConversionStats::addFileRead(const std::string& path)
+{
+	struct stat fileStat;
+	if (stat(path.c_str(), &fileStat) != 0)
+		return;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_bytesRead += (uint64_t)fileStat.st_size;
+}
+
+void ConversionStats::addBytesWritten(uint64_t bytes)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_bytesWritten += bytes;
+}
+
+void ConversionStats::addSparseGrid(const SparseGrid& sparseGrid)
+{
+	std::vector<SparseGrid::AllocatedSubCell> allocatedSubCells;
+	sparseGrid.getAllocatedSubCells(allocatedSubCells);
+
+	uint64_t subCellMemorySize = 0;
+	uint64_t histogram[kOccupancyBuckets] = { 0 };
+
+	for (size_t i = 0; i < allocatedSubCells.size(); i++)
+	{
+		const SparseGrid::SparseSubCell& subCell = *allocatedSubCells[i].pSubCell;
+
+		subCellMemorySize += subCell.getMemorySize();
+
+		unsigned int numVoxels = subCell.getNumValues() / subCell.getNumComponents();
+		unsigned int bucket = (unsigned int)((uint64_t)countNonZeroVoxels(subCell) * kOccupancyBuckets / numVoxels);
+		histogram[std::min(bucket, kOccupancyBuckets - 1)]++;
+	}
+
+	uint64_t gridMemorySize = sparseGrid.getMemorySize();
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_numSparseGrids++;
+	m_numSubCells += sparseGrid.getNumSubCells();
+	m_numAllocatedSubCells += allocatedSubCells.size();
+	m_subCellMemorySize += subCellMemorySize;
+	m_gridMemorySize += gridMemorySize;
+	m_maxGridMemorySize = std::max(m_maxGridMemorySize, gridMemorySize);
+
+	for (unsigned int i = 0; i < kOccupancyBuckets; i++)
+	{
+		m_occupancyHistogram[i] += histogram[i];
+	}
+}
+
+bool ConversionStats::writeJSON(const std::string& path) const
+{
+	FILE* pFile = fopen(path.c_str(), "w");
+	if (!pFile)
+	{
+		fprintf(stderr, "Couldn't open stats file: %s for writing.\n", path.c_str());
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	// ru_maxrss is in bytes on macOS, but KB on Linux
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	uint64_t peakRSS = (uint64_t)usage.ru_maxrss;
+#else
+	uint64_t peakRSS = (uint64_t)usage.ru_maxrss * 1024;
+#endif
+
+	fprintf(pFile, "{\n");
+	fprintf(pFile, "  \"wallSeconds\": %.6f,\n", getWallTime() - m_startWallTime);
+	fprintf(pFile, "  \"cpuSeconds\": %.6f,\n", getProcessCPUTime() - m_startCPUTime);
+	fprintf(pFile, "  \"peakRSSBytes\": %llu,\n", (unsigned long long)peakRSS);
+	fprintf(pFile, "  \"bytesRead\": %llu,\n", (unsigned long long)m_bytesRead);
+	fprintf(pFile, "  \"bytesWritten\": %llu,\n", (unsigned long long)m_bytesWritten);
+	fprintf(pFile, "  \"overlappingPhases\": %s,\n", m_overlappingPhases ? "true" : "false");
+
+	fprintf(pFile, "  \"phases\": {\n");
+	for (unsigned int i = 0; i < eConversionPhaseCount; i++)
+	{
+		fprintf(pFile, "    \"%s\": { \"count\": %llu, \"wallSeconds\": %.6f, \"cpuSeconds\": %.6f }%s\n", kPhaseNames[i],
+				(unsigned long long)m_phases[i].count, m_phases[i].wallSeconds, m_phases[i].cpuSeconds,
+				(i + 1 < eConversionPhaseCount) ? "," : "");
+	}
+	fprintf(pFile, "  },\n");
+
+	fprintf(pFile, "  \"halfConversionThreadSeconds\": %.6f,\n", m_halfConversionNanoseconds / 1.0e9);
+
+	fprintf(pFile, "  \"sparseGrids\": {\n");
+	fprintf(pFile, "    \"count\": %llu,\n", (unsigned long long)m_numSparseGrids);
+	fprintf(pFile, "    \"subCells\": %llu,\n", (unsigned long long)m_numSubCells);
+	fprintf(pFile, "    \"allocatedSubCells\": %llu,\n", (unsigned long long)m_numAllocatedSubCells);
+	fprintf(pFile, "    \"subCellMemoryBytes\": %llu,\n", (unsigned long long)m_subCellMemorySize);
+	fprintf(pFile, "    \"gridMemoryBytes\": %llu,\n", (unsigned long long)m_gridMemorySize);
+	fprintf(pFile, "    \"maxGridMemoryBytes\": %llu,\n", (unsigned long long)m_maxGridMemorySize);
+	fprintf(pFile, "    \"occupancyHistogram\": [");
+	for (unsigned int i = 0; i < kOccupancyBuckets; i++)
+	{
+		fprintf(pFile, "%s%llu", (i > 0) ? ", " : "", (unsigned long long)m_occupancyHistogram[i]);
+	}
+	fprintf(pFile, "]\n");
+	fprintf(pFile, "  }\n");
+
+	fprintf(pFile, "}\n");
+
+	fclose(pFile);
+
+	return true;
+}
+
+double ConversionStats::getProcessCPUTime()
+{
+	struct timespec cpuTime;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpuTime);
+
+	return (double)cpuTime.tv_sec + (double)cpuTime.tv_nsec / 1.0e9;
+}
+
+double ConversionStats::getWallTime()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+thread_local ScopedPhaseTimer* ScopedPhaseTimer::s_pCurrent = NULL;
+
+ScopedPhaseTimer::ScopedPhaseTimer(ConversionStats* pStats, ConversionPhase phase) : m_pStats(pStats), m_phase(phase),
+	m_pParent(NULL), m_wallStart(0.0), m_cpuStart(0.0), m_wallSeconds(0.0), m_cpuSeconds(0.0)
+{
+	if (!m_pStats)
+		return;
+
+	m_pParent = s_pCurrent;
+	if (m_pParent)
+	{
+		m_pParent->pause();
+	}
+
+	s_pCurrent = this;
+
+	resume();
+}
+
+ScopedPhaseTimer::~ScopedPhaseTimer()
+{
+	if (!m_pStats)
+		return;
+
+	pause();
+
+	m_pStats->addPhaseTime(m_phase, m_wallSeconds, m_cpuSeconds);
+
+	s_pCurrent = m_pParent;
+	if (m_pParent)
+	{
+		m_pParent->resume();
+	}
+}
+
+void ScopedPhaseTimer::pause()
+{
+	m_wallSeconds += ConversionStats::getWallTime() - m_wallStart;
+	m_cpuSeconds += ConversionStats::getProcessCPUTime() - m_cpuStart;
+}
+
+void ScopedPhaseTimer::resume()
+{
+	m_wallStart = ConversionStats::getWallTime();
+	m_cpuStart = ConversionStats::getProcessCPUTime();
+}
@@ -0,0 +1,138 @@
+/*
+ vdbconv
+ Copyright 2014-2017 Peter Pearson.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ You may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ ---------
+*/
+
+#ifndef CONVERSION_STATS_H
+#define CONVERSION_STATS_H
+
+#include <string>
+#include <mutex>
+#include <atomic>
+
+#include <stdint.h>
+
+#include "sparse_grid.h"
+
+// the phases of a conversion which are timed separately
+enum ConversionPhase
+{
+	eConversionPhaseBounds,
+	// opening the VDB files and reading the grids
+	eConversionPhaseRead,
+	// filtering the grids down to a coarser voxel size
+	eConversionPhaseResample,
+	// extracting the voxel values from the grids (including any half conversion)
+	eConversionPhaseExtract,
+	eConversionPhaseMipLevels,
+	// quantizing, compressing etc the sparse subcells
+	eConversionPhaseEncode,
+	eConversionPhaseWrite,
+	eConversionPhaseCount
+};
+
+// collects timing and memory stats for a conversion, which can be written as JSON. Everything can be
+// added to from multiple threads at once.
+class ConversionStats
+{
+public:
+	static const unsigned int kOccupancyBuckets = 10;
+
+	// the overall wall and CPU times start from construction
+	ConversionStats();
+
+	// for sequences, frames are converted at the same time, so the phases overlap, and the CPU time
+	// of each phase includes other work going on at the same time
+	void setOverlappingPhases(bool overlapping) { m_overlappingPhases = overlapping; }
+
+	void addPhaseTime(ConversionPhase phase, double wallSeconds, double cpuSeconds);
+	// the half conversion happens within the extraction, on many threads, so it's the total time of all of them
+	void addHalfConversionTime(double seconds);
+
+	void addFileRead(const std::string& path);
+	void addBytesWritten(uint64_t bytes);
+
+	// records how many subcells were allocated, how full they were, and how much memory they used
+	void addSparseGrid(const SparseGrid& sparseGrid);
+
+	bool writeJSON(const std::string& path) const;
+
+	static double getProcessCPUTime();
+	static double getWallTime();
+
+protected:
+	struct PhaseStats
+	{
+		PhaseStats() : count(0), wallSeconds(0.0), cpuSeconds(0.0)
+		{
+		}
+
+		uint64_t	count;
+		double		wallSeconds;
+		double		cpuSeconds;
+	};
+
+	mutable std::mutex		m_mutex;
+
+	double					m_startWallTime;
+	double					m_startCPUTime;
+	bool					m_overlappingPhases;
+
+	PhaseStats				m_phases[eConversionPhaseCount];
+	std::atomic<uint64_t>	m_halfConversionNanoseconds;
+
+	uint64_t				m_bytesRead;
+	uint64_t				m_bytesWritten;
+
+	uint64_t				m_numSparseGrids;
+	uint64_t				m_numSubCells;
+	uint64_t				m_numAllocatedSubCells;
+	// the sum of SparseSubCell::getMemorySize() for the allocated subcells
+	uint64_t				m_subCellMemorySize;
+	// the sum and max of SparseGrid::getMemorySize()
+	uint64_t				m_gridMemorySize;
+	uint64_t				m_maxGridMemorySize;
+	// the allocated subcells by the fraction of their voxels which are non-zero, in tenths
+	uint64_t				m_occupancyHistogram[kOccupancyBuckets];
+};
+
+// times a phase for as long as it's in scope, excluding the time of any phases nested within it on the same
+// thread. Does nothing if pStats is NULL.
+class ScopedPhaseTimer
+{
+public:
+	ScopedPhaseTimer(ConversionStats* pStats, ConversionPhase phase);
+	~ScopedPhaseTimer();
+
+protected:
+	void pause();
+	void resume();
+
+protected:
+	ConversionStats*	m_pStats;
+	ConversionPhase		m_phase;
+	ScopedPhaseTimer*	m_pParent;
+
+	double				m_wallStart;
+	double				m_cpuStart;
+	double				m_wallSeconds;
+	double				m_cpuSeconds;
+
+	// the innermost timer on this thread
+	static thread_local ScopedPhaseTimer*	s_pCurrent;
+};
+
+#endif // CONVERSION_STATS_H
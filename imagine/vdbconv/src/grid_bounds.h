@@ -0,0 +1,86 @@
+/*
+ vdbconv
+ Copyright 2014-2017 Peter Pearson.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ You may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ ---------
+*/
+
+#ifndef GRID_BOUNDS_H
+#define GRID_BOUNDS_H
+
+#include <algorithm>
+
+#include <openvdb/openvdb.h>
+
+// voxel-space bounds of the active voxels of one or more grids
+struct GridBounds
+{
+	GridBounds() : min(5000.0f), max(-5000.0f)
+	{
+
+	}
+
+	bool isEmpty() const
+	{
+		return min.x() > max.x() || min.y() > max.y() || min.z() > max.z();
+	}
+
+	void mergeGrid(openvdb::GridBase::ConstPtr grid)
+	{
+		// work out bbox
+		openvdb::CoordBBox bbox = grid->evalActiveVoxelBoundingBox();
+
+		mergeBBox(bbox);
+	}
+
+	void mergeBBox(const openvdb::CoordBBox& bbox)
+	{
+		// empty grids don't contribute anything
+		if (bbox.empty())
+			return;
+
+		openvdb::Coord voxelMin = bbox.min();
+		openvdb::Coord voxelMax = bbox.max();
+
+		openvdb::Vec3d gridMin = voxelMin.asVec3d();
+		openvdb::Vec3d gridMax = voxelMax.asVec3d();
+
+		min.x() = std::min(min.x(), (float)gridMin.x());
+		min.y() = std::min(min.y(), (float)gridMin.y());
+		min.z() = std::min(min.z(), (float)gridMin.z());
+
+		max.x() = std::max(max.x(), (float)gridMax.x());
+		max.y() = std::max(max.y(), (float)gridMax.y());
+		max.z() = std::max(max.z(), (float)gridMax.z());
+	}
+
+	void mergeBounds(const GridBounds& bounds)
+	{
+		if (bounds.isEmpty())
+			return;
+
+		min.x() = std::min(min.x(), bounds.min.x());
+		min.y() = std::min(min.y(), bounds.min.y());
+		min.z() = std::min(min.z(), bounds.min.z());
+
+		max.x() = std::max(max.x(), bounds.max.x());
+		max.y() = std::max(max.y(), bounds.max.y());
+		max.z() = std::max(max.z(), bounds.max.z());
+	}
+
+	openvdb::Vec3f min;
+	openvdb::Vec3f max;
+};
+
+#endif // GRID_BOUNDS_H
@@ -0,0 +1,88 @@
+/*
+ vdbconv
+ Copyright 2014-2017 Peter Pearson.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ You may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ ---------
+*/
+
+#include "half_convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HALF_CONVERT_X86 1
+#include <immintrin.h>
+#endif
+
+namespace
+{
+
+bool checkF16CAvailable()
+{
+#ifdef HALF_CONVERT_X86
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+#else
+	return false;
+#endif
+}
+
+} // namespace
+
+void convertFloatsToHalfsScalar(const float* pSrc, half* pDst, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		pDst[i] = (half)pSrc[i];
+	}
+}
+
+#ifdef HALF_CONVERT_X86
+// this is compiled for F16C regardless of the build flags, so it must only be called if the CPU supports it
+__attribute__((target("avx,f16c")))
+void convertFloatsToHalfsF16C(const float* pSrc, half* pDst, size_t count)
+{
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256 values = _mm256_loadu_ps(pSrc + i);
+		__m128i halfValues = _mm256_cvtps_ph(values, _MM_FROUND_TO_NEAREST_INT);
+		_mm_storeu_si128((__m128i*)(pDst + i), halfValues);
+	}
+
+	convertFloatsToHalfsScalar(pSrc + i, pDst + i, count - i);
+}
+#else
+void convertFloatsToHalfsF16C(const float* pSrc, half* pDst, size_t count)
+{
+	convertFloatsToHalfsScalar(pSrc, pDst, count);
+}
+#endif
+
+bool isF16CAvailable()
+{
+	static const bool available = checkF16CAvailable();
+	return available;
+}
+
+void convertFloatsToHalfs(const float* pSrc, half* pDst, size_t count)
+{
+#ifdef HALF_CONVERT_X86
+	if (isF16CAvailable())
+	{
+		convertFloatsToHalfsF16C(pSrc, pDst, count);
+		return;
+	}
+#endif
+
+	convertFloatsToHalfsScalar(pSrc, pDst, count);
+}
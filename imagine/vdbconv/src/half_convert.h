@@ -0,0 +1,40 @@
+/*
+ vdbconv
+ Copyright 2014-2017 Peter Pearson.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ You may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ ---------
+*/
+
+#ifndef HALF_CONVERT_H
+#define HALF_CONVERT_H
+
+#include <stddef.h>
+
+#include <half.h>
+
+// batch float to half conversion - on x86 CPUs with F16C this converts 8 values per instruction,
+// otherwise it falls back to the half class one value at a time. The results are the same either way
+// (round to nearest even).
+
+void convertFloatsToHalfs(const float* pSrc, half* pDst, size_t count);
+
+// whether convertFloatsToHalfs() can use F16C on this CPU
+bool isF16CAvailable();
+
+// the two paths convertFloatsToHalfs() chooses between, so they can be tested against each other.
+// convertFloatsToHalfsF16C() must only be called if isF16CAvailable().
+void convertFloatsToHalfsScalar(const float* pSrc, half* pDst, size_t count);
+void convertFloatsToHalfsF16C(const float* pSrc, half* pDst, size_t count);
+
+#endif // HALF_CONVERT_H
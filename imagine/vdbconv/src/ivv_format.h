@@ -0,0 +1,158 @@
+/*
+ vdbconv
+ Copyright 2014-2017 Peter Pearson.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ You may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ ---------
+*/
+
+#ifndef IVV_FORMAT_H
+#define IVV_FORMAT_H
+
+// Imagine Voxel Volume (IVV) file format constants.
+//
+// All files start with:
+//   uint8 version, uint8 dataType, uint8 gridType, [uint16 subCellSize - sparse only],
+//   uint32 resX, resY, resZ, float bbox min x, y, z, float bbox max x, y, z
+//
+// Version 3 files then have the voxel data: for dense grids, all values in x, y, z order. For
+// sparse grids, the subcells in x, y, z order, in batches of 8 - a uint8 with a bit set for each
+// allocated subcell in the batch, followed by the raw values of each of those subcells.
+//
+// Version 4 files have a uint32 of format flags after the above header, each of which may add
+// extra header fields (in flag bit order). The sparse subcell batches are the same, except each
+// allocated subcell's data starts with a uint8 encoding, which specifies how the rest is stored.
+//
+// Quantized grids (eIVVFlagQuantized) have uint8 or uint16 values, which map back to float values
+// with: offset + value * scale. For sparse grids, each allocated subcell has a float offset and
+// scale after its encoding byte, and for dense grids each z slice starts with them.
+//
+// Mip-mapped files (eIVVFlagMipLevels) have the extra levels after the full-res level's data, each
+// of which is half the resolution (rounded up) of the level before it, and starts with its uint32
+// resX, resY, resZ, followed by its values in the same layout as the full-res level - for sparse
+// grids, with its own subcell batches, using the same subcell size.
+//
+// Sparse grids with a subcell index (eIVVFlagSubCellIndex) don't use the batches. Instead there's a
+// bitset of which subcells are allocated (subcell n is bit n % 8 of byte n / 8), then a uint64 file
+// offset for each allocated subcell's payload, then for each allocated subcell its uint8 encoding,
+// uint32 payload size, and (if quantized) float offset and scale. The payloads follow, each starting
+// at a 64-byte aligned file offset: the raw values, the compressed values, or the constant value.
+//
+// Multi-channel files (eIVVFlagMultiChannel, sparse only) have several grids of the same resolution.
+// A subcell is allocated in the batches if it's allocated in any channel, and then has the data of
+// each channel in turn, each starting with its encoding byte as above. Channels with no values in
+// a subcell which others do have store it as a constant zero.
+//
+// Vector grids (eIVVFlagVectorValues, sparse only) have several components per voxel, which are
+// interleaved, so each voxel's values are together. Everything else is per value as for scalar grids -
+// constant subcells have a value for each component, and quantized subcells have a single offset
+// and scale for all the components.
+//
+// Masked subcells (eIVVSubCellMasked) have a uint64 occupancy word for every 64 voxels (voxel n is bit
+// n % 64 of word n / 64), followed by the values (all components) of only the voxels whose bits are set,
+// in voxel order - the rest are zero. A voxel's value is at the count of set bits before its own.
+//
+// Temporal delta files (eIVVFlagTemporalDelta, sparse only) are frames of a sequence, which have the frame
+// number they are and the frame they refer to. Reference subcells (eIVVSubCellReference) have no data, as
+// their values are the same subcell's in the reference frame's file (within the tolerance they were written
+// with), which can itself refer to an earlier frame. Keyframes refer to themselves, so have no references.
+// References only apply to the full-res level: mip levels always store their own data, which is built from
+// the frame's original values, so can differ slightly from a downsample of the referenced full-res level.
+//
+// Frames of sequences converted with their own bounds (eIVVFlagFrameOffset) are offset within the bounds of
+// the whole sequence. The header bbox is then the frame's part of the sequence's bbox, so it's placed correctly
+// without needing to know about the offset.
+
+enum IVVVersion
+{
+	eIVVVersionOriginal		= 3,
+	eIVVVersionExtended		= 4
+};
+
+enum IVVDataType
+{
+	eIVVDataFloat			= 0,
+	eIVVDataHalf			= 1,
+	// quantized - only with eIVVFlagQuantized
+	eIVVDataUInt8			= 2,
+	eIVVDataUInt16			= 3
+};
+
+enum IVVGridType
+{
+	eIVVGridDense			= 0,
+	eIVVGridSparse			= 1
+};
+
+enum IVVFormatFlags
+{
+	// header has uint8 codec, uint8 filter
+	eIVVFlagCompressed		= 1 << 0,
+	// no extra header fields
+	eIVVFlagQuantized		= 1 << 1,
+	// subcells where every voxel has the same value may use eIVVSubCellConstant - no extra header fields
+	eIVVFlagConstantSubCells	= 1 << 2,
+	// header has uint8 numMipLevels, uint8 mipFilter, then a uint64 file offset for each level
+	eIVVFlagMipLevels		= 1 << 3,
+	// sparse subcells are in Morton (Z-order) of their subcell indices rather than x, y, z order, skipping
+	// any codes which are outside the grid - no extra header fields
+	eIVVFlagMortonOrder		= 1 << 4,
+	// sparse subcells are stored with an offset index and aligned payloads - no extra header fields
+	eIVVFlagSubCellIndex	= 1 << 5,
+	// header has uint8 numChannels, then for each channel its name as a uint8 length and the characters
+	eIVVFlagMultiChannel	= 1 << 6,
+	// header has a uint8 number of components per voxel for each channel (or just one for single-channel files)
+	eIVVFlagVectorValues	= 1 << 7,
+	// sparse subcells may use eIVVSubCellMasked - no extra header fields
+	eIVVFlagMaskedSubCells	= 1 << 8,
+	// header has uint32 frame, uint32 referenceFrame, and sparse subcells may use eIVVSubCellReference
+	eIVVFlagTemporalDelta	= 1 << 9,
+	// header has int32 voxel offset x, y, z of the grid within the sequence's bounds, then the uint32 sequence resX, resY, resZ
+	eIVVFlagFrameOffset		= 1 << 10
+};
+
+enum IVVSubCellEncoding
+{
+	// the raw values
+	eIVVSubCellRaw			= 0,
+	// uint32 compressed size, followed by the compressed values
+	eIVVSubCellCompressed	= 1,
+	// a single value (of the grid's data type) for all voxels in the subcell, like an OpenVDB tile
+	eIVVSubCellConstant		= 2,
+	// uint32 masked size, followed by the occupancy mask and the values of the set voxels
+	eIVVSubCellMasked		= 3,
+	// no data - the values are the same subcell's in the reference frame
+	eIVVSubCellReference	= 4
+};
+
+enum IVVCodec
+{
+	eIVVCodecNone			= 0,
+	eIVVCodecLZ4			= 1
+};
+
+enum IVVFilter
+{
+	eIVVFilterNone			= 0,
+	// the bytes of the values are grouped by significance before compression
+	eIVVFilterByteShuffle	= 1
+};
+
+enum IVVMipFilter
+{
+	eIVVMipFilterBox		= 0,
+	// the max of the voxels, which keeps thin features from fading out
+	eIVVMipFilterMax		= 1
+};
+
+#endif // IVV_FORMAT_H
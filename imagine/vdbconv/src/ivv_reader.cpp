@@ -0,0 +1,1003 @@
+/*
+ vdbconv
+ Copyright 2014-2017 Peter Pearson.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ You may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ ---------
+*/
+
+#include "ivv_reader.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <thread>
+
+#include <half.h>
+
+#include "quantize.h"
+#include "subcell_codec.h"
+
+namespace
+{
+
+// steps through the subcells of a grid in the order they're stored in, giving the subcell indices of each, without
+// needing a table of all of them. The Morton order is walked as an octree, skipping the parts outside the grid, as
+// the cell counts generally aren't powers of two - this gives the same order as sorting all the Morton codes.
+class SubCellOrder
+{
+public:
+	SubCellOrder(bool mortonOrder, unsigned int cellCountX, unsigned int cellCountY, unsigned int cellCountZ) :
+		m_mortonOrder(mortonOrder), m_cellCountX(cellCountX), m_cellCountY(cellCountY), m_cellCountZ(cellCountZ),
+		m_linearIndex(0)
+	{
+		unsigned int maxCellCount = std::max(cellCountX, std::max(cellCountY, cellCountZ));
+
+		if (m_mortonOrder && cellCountX > 0 && cellCountY > 0 && cellCountZ > 0)
+		{
+			unsigned int size = 1;
+			while (size < maxCellCount)
+				size *= 2;
+
+			m_stack.push_back(OctreeNode(0, 0, 0, size));
+		}
+	}
+
+	bool next(unsigned int& cellI, unsigned int& cellJ, unsigned int& cellK)
+	{
+		if (!m_mortonOrder)
+		{
+			uint64_t cellCountXY = (uint64_t)m_cellCountX * (uint64_t)m_cellCountY;
+			if (m_linearIndex >= cellCountXY * m_cellCountZ)
+				return false;
+
+			cellI = (unsigned int)(m_linearIndex % m_cellCountX);
+			cellJ = (unsigned int)((m_linearIndex / m_cellCountX) % m_cellCountY);
+			cellK = (unsigned int)(m_linearIndex / cellCountXY);
+			m_linearIndex++;
+
+			return true;
+		}
+
+		while (!m_stack.empty())
+		{
+			OctreeNode node = m_stack.back();
+
+			if (node.size == 1)
+			{
+				m_stack.pop_back();
+
+				cellI = node.i;
+				cellJ = node.j;
+				cellK = node.k;
+				return true;
+			}
+
+			if (node.child == 8)
+			{
+				m_stack.pop_back();
+				continue;
+			}
+
+			m_stack.back().child++;
+
+			// i is the lowest bit of each level of the Morton code, then j, then k
+			unsigned int childSize = node.size / 2;
+			unsigned int childI = node.i + (node.child & 1) * childSize;
+			unsigned int childJ = node.j + ((node.child >> 1) & 1) * childSize;
+			unsigned int childK = node.k + ((node.child >> 2) & 1) * childSize;
+
+			if (childI < m_cellCountX && childJ < m_cellCountY && childK < m_cellCountZ)
+			{
+				m_stack.push_back(OctreeNode(childI, childJ, childK, childSize));
+			}
+		}
+
+		return false;
+	}
+
+protected:
+	struct OctreeNode
+	{
+		OctreeNode(unsigned int _i, unsigned int _j, unsigned int _k, unsigned int _size) : i(_i), j(_j), k(_k), size(_size), child(0)
+		{
+		}
+
+		unsigned int	i;
+		unsigned int	j;
+		unsigned int	k;
+		unsigned int	size;
+		// the next child to visit
+		unsigned int	child;
+	};
+
+	bool			m_mortonOrder;
+	unsigned int	m_cellCountX;
+	unsigned int	m_cellCountY;
+	unsigned int	m_cellCountZ;
+
+	uint64_t		m_linearIndex;
+	std::vector<OctreeNode>	m_stack;
+};
+
+} // namespace
+
+IVVReader::IVVReader() : m_pData(NULL), m_fileSize(0), m_version(0), m_dataType(0), m_formatFlags(0),
+	m_codec(eIVVCodecNone), m_filter(eIVVFilterNone), m_quantizeBits(0), m_channelIndex(0), m_numComponents(1), m_resX(0), m_resY(0), m_resZ(0),
+	m_isSparse(false), m_valuesOffset(0), m_subCellSize(0), m_mortonOrder(false), m_cellCountX(0), m_cellCountY(0), m_cellCountZ(0),
+	m_clockHand(0), m_residentMemoryLimit(0), m_residentMemorySize(0), m_frame(0), m_referenceFrame(0), m_pReferenceReader(NULL)
+{
+	memset(m_bbox, 0, sizeof(float) * 6);
+	memset(m_frameOffset, 0, sizeof(int) * 3);
+	memset(m_sequenceRes, 0, sizeof(unsigned int) * 3);
+}
+
+IVVReader::~IVVReader()
+{
+	close();
+}
+
+bool IVVReader::open(const std::string& path, const std::string& channelName)
+{
+	close();
+
+	int fileDescriptor = ::open(path.c_str(), O_RDONLY);
+	if (fileDescriptor == -1)
+	{
+		fprintf(stderr, "Couldn't open file: %s\n", path.c_str());
+		return false;
+	}
+
+	struct stat fileStat;
+	if (fstat(fileDescriptor, &fileStat) != 0 || fileStat.st_size == 0)
+	{
+		fprintf(stderr, "Couldn't read file: %s\n", path.c_str());
+		::close(fileDescriptor);
+		return false;
+	}
+
+	m_fileSize = (size_t)fileStat.st_size;
+
+	void* pMapping = mmap(NULL, m_fileSize, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+
+	// the mapping stays valid after the file's closed
+	::close(fileDescriptor);
+
+	if (pMapping == MAP_FAILED)
+	{
+		fprintf(stderr, "Couldn't map file: %s\n", path.c_str());
+		m_fileSize = 0;
+		return false;
+	}
+
+	m_pData = (const unsigned char*)pMapping;
+
+	bool result = readHeader(channelName);
+
+	if (result && m_isSparse)
+	{
+		result = (m_formatFlags & eIVVFlagSubCellIndex) ? readSubCellIndex() : readSubCellTable();
+	}
+
+	if (!result)
+	{
+		fprintf(stderr, "Invalid IVV file: %s\n", path.c_str());
+		close();
+		return false;
+	}
+
+	return true;
+}
+
+void IVVReader::close()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (m_pData)
+	{
+		munmap((void*)m_pData, m_fileSize);
+		m_pData = NULL;
+	}
+
+	m_fileSize = 0;
+
+	m_aChannelNames.clear();
+	m_channelIndex = 0;
+	m_aChannelComponents.clear();
+	m_numComponents = 1;
+
+	// nothing else can be using the subcells while the reader's being closed
+	for (size_t i = 0; i < m_aResidentEntries.size(); i++)
+	{
+		delete [] m_pResidentData[m_aResidentEntries[i]].pData.load(std::memory_order_relaxed);
+	}
+
+	m_aSubCellEntries.clear();
+	m_pResidentData.reset();
+
+	m_aResidentEntries.clear();
+	m_clockHand = 0;
+	m_residentMemorySize = 0;
+
+	m_subCellSize = 0;
+	m_cellCountX = 0;
+	m_cellCountY = 0;
+	m_cellCountZ = 0;
+
+	m_frame = 0;
+	m_referenceFrame = 0;
+	m_pReferenceReader = NULL;
+}
+
+void IVVReader::setResidentMemoryLimit(size_t memoryLimit)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_residentMemoryLimit = memoryLimit;
+
+	evictSubCells(0);
+}
+
+bool IVVReader::setReferenceReader(IVVReader* pReferenceReader)
+{
+	if (pReferenceReader && (!pReferenceReader->m_isSparse || pReferenceReader->m_resX != m_resX || pReferenceReader->m_resY != m_resY ||
+							 pReferenceReader->m_resZ != m_resZ || pReferenceReader->m_numComponents != m_numComponents ||
+							 pReferenceReader->m_subCellSize != m_subCellSize))
+	{
+		fprintf(stderr, "IVV reference frame doesn't match.\n");
+		return false;
+	}
+
+	m_pReferenceReader = pReferenceReader;
+
+	return true;
+}
+
+float IVVReader::getVoxelValue(unsigned int i, unsigned int j, unsigned int k, unsigned int component)
+{
+	if (!m_pData || i >= m_resX || j >= m_resY || k >= m_resZ || component >= m_numComponents)
+		return 0.0f;
+
+	if (!m_isSparse)
+		return getDenseVoxelValue(i, j, k);
+
+	uint64_t cellIndex = (uint64_t)(i / m_subCellSize) + (uint64_t)(j / m_subCellSize) * m_cellCountX +
+						 (uint64_t)(k / m_subCellSize) * m_cellCountX * m_cellCountY;
+
+	size_t entryIndex = 0;
+	if (!findSubCellEntry(cellIndex, entryIndex))
+		return 0.0f;
+
+	const SubCellEntry& entry = m_aSubCellEntries[entryIndex];
+
+	if (entry.encoding == eIVVSubCellReference)
+		return m_pReferenceReader ? m_pReferenceReader->getVoxelValue(i, j, k, component) : 0.0f;
+
+	ResidentData& resident = m_pResidentData[entryIndex];
+
+	// the usual case of the subcell already being resident doesn't lock anything - the subcell's pinned
+	// while its data's being read, so it can't be evicted until we're done with it
+	resident.numReaders.fetch_add(1);
+	const unsigned char* pResidentData = resident.pData.load();
+
+	if (pResidentData)
+	{
+		float value = getResidentVoxelValue(entry, pResidentData, i, j, k, component);
+		resident.numReaders.fetch_sub(1, std::memory_order_release);
+
+		// only written if it's changed, so lookups of the same subcell don't fight over the cache line
+		if (!resident.referenced.load(std::memory_order_relaxed))
+		{
+			resident.referenced.store(true, std::memory_order_relaxed);
+		}
+
+		return value;
+	}
+
+	resident.numReaders.fetch_sub(1, std::memory_order_release);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	// another thread might have paged it in while we were waiting, and nothing can evict it while we've got the lock
+	pResidentData = resident.pData.load(std::memory_order_relaxed);
+	if (!pResidentData)
+	{
+		if (!pageInSubCell(entryIndex))
+			return 0.0f;
+
+		pResidentData = resident.pData.load(std::memory_order_relaxed);
+	}
+
+	return getResidentVoxelValue(entry, pResidentData, i, j, k, component);
+}
+
+bool IVVReader::readHeader(const std::string& channelName)
+{
+	uint64_t pos = 0;
+
+	unsigned char gridType = 0;
+	if (!readValue(pos, m_version) || !readValue(pos, m_dataType) || !readValue(pos, gridType))
+		return false;
+
+	if (m_version != eIVVVersionOriginal && m_version != eIVVVersionExtended)
+		return false;
+
+	m_isSparse = (gridType == eIVVGridSparse);
+
+	uint16_t subCellSize = 0;
+	if (m_isSparse && !readValue(pos, subCellSize))
+		return false;
+
+	if (!readValue(pos, m_resX) || !readValue(pos, m_resY) || !readValue(pos, m_resZ) ||
+		!readBytes(pos, m_bbox, sizeof(float) * 6))
+		return false;
+
+	m_formatFlags = 0;
+
+	if (m_version == eIVVVersionExtended)
+	{
+		uint32_t flags = 0;
+		if (!readValue(pos, flags))
+			return false;
+
+		m_formatFlags = flags;
+
+		const unsigned int kSupportedFlags = eIVVFlagCompressed | eIVVFlagQuantized | eIVVFlagConstantSubCells |
+											 eIVVFlagMipLevels | eIVVFlagMortonOrder | eIVVFlagSubCellIndex |
+											 eIVVFlagMultiChannel | eIVVFlagVectorValues | eIVVFlagMaskedSubCells |
+											 eIVVFlagTemporalDelta | eIVVFlagFrameOffset;
+
+		if (m_formatFlags & ~kSupportedFlags)
+		{
+			fprintf(stderr, "Unsupported IVV format flags: %x\n", m_formatFlags & ~kSupportedFlags);
+			return false;
+		}
+
+		if (m_formatFlags & eIVVFlagCompressed)
+		{
+			if (!readValue(pos, m_codec) || !readValue(pos, m_filter))
+				return false;
+
+			if (!isCodecAvailable(m_codec))
+			{
+				fprintf(stderr, "IVV compression codec: %u is not available in this build.\n", (unsigned int)m_codec);
+				return false;
+			}
+		}
+
+		if (m_formatFlags & eIVVFlagMipLevels)
+		{
+			// we only read the full-res level, so just skip the level offsets
+			unsigned char numMipLevels = 0;
+			unsigned char mipFilter = 0;
+			if (!readValue(pos, numMipLevels) || !readValue(pos, mipFilter))
+				return false;
+
+			pos += numMipLevels * sizeof(uint64_t);
+		}
+
+		if (m_formatFlags & eIVVFlagMultiChannel)
+		{
+			unsigned char numChannels = 0;
+			if (!readValue(pos, numChannels) || numChannels == 0)
+				return false;
+
+			for (unsigned int i = 0; i < numChannels; i++)
+			{
+				unsigned char nameLength = 0;
+				char name[256];
+				if (!readValue(pos, nameLength) || !readBytes(pos, name, nameLength))
+					return false;
+
+				m_aChannelNames.push_back(std::string(name, nameLength));
+
+				if (m_aChannelNames.back() == channelName)
+					m_channelIndex = i;
+			}
+		}
+
+		if (m_formatFlags & eIVVFlagVectorValues)
+		{
+			// vector grids are always sparse
+			if (!m_isSparse)
+				return false;
+
+			unsigned int numChannels = std::max((unsigned int)m_aChannelNames.size(), 1u);
+
+			for (unsigned int i = 0; i < numChannels; i++)
+			{
+				unsigned char numComponents = 0;
+				if (!readValue(pos, numComponents) || numComponents == 0)
+					return false;
+
+				m_aChannelComponents.push_back(numComponents);
+			}
+		}
+
+		if (m_formatFlags & eIVVFlagTemporalDelta)
+		{
+			if (!m_isSparse || !readValue(pos, m_frame) || !readValue(pos, m_referenceFrame))
+				return false;
+		}
+	}
+
+	m_frameOffset[0] = m_frameOffset[1] = m_frameOffset[2] = 0;
+	m_sequenceRes[0] = m_resX;
+	m_sequenceRes[1] = m_resY;
+	m_sequenceRes[2] = m_resZ;
+
+	if (m_formatFlags & eIVVFlagFrameOffset)
+	{
+		if (!readBytes(pos, m_frameOffset, sizeof(int32_t) * 3) || !readBytes(pos, m_sequenceRes, sizeof(uint32_t) * 3))
+			return false;
+	}
+
+	if (m_aChannelComponents.empty())
+	{
+		m_aChannelComponents.resize(std::max((unsigned int)m_aChannelNames.size(), 1u), 1);
+	}
+
+	if (!channelName.empty() && (m_aChannelNames.empty() || m_aChannelNames[m_channelIndex] != channelName))
+	{
+		fprintf(stderr, "Couldn't find IVV channel: %s\n", channelName.c_str());
+		return false;
+	}
+
+	m_quantizeBits = 0;
+	if (m_dataType == eIVVDataUInt8)
+		m_quantizeBits = 8;
+	else if (m_dataType == eIVVDataUInt16)
+		m_quantizeBits = 16;
+	else if (m_dataType != eIVVDataFloat && m_dataType != eIVVDataHalf)
+		return false;
+
+	m_valuesOffset = pos;
+
+	if (!m_isSparse)
+	{
+		size_t sliceSize = (size_t)m_resX * (size_t)m_resY * getFileValueSize();
+		if (m_quantizeBits != 0)
+			sliceSize += sizeof(float) * 2;
+
+		return m_valuesOffset + sliceSize * m_resZ <= m_fileSize;
+	}
+
+	if (subCellSize == 0)
+		return false;
+
+	m_numComponents = m_aChannelComponents[m_channelIndex];
+
+	m_subCellSize = subCellSize;
+	m_mortonOrder = (m_formatFlags & eIVVFlagMortonOrder) != 0;
+	m_cellCountX = (m_resX + m_subCellSize - 1) / m_subCellSize;
+	m_cellCountY = (m_resY + m_subCellSize - 1) / m_subCellSize;
+	m_cellCountZ = (m_resZ + m_subCellSize - 1) / m_subCellSize;
+
+	return true;
+}
+
+bool IVVReader::readSubCellTable()
+{
+	uint64_t pos = m_valuesOffset;
+
+	uint64_t numSubCells = (uint64_t)m_cellCountX * (uint64_t)m_cellCountY * (uint64_t)m_cellCountZ;
+	SubCellOrder order(m_mortonOrder, m_cellCountX, m_cellCountY, m_cellCountZ);
+
+	size_t valueSize = getFileValueSize();
+
+	// we have to go through the batches of 8 subcells in order to find where each one's data is,
+	// but we don't need to read any of the data itself
+	for (uint64_t layoutIndex = 0; layoutIndex < numSubCells; layoutIndex += 8)
+	{
+		unsigned char subCellStateFlags = 0;
+		if (!readValue(pos, subCellStateFlags))
+			return false;
+
+		unsigned int batchSize = (unsigned int)std::min(numSubCells - layoutIndex, (uint64_t)8);
+
+		for (unsigned int batchIndex = 0; batchIndex < batchSize; batchIndex++)
+		{
+			unsigned int cellI = 0;
+			unsigned int cellJ = 0;
+			unsigned int cellK = 0;
+			order.next(cellI, cellJ, cellK);
+
+			if (!(subCellStateFlags & (1 << batchIndex)))
+				continue;
+
+			unsigned int resX = 0;
+			unsigned int resY = 0;
+			unsigned int resZ = 0;
+			getSubCellRes(cellI, cellJ, cellK, resX, resY, resZ);
+			size_t numVoxels = (size_t)resX * (size_t)resY * (size_t)resZ;
+
+			SubCellEntry entry;
+
+			if (m_version == eIVVVersionOriginal)
+			{
+				entry.encoding = eIVVSubCellRaw;
+				entry.dataSize = (uint32_t)(numVoxels * valueSize);
+				entry.offset = pos;
+
+				pos += entry.dataSize;
+				if (pos > m_fileSize)
+					return false;
+			}
+			else
+			{
+				// multi-channel files have the data for each channel in turn
+				unsigned int numChannels = std::max((unsigned int)m_aChannelNames.size(), 1u);
+
+				for (unsigned int channel = 0; channel < numChannels; channel++)
+				{
+					SubCellEntry channelEntry;
+					if (!readSubCellRecord(pos, numVoxels, m_aChannelComponents[channel], channelEntry))
+						return false;
+
+					if (channel == m_channelIndex)
+						entry = channelEntry;
+				}
+			}
+
+			entry.cellIndex = (uint64_t)cellI + (uint64_t)cellJ * m_cellCountX + (uint64_t)cellK * m_cellCountX * m_cellCountY;
+			m_aSubCellEntries.push_back(entry);
+		}
+	}
+
+	initResidentData();
+
+	return true;
+}
+
+bool IVVReader::readSubCellRecord(uint64_t& pos, size_t numVoxels, unsigned int numComponents, SubCellEntry& entry) const
+{
+	// the size of all the components of a voxel
+	size_t voxelDataSize = getFileValueSize() * numComponents;
+
+	if (!readValue(pos, entry.encoding))
+		return false;
+
+	if (m_quantizeBits != 0 && (!readValue(pos, entry.quantizeOffset) || !readValue(pos, entry.quantizeScale)))
+		return false;
+
+	if (entry.encoding == eIVVSubCellCompressed || entry.encoding == eIVVSubCellMasked)
+	{
+		if (!readValue(pos, entry.dataSize))
+			return false;
+	}
+	else if (entry.encoding == eIVVSubCellConstant)
+	{
+		entry.dataSize = (uint32_t)voxelDataSize;
+	}
+	else if (entry.encoding == eIVVSubCellReference)
+	{
+		entry.dataSize = 0;
+	}
+	else
+	{
+		entry.dataSize = (uint32_t)(numVoxels * voxelDataSize);
+	}
+
+	entry.offset = pos;
+	pos += entry.dataSize;
+
+	return pos <= m_fileSize;
+}
+
+bool IVVReader::readSubCellIndex()
+{
+	uint64_t pos = m_valuesOffset;
+
+	uint64_t numSubCells = (uint64_t)m_cellCountX * (uint64_t)m_cellCountY * (uint64_t)m_cellCountZ;
+	uint64_t occupancySize = (numSubCells + 7) / 8;
+
+	if (pos + occupancySize > m_fileSize)
+		return false;
+
+	SubCellOrder order(m_mortonOrder, m_cellCountX, m_cellCountY, m_cellCountZ);
+
+	for (uint64_t layoutIndex = 0; layoutIndex < numSubCells; layoutIndex++)
+	{
+		unsigned int cellI = 0;
+		unsigned int cellJ = 0;
+		unsigned int cellK = 0;
+		order.next(cellI, cellJ, cellK);
+
+		if (m_pData[pos + layoutIndex / 8] & (1 << (layoutIndex % 8)))
+		{
+			SubCellEntry entry;
+			entry.cellIndex = (uint64_t)cellI + (uint64_t)cellJ * m_cellCountX + (uint64_t)cellK * m_cellCountX * m_cellCountY;
+			m_aSubCellEntries.push_back(entry);
+		}
+	}
+
+	pos += occupancySize;
+
+	for (size_t i = 0; i < m_aSubCellEntries.size(); i++)
+	{
+		if (!readValue(pos, m_aSubCellEntries[i].offset))
+			return false;
+	}
+
+	for (size_t i = 0; i < m_aSubCellEntries.size(); i++)
+	{
+		SubCellEntry& entry = m_aSubCellEntries[i];
+
+		if (!readValue(pos, entry.encoding) || !readValue(pos, entry.dataSize))
+			return false;
+
+		if (m_quantizeBits != 0 && (!readValue(pos, entry.quantizeOffset) || !readValue(pos, entry.quantizeScale)))
+			return false;
+
+		if (entry.offset + entry.dataSize > m_fileSize)
+			return false;
+	}
+
+	initResidentData();
+
+	return true;
+}
+
+void IVVReader::initResidentData()
+{
+	// the entries are read in the order of the layout
+	if (m_mortonOrder)
+	{
+		std::sort(m_aSubCellEntries.begin(), m_aSubCellEntries.end(), [](const SubCellEntry& a, const SubCellEntry& b)
+		{
+			return a.cellIndex < b.cellIndex;
+		});
+	}
+
+	m_pResidentData.reset(new ResidentData[m_aSubCellEntries.size()]);
+}
+
+bool IVVReader::findSubCellEntry(uint64_t cellIndex, size_t& entryIndex) const
+{
+	std::vector<SubCellEntry>::const_iterator itEntry = std::lower_bound(m_aSubCellEntries.begin(), m_aSubCellEntries.end(), cellIndex,
+																		 [](const SubCellEntry& entry, uint64_t index)
+	{
+		return entry.cellIndex < index;
+	});
+
+	if (itEntry == m_aSubCellEntries.end() || itEntry->cellIndex != cellIndex)
+		return false;
+
+	entryIndex = itEntry - m_aSubCellEntries.begin();
+	return true;
+}
+
+void IVVReader::getSubCellRes(unsigned int cellI, unsigned int cellJ, unsigned int cellK, unsigned int& resX, unsigned int& resY,
+							  unsigned int& resZ) const
+{
+	resX = std::min(m_subCellSize, m_resX - cellI * m_subCellSize);
+	resY = std::min(m_subCellSize, m_resY - cellJ * m_subCellSize);
+	resZ = std::min(m_subCellSize, m_resZ - cellK * m_subCellSize);
+}
+
+bool IVVReader::pageInSubCell(size_t entryIndex)
+{
+	const SubCellEntry& entry = m_aSubCellEntries[entryIndex];
+
+	unsigned int cellI = (unsigned int)(entry.cellIndex % m_cellCountX);
+	unsigned int cellJ = (unsigned int)((entry.cellIndex / m_cellCountX) % m_cellCountY);
+	unsigned int cellK = (unsigned int)(entry.cellIndex / ((uint64_t)m_cellCountX * m_cellCountY));
+
+	unsigned int resX = 0;
+	unsigned int resY = 0;
+	unsigned int resZ = 0;
+	getSubCellRes(cellI, cellJ, cellK, resX, resY, resZ);
+	size_t numVoxels = (size_t)resX * (size_t)resY * (size_t)resZ;
+
+	size_t memorySize = getResidentSubCellSize(entryIndex);
+
+	evictSubCells(memorySize);
+
+	std::unique_ptr<unsigned char[]> pResidentData(new unsigned char[memorySize]);
+
+	bool result = true;
+
+	if (entry.encoding == eIVVSubCellMasked)
+	{
+		size_t maskSize = getMaskWordCount(numVoxels) * sizeof(uint64_t);
+
+		result = entry.dataSize >= maskSize;
+
+		if (result)
+		{
+			uint32_t* pRanks = (uint32_t*)pResidentData.get();
+			buildMaskRanks(m_pData + entry.offset, numVoxels, pRanks);
+
+			// the values of the set voxels need to be exactly what's left
+			size_t numSet = pRanks[getMaskWordCount(numVoxels)];
+			result = (maskSize + numSet * getFileValueSize() * m_numComponents == entry.dataSize);
+		}
+	}
+	else
+	{
+		result = decodeSubCell(entry, numVoxels * m_numComponents, pResidentData.get());
+	}
+
+	if (!result)
+	{
+		fprintf(stderr, "Couldn't decode IVV subcell: %llu\n", (unsigned long long)entry.cellIndex);
+		return false;
+	}
+
+	ResidentData& resident = m_pResidentData[entryIndex];
+	resident.referenced.store(true, std::memory_order_relaxed);
+	resident.pData.store(pResidentData.release());
+
+	m_aResidentEntries.push_back(entryIndex);
+	m_residentMemorySize += memorySize;
+
+	return true;
+}
+
+bool IVVReader::decodeSubCell(const SubCellEntry& entry, size_t numValues, unsigned char* pDst) const
+{
+	size_t valueSize = getFileValueSize();
+	size_t rawSize = numValues * valueSize;
+
+	const unsigned char* pValues = m_pData + entry.offset;
+
+	if (entry.encoding == eIVVSubCellConstant)
+	{
+		// there's a value for each component, which is the same for all the voxels
+		size_t numVoxels = numValues / m_numComponents;
+
+		if (m_quantizeBits != 0)
+		{
+			float values[256];
+			dequantizeValues(pValues, m_numComponents, m_quantizeBits, entry.quantizeOffset, entry.quantizeScale, values);
+
+			for (size_t i = 0; i < numVoxels; i++)
+			{
+				memcpy((float*)pDst + i * m_numComponents, values, sizeof(float) * m_numComponents);
+			}
+		}
+		else
+		{
+			size_t voxelDataSize = valueSize * m_numComponents;
+
+			for (size_t i = 0; i < numVoxels; i++)
+			{
+				memcpy(pDst + i * voxelDataSize, pValues, voxelDataSize);
+			}
+		}
+
+		return true;
+	}
+
+	// quantized values are decoded to floats
+	if (entry.encoding == eIVVSubCellCompressed && m_quantizeBits == 0)
+		return decompressSubCellData(m_codec, m_filter, pValues, entry.dataSize, pDst, rawSize, valueSize);
+
+	std::vector<unsigned char> decompressedData;
+
+	if (entry.encoding == eIVVSubCellCompressed)
+	{
+		decompressedData.resize(rawSize);
+		if (!decompressSubCellData(m_codec, m_filter, pValues, entry.dataSize, &decompressedData[0], rawSize, valueSize))
+			return false;
+
+		pValues = &decompressedData[0];
+	}
+	else if (entry.encoding != eIVVSubCellRaw || entry.dataSize != rawSize)
+	{
+		return false;
+	}
+
+	if (m_quantizeBits != 0)
+	{
+		dequantizeValues(pValues, numValues, m_quantizeBits, entry.quantizeOffset, entry.quantizeScale, (float*)pDst);
+	}
+	else
+	{
+		memcpy(pDst, pValues, rawSize);
+	}
+
+	return true;
+}
+
+void IVVReader::evictSubCells(size_t requiredSize)
+{
+	if (m_residentMemoryLimit == 0)
+		return;
+
+	// a clock - the hand goes round the resident subcells, and ones which have been used since it last
+	// passed them get another chance. If they're all being used, the hand just takes the next one.
+	size_t numPassed = 0;
+
+	while (!m_aResidentEntries.empty() && m_residentMemorySize + requiredSize > m_residentMemoryLimit)
+	{
+		if (m_clockHand >= m_aResidentEntries.size())
+			m_clockHand = 0;
+
+		size_t entryIndex = m_aResidentEntries[m_clockHand];
+
+		if (numPassed < m_aResidentEntries.size() && m_pResidentData[entryIndex].referenced.exchange(false, std::memory_order_relaxed))
+		{
+			m_clockHand++;
+			numPassed++;
+			continue;
+		}
+
+		freeResidentData(entryIndex);
+
+		// the last one takes its place, and is the next one the hand looks at
+		m_aResidentEntries[m_clockHand] = m_aResidentEntries.back();
+		m_aResidentEntries.pop_back();
+		numPassed = 0;
+	}
+}
+
+void IVVReader::freeResidentData(size_t entryIndex)
+{
+	ResidentData& resident = m_pResidentData[entryIndex];
+
+	// lookups which got the data before it was taken away have it pinned, and only hold it for one voxel
+	unsigned char* pResidentData = resident.pData.exchange(NULL);
+
+	while (resident.numReaders.load() != 0)
+	{
+		std::this_thread::yield();
+	}
+
+	delete [] pResidentData;
+
+	m_residentMemorySize -= getResidentSubCellSize(entryIndex);
+}
+
+size_t IVVReader::getResidentSubCellSize(size_t entryIndex) const
+{
+	const SubCellEntry& entry = m_aSubCellEntries[entryIndex];
+
+	unsigned int cellI = (unsigned int)(entry.cellIndex % m_cellCountX);
+	unsigned int cellJ = (unsigned int)((entry.cellIndex / m_cellCountX) % m_cellCountY);
+	unsigned int cellK = (unsigned int)(entry.cellIndex / ((uint64_t)m_cellCountX * m_cellCountY));
+
+	unsigned int resX = 0;
+	unsigned int resY = 0;
+	unsigned int resZ = 0;
+	getSubCellRes(cellI, cellJ, cellK, resX, resY, resZ);
+	size_t numVoxels = (size_t)resX * (size_t)resY * (size_t)resZ;
+
+	if (entry.encoding == eIVVSubCellMasked)
+	{
+		return (getMaskWordCount(numVoxels) + 1) * sizeof(uint32_t);
+	}
+
+	// quantized values are decoded to floats
+	return numVoxels * m_numComponents * ((m_dataType == eIVVDataHalf) ? sizeof(half) : sizeof(float));
+}
+
+float IVVReader::getResidentVoxelValue(const SubCellEntry& entry, const unsigned char* pResidentData, unsigned int i,
+									   unsigned int j, unsigned int k, unsigned int component) const
+{
+	unsigned int resX = 0;
+	unsigned int resY = 0;
+	unsigned int resZ = 0;
+	getSubCellRes(i / m_subCellSize, j / m_subCellSize, k / m_subCellSize, resX, resY, resZ);
+
+	size_t voxelIndex = (i % m_subCellSize) + (j % m_subCellSize) * resX + (k % m_subCellSize) * (size_t)resX * resY;
+
+	if (entry.encoding != eIVVSubCellMasked)
+	{
+		size_t valueIndex = voxelIndex * m_numComponents + component;
+
+		if (m_dataType == eIVVDataHalf)
+			return ((const half*)pResidentData)[valueIndex];
+
+		return ((const float*)pResidentData)[valueIndex];
+	}
+
+	size_t numVoxels = (size_t)resX * (size_t)resY * (size_t)resZ;
+
+	const unsigned char* pMask = m_pData + entry.offset;
+
+	size_t valueIndex = 0;
+	if (!getMaskedValueIndex(pMask, (const uint32_t*)pResidentData, voxelIndex, valueIndex))
+		return 0.0f;
+
+	size_t valueSize = getFileValueSize();
+	const unsigned char* pValue = pMask + getMaskWordCount(numVoxels) * sizeof(uint64_t) +
+									(valueIndex * m_numComponents + component) * valueSize;
+
+	float value = 0.0f;
+
+	if (m_quantizeBits != 0)
+	{
+		dequantizeValues(pValue, 1, m_quantizeBits, entry.quantizeOffset, entry.quantizeScale, &value);
+	}
+	else if (m_dataType == eIVVDataHalf)
+	{
+		half halfValue;
+		memcpy(&halfValue, pValue, sizeof(half));
+		value = halfValue;
+	}
+	else
+	{
+		memcpy(&value, pValue, sizeof(float));
+	}
+
+	return value;
+}
+
+float IVVReader::getDenseVoxelValue(unsigned int i, unsigned int j, unsigned int k) const
+{
+	size_t valueSize = getFileValueSize();
+	size_t sliceNumValues = (size_t)m_resX * (size_t)m_resY;
+	size_t sliceIndex = (size_t)i + (size_t)j * m_resX;
+
+	if (m_quantizeBits != 0)
+	{
+		// each slice has its own offset and scale
+		const unsigned char* pSlice = m_pData + m_valuesOffset + (size_t)k * (sliceNumValues * valueSize + sizeof(float) * 2);
+
+		float offset;
+		float scale;
+		memcpy(&offset, pSlice, sizeof(float));
+		memcpy(&scale, pSlice + sizeof(float), sizeof(float));
+
+		float value = 0.0f;
+		dequantizeValues(pSlice + sizeof(float) * 2 + sliceIndex * valueSize, 1, m_quantizeBits, offset, scale, &value);
+
+		return value;
+	}
+
+	const unsigned char* pValue = m_pData + m_valuesOffset + ((size_t)k * sliceNumValues + sliceIndex) * valueSize;
+
+	if (m_dataType == eIVVDataHalf)
+	{
+		half value;
+		memcpy(&value, pValue, sizeof(half));
+		return value;
+	}
+
+	float value;
+	memcpy(&value, pValue, sizeof(float));
+	return value;
+}
+
+bool IVVReader::readBytes(uint64_t& pos, void* pDst, size_t size) const
+{
+	if (pos + size > m_fileSize)
+		return false;
+
+	memcpy(pDst, m_pData + pos, size);
+	pos += size;
+
+	return true;
+}
+
+size_t IVVReader::getFileValueSize() const
+{
+	switch (m_dataType)
+	{
+		case eIVVDataHalf:
+			return sizeof(half);
+		case eIVVDataUInt8:
+			return sizeof(uint8_t);
+		case eIVVDataUInt16:
+			return sizeof(uint16_t);
+		case eIVVDataFloat:
+		default:
+			return sizeof(float);
+	}
+}
@@ -0,0 +1,215 @@
+/*
+ vdbconv
+ Copyright 2014-2017 Peter Pearson.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ You may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ ---------
+*/
+
+#ifndef IVV_READER_H
+#define IVV_READER_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+#include <stdint.h>
+
+#include "ivv_format.h"
+
+// reads IVV files by memory-mapping them, so opening a file only needs to parse the header and the
+// sparse subcell table, and only the subcells which are in the file have an entry. Sparse subcells are
+// decoded on first access, and if there's a resident memory limit, subcells which haven't been used
+// recently are freed again to stay within it. Masked subcells are the exception, as they're read from
+// the mapping with just a small table to index them, which is built when they're paged in.
+// Dense grids are read directly from the mapping, so the OS pages them in as they're accessed.
+// Only the full-res level of mip-mapped files is read. Reference subcells in temporal delta files are
+// looked up in the reader for the reference frame, which needs to be opened separately and set.
+// Lookups can be done from multiple threads - those of resident subcells don't lock anything, and
+// just paging subcells in and out is serialised with a mutex.
+class IVVReader
+{
+public:
+	IVVReader();
+	~IVVReader();
+
+	// for multi-channel files, channelName is the channel to read - by default, the first one
+	bool open(const std::string& path, const std::string& channelName = "");
+	void close();
+
+	// empty for single-channel files
+	const std::vector<std::string>& getChannelNames() const { return m_aChannelNames; }
+
+	// the max memory for decoded sparse subcells - 0 means no limit
+	void setResidentMemoryLimit(size_t memoryLimit);
+
+	unsigned int getResX() const { return m_resX; }
+	unsigned int getResY() const { return m_resY; }
+	unsigned int getResZ() const { return m_resZ; }
+
+	bool isSparse() const { return m_isSparse; }
+	// 3 for vector grids
+	unsigned int getNumComponents() const { return m_numComponents; }
+
+	// bbox min x, y, z, then max x, y, z
+	const float* getBBox() const { return m_bbox; }
+
+	// for frames of sequences converted with per-frame bounds, the voxel offset of the grid within the sequence's
+	// bounds, and the resolution of those. Otherwise, there's no offset, and it's the same as the grid's resolution.
+	const int* getFrameOffset() const { return m_frameOffset; }
+	const unsigned int* getSequenceRes() const { return m_sequenceRes; }
+
+	float getVoxelValue(unsigned int i, unsigned int j, unsigned int k, unsigned int component = 0);
+
+	// the memory used by the decoded sparse subcells
+	size_t getResidentMemorySize() const { return m_residentMemorySize.load(std::memory_order_relaxed); }
+
+	// for temporal delta files from sequences, if it's not a keyframe its reference subcells are in the reference
+	// frame's file, which needs to be opened (along with any it refers to in turn) and set as the reference reader.
+	// Until it is, they're zero.
+	bool hasReferenceFrame() const { return (m_formatFlags & eIVVFlagTemporalDelta) && m_referenceFrame != m_frame; }
+	unsigned int getFrame() const { return m_frame; }
+	unsigned int getReferenceFrame() const { return m_referenceFrame; }
+	// the reader's not owned, and must have the same resolution and subcell size
+	bool setReferenceReader(IVVReader* pReferenceReader);
+
+protected:
+	// where each allocated subcell's payload is within the file, and how it's stored
+	struct SubCellEntry
+	{
+		SubCellEntry() : cellIndex(0), offset(0), dataSize(0), encoding(0), quantizeOffset(0.0f), quantizeScale(0.0f)
+		{
+		}
+
+		// the linear index of the subcell (i, then j, then k), which the entries are sorted by
+		uint64_t		cellIndex;
+		uint64_t		offset;
+		uint32_t		dataSize;
+		unsigned char	encoding;
+		float			quantizeOffset;
+		float			quantizeScale;
+	};
+
+	// the decoded data of a subcell while it's resident - its values (floats, or halfs for half files) or, for masked
+	// subcells, the counts of the set bits before each mask word, so their values can be found in the mapping.
+	// Lookups pin the subcell while they use the data, so it can't be freed from under them.
+	struct ResidentData
+	{
+		ResidentData() : pData(NULL), numReaders(0), referenced(false)
+		{
+		}
+
+		std::atomic<unsigned char*>	pData;
+		std::atomic<uint32_t>		numReaders;
+		// whether it's been used since the eviction last looked at it
+		std::atomic<bool>			referenced;
+	};
+
+	bool readHeader(const std::string& channelName);
+	bool readSubCellTable();
+	bool readSubCellIndex();
+	// reads the encoding etc of an allocated subcell's data in the extended format, leaving pos at the end of it
+	// numComponents is the channel's, which might not be the same as the one we're reading
+	bool readSubCellRecord(uint64_t& pos, size_t numVoxels, unsigned int numComponents, SubCellEntry& entry) const;
+	// allocates the resident data for the entries once they've all been read
+	void initResidentData();
+
+	// the index within m_aSubCellEntries of the subcell with this linear index, if it's in the file
+	bool findSubCellEntry(uint64_t cellIndex, size_t& entryIndex) const;
+
+	// the resolution of the subcell with these subcell indices - the ones at the edges can be smaller
+	void getSubCellRes(unsigned int cellI, unsigned int cellJ, unsigned int cellK, unsigned int& resX, unsigned int& resY,
+					   unsigned int& resZ) const;
+
+	// these need the mutex to be locked
+	bool pageInSubCell(size_t entryIndex);
+	bool decodeSubCell(const SubCellEntry& entry, size_t numValues, unsigned char* pDst) const;
+	void evictSubCells(size_t requiredSize);
+	void freeResidentData(size_t entryIndex);
+
+	// the memory used by a subcell while it's resident
+	size_t getResidentSubCellSize(size_t entryIndex) const;
+
+	float getResidentVoxelValue(const SubCellEntry& entry, const unsigned char* pResidentData, unsigned int i, unsigned int j,
+								unsigned int k, unsigned int component) const;
+
+	float getDenseVoxelValue(unsigned int i, unsigned int j, unsigned int k) const;
+
+	// bounds-checked reads from the mapping, which advance pos
+	bool readBytes(uint64_t& pos, void* pDst, size_t size) const;
+
+	template <typename T>
+	bool readValue(uint64_t& pos, T& value) const
+	{
+		return readBytes(pos, &value, sizeof(T));
+	}
+
+	size_t getFileValueSize() const;
+
+protected:
+	const unsigned char*	m_pData;
+	size_t					m_fileSize;
+
+	unsigned char			m_version;
+	unsigned char			m_dataType;
+	unsigned int			m_formatFlags;
+	unsigned char			m_codec;
+	unsigned char			m_filter;
+	unsigned int			m_quantizeBits;
+
+	std::vector<std::string>	m_aChannelNames;
+	unsigned int			m_channelIndex;
+	// the number of components of each channel (just one entry for single-channel files)
+	std::vector<unsigned int>	m_aChannelComponents;
+	unsigned int			m_numComponents;
+
+	unsigned int			m_resX;
+	unsigned int			m_resY;
+	unsigned int			m_resZ;
+	float					m_bbox[6];
+
+	int						m_frameOffset[3];
+	unsigned int			m_sequenceRes[3];
+
+	bool					m_isSparse;
+	// where the voxel values start, after the header
+	uint64_t				m_valuesOffset;
+
+	unsigned int			m_subCellSize;
+	bool					m_mortonOrder;
+	unsigned int			m_cellCountX;
+	unsigned int			m_cellCountY;
+	unsigned int			m_cellCountZ;
+
+	// just the subcells which are in the file, sorted by cell index
+	std::vector<SubCellEntry>	m_aSubCellEntries;
+	// one for each entry
+	std::unique_ptr<ResidentData[]>	m_pResidentData;
+
+	// the entries which are resident, and the position of the eviction's clock hand within them
+	std::vector<size_t>		m_aResidentEntries;
+	size_t					m_clockHand;
+
+	size_t					m_residentMemoryLimit;
+	std::atomic<size_t>		m_residentMemorySize;
+
+	unsigned int			m_frame;
+	unsigned int			m_referenceFrame;
+	IVVReader*				m_pReferenceReader;
+
+	std::mutex				m_mutex;
+};
+
+#endif // IVV_READER_H
@@ -17,9 +17,12 @@
 */
 
 #include <string>
+#include <algorithm>
 #include <stdio.h>
 
+#include "conversion_stats.h"
 #include "vdb_converter.h"
+#include "subcell_codec.h"
 
 int main(int argc, char** argv)
 {
@@ -41,6 +44,21 @@ int main(int argc, char** argv)
 
 	unsigned int numOptionArgs = (argc - 1) - 2;
 
+	unsigned char compressionCodec = eIVVCodecNone;
+	unsigned char compressionFilter = eIVVFilterNone;
+
+	unsigned int mipLevels = 0;
+	unsigned char mipFilter = eIVVMipFilterBox;
+
+	unsigned int resampleFactor = 1;
+	unsigned char resampleFilter = eIVVMipFilterBox;
+
+	bool temporalDelta = false;
+	float temporalTolerance = 0.0f;
+	unsigned int keyframeInterval = 10;
+
+	std::string statsPath;
+
 	if (!printHelp)
 	{
 		for (unsigned int i = 0; i < numOptionArgs; i++)
@@ -63,6 +81,21 @@ int main(int argc, char** argv)
 			{
 				converter.setStoreAsHalf(true);
 			}
+			else if (argName == "quantize" && numOptionArgs > i + 1)
+			{
+				std::string strQuantizeValue = argv[i + 1 + 1];
+				unsigned int quantizeBits = atoi(strQuantizeValue.c_str());
+				if (quantizeBits == 8 || quantizeBits == 16)
+				{
+					converter.setQuantizeBits(quantizeBits);
+				}
+				else
+				{
+					printHelp = true;
+					fprintf(stderr, "Invalid quantization bits: %s\n", strQuantizeValue.c_str());
+				}
+				argOffset += 1;
+			}
 			else if (argName == "valMul" && numOptionArgs > i + 1)
 			{
 				std::string strValMultValue = argv[i + 1 + 1];
@@ -87,6 +120,53 @@ int main(int argc, char** argv)
 			{
 				sequence = true;
 			}
+			else if (argName == "frames" && numOptionArgs > i + 1)
+			{
+				std::string strFramesValue = argv[i + 1 + 1];
+				unsigned int startFrame = 0;
+				unsigned int endFrame = 0;
+				if (sscanf(strFramesValue.c_str(), "%u-%u", &startFrame, &endFrame) == 2 && startFrame <= endFrame)
+				{
+					converter.setFrameRange(startFrame, endFrame);
+				}
+				else
+				{
+					printHelp = true;
+					fprintf(stderr, "Invalid frame range: %s\n", strFramesValue.c_str());
+				}
+				argOffset += 1;
+			}
+			else if (argName == "shard" && numOptionArgs > i + 1)
+			{
+				std::string strShardValue = argv[i + 1 + 1];
+				unsigned int shardIndex = 0;
+				unsigned int shardCount = 0;
+				if (sscanf(strShardValue.c_str(), "%u/%u", &shardIndex, &shardCount) == 2 && shardIndex < shardCount)
+				{
+					converter.setShard(shardIndex, shardCount);
+				}
+				else
+				{
+					printHelp = true;
+					fprintf(stderr, "Invalid shard: %s\n", strShardValue.c_str());
+				}
+				argOffset += 1;
+			}
+			else if (argName == "manifest" && numOptionArgs > i + 1)
+			{
+				std::string strManifestValue = argv[i + 1 + 1];
+				converter.setBoundsManifestPath(strManifestValue);
+				argOffset += 1;
+			}
+			else if (argName == "stats" && numOptionArgs > i + 1)
+			{
+				statsPath = argv[i + 1 + 1];
+				argOffset += 1;
+			}
+			else if (argName == "boundsOnly")
+			{
+				converter.setBoundsOnly(true);
+			}
 			else if (argName == "sparse")
 			{
 				converter.setUseSparseGrid(true);
@@ -94,17 +174,204 @@ int main(int argc, char** argv)
 			else if (argName == "cellSize" && numOptionArgs > i + 1)
 			{
 				std::string strCellSizeValue = argv[i + 1 + 1];
-				if (!strCellSizeValue.empty())
+				if (strCellSizeValue == "auto")
+				{
+					converter.setAutoSparseSubCellSize(true);
+					argOffset += 1;
+				}
+				else if (!strCellSizeValue.empty())
 				{
 					unsigned int cellSize = atoi(strCellSizeValue.c_str());
 					converter.setSparseSubCellSize(cellSize);
 					argOffset += 1;
 				}
 			}
+			else if (argName == "morton")
+			{
+				converter.setSparseSubCellLayout(SparseGrid::eSubCellLayoutMorton);
+			}
+			else if (argName == "activeCells")
+			{
+				converter.setSparseCellStorage(SparseGrid::eCellStorageActive);
+			}
+			else if (argName == "threads" && numOptionArgs > i + 1)
+			{
+				std::string strThreadsValue = argv[i + 1 + 1];
+				if (!strThreadsValue.empty())
+				{
+					unsigned int numThreads = atoi(strThreadsValue.c_str());
+					converter.setNumThreads(numThreads);
+					argOffset += 1;
+				}
+			}
+			else if (argName == "framesInFlight" && numOptionArgs > i + 1)
+			{
+				std::string strFramesValue = argv[i + 1 + 1];
+				if (!strFramesValue.empty())
+				{
+					unsigned int maxFrames = atoi(strFramesValue.c_str());
+					converter.setMaxFramesInFlight(maxFrames);
+					argOffset += 1;
+				}
+			}
+			else if (argName == "memLimit" && numOptionArgs > i + 1)
+			{
+				std::string strMemLimitValue = argv[i + 1 + 1];
+				if (!strMemLimitValue.empty())
+				{
+					size_t memLimitMB = atoi(strMemLimitValue.c_str());
+					converter.setMemoryLimit(memLimitMB * 1024 * 1024);
+					argOffset += 1;
+				}
+			}
+			else if (argName == "compress" && numOptionArgs > i + 1)
+			{
+				std::string strCodecValue = argv[i + 1 + 1];
+				if (strCodecValue == "lz4")
+				{
+					compressionCodec = eIVVCodecLZ4;
+				}
+				else if (strCodecValue == "none")
+				{
+					compressionCodec = eIVVCodecNone;
+				}
+				else
+				{
+					printHelp = true;
+					fprintf(stderr, "Unknown compression codec: %s\n", strCodecValue.c_str());
+				}
+
+				if (!isCodecAvailable(compressionCodec))
+				{
+					fprintf(stderr, "Compression codec: %s is not available in this build.\n", strCodecValue.c_str());
+					return -1;
+				}
+				argOffset += 1;
+			}
+			else if (argName == "mipLevels" && numOptionArgs > i + 1)
+			{
+				std::string strMipLevelsValue = argv[i + 1 + 1];
+				if (!strMipLevelsValue.empty())
+				{
+					mipLevels = atoi(strMipLevelsValue.c_str());
+					argOffset += 1;
+				}
+			}
+			else if (argName == "resample" && numOptionArgs > i + 1)
+			{
+				std::string strResampleValue = argv[i + 1 + 1];
+				if (!strResampleValue.empty())
+				{
+					resampleFactor = std::max(atoi(strResampleValue.c_str()), 1);
+					argOffset += 1;
+				}
+			}
+			else if (argName == "resampleFilter" && numOptionArgs > i + 1)
+			{
+				std::string strResampleFilterValue = argv[i + 1 + 1];
+				if (strResampleFilterValue == "box")
+				{
+					resampleFilter = eIVVMipFilterBox;
+				}
+				else if (strResampleFilterValue == "max")
+				{
+					resampleFilter = eIVVMipFilterMax;
+				}
+				else
+				{
+					printHelp = true;
+					fprintf(stderr, "Unknown resample filter: %s\n", strResampleFilterValue.c_str());
+				}
+				argOffset += 1;
+			}
+			else if (argName == "frameBounds")
+			{
+				converter.setPerFrameBounds(true);
+			}
+			else if (argName == "temporal" && numOptionArgs > i + 1)
+			{
+				std::string strToleranceValue = argv[i + 1 + 1];
+				if (!strToleranceValue.empty())
+				{
+					temporalDelta = true;
+					temporalTolerance = atof(strToleranceValue.c_str());
+					argOffset += 1;
+				}
+			}
+			else if (argName == "keyframes" && numOptionArgs > i + 1)
+			{
+				std::string strKeyframesValue = argv[i + 1 + 1];
+				if (!strKeyframesValue.empty())
+				{
+					keyframeInterval = std::max(atoi(strKeyframesValue.c_str()), 1);
+					argOffset += 1;
+				}
+			}
+			else if (argName == "mipFilter" && numOptionArgs > i + 1)
+			{
+				std::string strMipFilterValue = argv[i + 1 + 1];
+				if (strMipFilterValue == "box")
+				{
+					mipFilter = eIVVMipFilterBox;
+				}
+				else if (strMipFilterValue == "max")
+				{
+					mipFilter = eIVVMipFilterMax;
+				}
+				else
+				{
+					printHelp = true;
+					fprintf(stderr, "Unknown mip filter: %s\n", strMipFilterValue.c_str());
+				}
+				argOffset += 1;
+			}
+			else if (argName == "grid" && numOptionArgs > i + 1)
+			{
+				// <grid name>, or <grid name>=<channel name>
+				std::string strGridValue = argv[i + 1 + 1];
+				size_t equalsPos = strGridValue.find("=");
+				std::string gridName = strGridValue.substr(0, equalsPos);
+				std::string channelName = (equalsPos == std::string::npos) ? gridName : strGridValue.substr(equalsPos + 1);
+
+				if (!gridName.empty() && !channelName.empty())
+				{
+					converter.addGridMapping(gridName, channelName);
+				}
+				else
+				{
+					printHelp = true;
+					fprintf(stderr, "Invalid grid mapping: %s\n", strGridValue.c_str());
+				}
+				argOffset += 1;
+			}
+			else if (argName == "channels")
+			{
+				converter.setWriteMultiChannel(true);
+			}
+			else if (argName == "index")
+			{
+				converter.setWriteSubCellIndex(true);
+			}
+			else if (argName == "tiles")
+			{
+				converter.setCollapseConstantSubCells(true);
+			}
+			else if (argName == "mask")
+			{
+				converter.setMaskSubCells(true);
+			}
+			else if (argName == "shuffle")
+			{
+				compressionFilter = eIVVFilterByteShuffle;
+			}
 			else if (argName == "dense")
 			{
 				converter.setUseSparseGrid(false);
 			}
+			else if (argName == "stream")
+			{
+				converter.setStreamDenseGrids(true);
+			}
 			else
 			{
 				printHelp = true;
@@ -115,13 +382,45 @@ int main(int argc, char** argv)
 		}
 	}
 
+	converter.setCompression(compressionCodec, compressionFilter);
+	converter.setMipLevels(mipLevels, mipFilter);
+	converter.setResample(resampleFactor, resampleFilter);
+	converter.setTemporalDelta(temporalDelta, temporalTolerance, keyframeInterval);
+
 	if (printHelp)
 	{
 		fprintf(stderr, "OpenVDB to Imagine Voxel Volume converter, version 0.3.\n");
 		fprintf(stderr, "Usage: vdbconv [options] <source_vdb> <dest_ivv>\n");
+		fprintf(stderr, "    Options: -seq\t\t\t\tconvert a sequence, with # characters for the frame number\n");
+		fprintf(stderr, "    Options: -frames <int>-<int>\tonly convert these frames of the sequence\n");
+		fprintf(stderr, "    Options: -shard <int>/<int>\tonly convert this shard (0-based) of the frames\n");
+		fprintf(stderr, "    Options: -manifest <path>\t\tpath of the sequence bounds manifest to use\n");
+		fprintf(stderr, "    Options: -boundsOnly\t\tonly work out the sequence bounds manifest\n");
 		fprintf(stderr, "    Options: -half\t\t\tsave as half format\n");
+		fprintf(stderr, "    Options: -quantize <8|16>\t\tsave as quantized 8 or 16-bit values\n");
 		fprintf(stderr, "    Options: -sparse\t\t\tsave as a sparse grid\n");
-		fprintf(stderr, "    Options: -cellSize <int>\t\tuse this cellSize for sub sparse cells\n");
+		fprintf(stderr, "    Options: -stream\t\t\twrite dense grids a slab at a time, rather than all in memory\n");
+		fprintf(stderr, "    Options: -cellSize <int|auto>\tuse this cellSize for sub sparse cells, or choose it from the grid\n");
+		fprintf(stderr, "    Options: -morton\t\t\tstore sparse subcells in Morton (Z-order) order\n");
+		fprintf(stderr, "    Options: -activeCells\t\tonly create sparse subcells with values, for huge sparse domains (not with -morton)\n");
+		fprintf(stderr, "    Options: -threads <int>\t\tnumber of threads to use (0 for all cores)\n");
+		fprintf(stderr, "    Options: -framesInFlight <int>\tmax number of frames to convert at once for sequences\n");
+		fprintf(stderr, "    Options: -memLimit <int>\t\tmemory limit in MB for frames in flight for sequences\n");
+		fprintf(stderr, "    Options: -compress <lz4|none>\tcompress sparse subcells with this codec\n");
+		fprintf(stderr, "    Options: -mipLevels <int>\t\tnumber of half-resolution levels to store as well\n");
+		fprintf(stderr, "    Options: -mipFilter <box|max>\tfilter to build the mip levels with\n");
+		fprintf(stderr, "    Options: -resample <int>\t\tfilter the grids down to this many times the voxel size before converting\n");
+		fprintf(stderr, "    Options: -resampleFilter <box|max>\tfilter to resample the grids with\n");
+		fprintf(stderr, "    Options: -frameBounds\t\t\tfor sequences, convert each frame with its own bounds, stored with its offset\n");
+		fprintf(stderr, "    Options: -temporal <float>\t\tfor sparse sequences, store subcells within this tolerance of the previous frame's as references to it\n");
+		fprintf(stderr, "    Options: -keyframes <int>\t\tinterval of frames with no references for -temporal (default 10)\n");
+		fprintf(stderr, "    Options: -grid <name>[=<channel>]\tconvert this float or vector grid, saved as this channel (repeatable)\n");
+		fprintf(stderr, "    Options: -channels\t\t\twrite all the grids into one multi-channel sparse file\n");
+		fprintf(stderr, "    Options: -index\t\t\twrite a sparse subcell offset index, with 64-byte aligned payloads\n");
+		fprintf(stderr, "    Options: -tiles\t\t\tstore constant-valued sparse subcells as a single value\n");
+		fprintf(stderr, "    Options: -mask\t\t\tstore sparse subcells as an occupancy mask and the non-zero values, where smaller\n");
+		fprintf(stderr, "    Options: -shuffle\t\t\tbyte-shuffle subcell values before compressing them\n");
+		fprintf(stderr, "    Options: -stats <path>\t\twrite per-phase timing and memory stats to this JSON file\n");
 		fprintf(stderr, "    Options: -valMul <float>\t\tapply value modifier\n");
 		fprintf(stderr, "    Options: -sizeScale <float>\t\tapply this scale to the bounds of the volume\n\n");
 		return 0;
@@ -137,15 +436,28 @@ int main(int argc, char** argv)
 		sequence = false;
 	}
 
+	ConversionStats stats;
+	if (!statsPath.empty())
+	{
+		converter.setStats(&stats);
+	}
+
+	bool converted = false;
+
 	if (!sequence)
 	{
-		converter.convertSingle(sourceFile, destFile);
+		converted = converter.convertSingle(sourceFile, destFile);
 	}
 	else
 	{
-		converter.convertSequence(sourceFile, destFile);
+		converted = converter.convertSequence(sourceFile, destFile);
+	}
+
+	if (!statsPath.empty())
+	{
+		stats.writeJSON(statsPath);
 	}
 
-	return 0;
+	return converted ? 0 : 1;
 }
 
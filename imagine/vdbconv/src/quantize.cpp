@@ -0,0 +1,111 @@
+/*
+ vdbconv
+ Copyright 2014-2017 Peter Pearson.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ You may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ ---------
+*/
+
+#include "quantize.h"
+
+#include <cmath>
+#include <algorithm>
+
+#include <stdint.h>
+#include <string.h>
+
+namespace
+{
+
+template <typename T>
+float quantizeValuesToType(const float* pValues, size_t numValues, unsigned int maxLevel, float offset, float scale, T* pDst)
+{
+	float maxError = 0.0f;
+
+	float invScale = (scale > 0.0f) ? 1.0f / scale : 0.0f;
+
+	for (size_t i = 0; i < numValues; i++)
+	{
+		float value = pValues[i];
+
+		float level = std::floor((value - offset) * invScale + 0.5f);
+		level = std::min(std::max(level, 0.0f), (float)maxLevel);
+
+		T quantizedValue = (T)level;
+		pDst[i] = quantizedValue;
+
+		float error = std::fabs(value - (offset + (float)quantizedValue * scale));
+		maxError = std::max(maxError, error);
+	}
+
+	return maxError;
+}
+
+} // namespace
+
+void getQuantizeRange(const float* pValues, size_t numValues, unsigned int bits, float& offset, float& scale)
+{
+	if (numValues == 0)
+	{
+		offset = 0.0f;
+		scale = 0.0f;
+		return;
+	}
+
+	float minValue = pValues[0];
+	float maxValue = pValues[0];
+
+	for (size_t i = 1; i < numValues; i++)
+	{
+		minValue = std::min(minValue, pValues[i]);
+		maxValue = std::max(maxValue, pValues[i]);
+	}
+
+	unsigned int maxLevel = (1u << bits) - 1;
+
+	offset = minValue;
+	scale = (maxValue - minValue) / (float)maxLevel;
+}
+
+float quantizeValues(const float* pValues, size_t numValues, unsigned int bits, float offset, float scale, void* pDst)
+{
+	if (bits == 8)
+	{
+		return quantizeValuesToType(pValues, numValues, 255, offset, scale, (uint8_t*)pDst);
+	}
+
+	return quantizeValuesToType(pValues, numValues, 65535, offset, scale, (uint16_t*)pDst);
+}
+
+void dequantizeValues(const void* pSrc, size_t numValues, unsigned int bits, float offset, float scale, float* pDst)
+{
+	if (bits == 8)
+	{
+		const uint8_t* pValues = (const uint8_t*)pSrc;
+		for (size_t i = 0; i < numValues; i++)
+		{
+			pDst[i] = offset + (float)pValues[i] * scale;
+		}
+	}
+	else
+	{
+		// the source might not be aligned (i.e. straight from a file mapping)
+		const unsigned char* pBytes = (const unsigned char*)pSrc;
+		for (size_t i = 0; i < numValues; i++)
+		{
+			uint16_t value;
+			memcpy(&value, pBytes + i * sizeof(uint16_t), sizeof(uint16_t));
+			pDst[i] = offset + (float)value * scale;
+		}
+	}
+}
@@ -0,0 +1,38 @@
+/*
+ vdbconv
+ Copyright 2014-2017 Peter Pearson.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ You may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ ---------
+*/
+
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include <stddef.h>
+
+// quantization of float values to 8 or 16-bit unsigned integers, where each block of values
+// (a sparse subcell, or a dense z slice) has its own offset and scale, so that:
+//   value = offset + quantizedValue * scale
+
+// works out the offset and scale to use for the values - the scale will be 0 if they're all the same
+void getQuantizeRange(const float* pValues, size_t numValues, unsigned int bits, float& offset, float& scale);
+
+// quantizes the values into pDst (which needs to be numValues * (bits / 8) bytes), and returns
+// the max absolute error of the quantized values
+float quantizeValues(const float* pValues, size_t numValues, unsigned int bits, float offset, float scale, void* pDst);
+
+// the reverse of the above - pSrc has numValues * (bits / 8) bytes
+void dequantizeValues(const void* pSrc, size_t numValues, unsigned int bits, float offset, float scale, float* pDst);
+
+#endif // QUANTIZE_H
@@ -0,0 +1,144 @@
+/*
+ vdbconv
+ Copyright 2014-2017 Peter Pearson.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ You may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ ---------
+*/
+
+#ifndef SEQUENCE_PIPELINE_H
+#define SEQUENCE_PIPELINE_H
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+// blocking queue used to pass frames between the stages of the sequence conversion pipeline.
+// it's not bounded itself - the number of frames in flight is limited by FrameBudget.
+template <typename T>
+class PipelineQueue
+{
+public:
+	PipelineQueue() : m_closed(false)
+	{
+	}
+
+	void push(const T& item)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_items.push_back(item);
+		}
+
+		m_condition.notify_one();
+	}
+
+	// blocks until an item's available, and returns false once the queue's been closed and
+	// there's nothing left in it
+	bool pop(T& item)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		while (m_items.empty() && !m_closed)
+		{
+			m_condition.wait(lock);
+		}
+
+		if (m_items.empty())
+			return false;
+
+		item = m_items.front();
+		m_items.pop_front();
+
+		return true;
+	}
+
+	void close()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_closed = true;
+		}
+
+		m_condition.notify_all();
+	}
+
+protected:
+	std::mutex					m_mutex;
+	std::condition_variable		m_condition;
+
+	std::deque<T>				m_items;
+	bool						m_closed;
+};
+
+// limits the number of frames in flight in the pipeline, and the memory they're estimated to use.
+// a frame is always let through if there's nothing else in flight, even if it's over the memory
+// limit on its own, so the pipeline can't stall.
+class FrameBudget
+{
+public:
+	// maxMemory of 0 means no memory limit
+	FrameBudget(unsigned int maxFrames, size_t maxMemory) : m_maxFrames(maxFrames), m_maxMemory(maxMemory),
+		m_framesInFlight(0), m_memoryInUse(0)
+	{
+	}
+
+	void acquire(size_t memory)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		while (m_framesInFlight > 0 && (m_framesInFlight >= m_maxFrames ||
+									   (m_maxMemory > 0 && m_memoryInUse + memory > m_maxMemory)))
+		{
+			m_condition.wait(lock);
+		}
+
+		m_framesInFlight++;
+		m_memoryInUse += memory;
+	}
+
+	// changes the memory charged for a frame that's already in flight (i.e. once the real size of
+	// its converted data is known). This never blocks.
+	void adjust(size_t oldMemory, size_t newMemory)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_memoryInUse = m_memoryInUse - oldMemory + newMemory;
+		}
+
+		m_condition.notify_all();
+	}
+
+	void release(size_t memory)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_framesInFlight--;
+			m_memoryInUse -= memory;
+		}
+
+		m_condition.notify_all();
+	}
+
+protected:
+	std::mutex					m_mutex;
+	std::condition_variable		m_condition;
+
+	unsigned int				m_maxFrames;
+	size_t						m_maxMemory;
+
+	unsigned int				m_framesInFlight;
+	size_t						m_memoryInUse;
+};
+
+#endif // SEQUENCE_PIPELINE_H
@@ -0,0 +1,112 @@
+/*
+ vdbconv
+ Copyright 2014-2017 Peter Pearson.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ You may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ ---------
+*/
+
+#include "slab_allocator.h"
+
+#include <stdlib.h>
+
+#include <new>
+
+SlabAllocator::SlabAllocator(size_t chunkSize) : m_chunkSize(getBlockSize(chunkSize)), m_totalChunkSize(0),
+	m_pCurrentPos(NULL), m_currentRemaining(0)
+{
+}
+
+SlabAllocator::~SlabAllocator()
+{
+	freeAll();
+}
+
+void* SlabAllocator::allocateBlock(size_t size)
+{
+	size_t blockSize = getBlockSize(size);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	std::map<size_t, std::vector<void*> >::iterator itFree = m_freeBlocks.find(blockSize);
+	if (itFree != m_freeBlocks.end() && !itFree->second.empty())
+	{
+		void* pBlock = itFree->second.back();
+		itFree->second.pop_back();
+		return pBlock;
+	}
+
+	if (blockSize > m_chunkSize)
+	{
+		// this doesn't change the current chunk, as there's likely to be space left in it
+		return allocateChunk(blockSize);
+	}
+
+	if (blockSize > m_currentRemaining)
+	{
+		// whatever's left of the current chunk is just wasted
+		m_pCurrentPos = allocateChunk(m_chunkSize);
+		m_currentRemaining = m_chunkSize;
+	}
+
+	void* pBlock = m_pCurrentPos;
+	m_pCurrentPos += blockSize;
+	m_currentRemaining -= blockSize;
+
+	return pBlock;
+}
+
+void SlabAllocator::freeBlock(void* pBlock, size_t size)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_freeBlocks[getBlockSize(size)].push_back(pBlock);
+}
+
+void SlabAllocator::freeAll()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	for (unsigned int i = 0; i < m_aChunks.size(); i++)
+	{
+		free(m_aChunks[i]);
+	}
+
+	m_aChunks.clear();
+	m_totalChunkSize = 0;
+
+	m_pCurrentPos = NULL;
+	m_currentRemaining = 0;
+
+	m_freeBlocks.clear();
+}
+
+size_t SlabAllocator::getMemorySize() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	return m_totalChunkSize;
+}
+
+unsigned char* SlabAllocator::allocateChunk(size_t size)
+{
+	// same as new failing
+	void* pChunk = NULL;
+	if (posix_memalign(&pChunk, kBlockAlignment, size) != 0)
+		throw std::bad_alloc();
+
+	m_aChunks.push_back((unsigned char*)pChunk);
+	m_totalChunkSize += size;
+
+	return (unsigned char*)pChunk;
+}
@@ -0,0 +1,79 @@
+/*
+ vdbconv
+ Copyright 2014-2017 Peter Pearson.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ You may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ ---------
+*/
+
+#ifndef SLAB_ALLOCATOR_H
+#define SLAB_ALLOCATOR_H
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <stddef.h>
+
+// hands out blocks of memory from large chunks, so that lots of subcell payloads don't each need their
+// own heap allocation, and can all be freed together. Freed blocks are kept and reused for later blocks
+// of the same size, rather than going back to the heap. Allocating and freeing blocks is thread-safe.
+class SlabAllocator
+{
+public:
+	SlabAllocator(size_t chunkSize = kDefaultChunkSize);
+	~SlabAllocator();
+
+	// blocks are aligned to kBlockAlignment bytes. Blocks bigger than the chunk size get a chunk of their own.
+	void* allocateBlock(size_t size);
+	// size must be the same as the block was allocated with
+	void freeBlock(void* pBlock, size_t size);
+
+	// frees all the chunks, so any blocks which were handed out are no longer valid
+	void freeAll();
+
+	// the memory allocated for all the chunks
+	size_t getMemorySize() const;
+
+	static const size_t kBlockAlignment = 64;
+	static const size_t kDefaultChunkSize = 4 * 1024 * 1024;
+
+protected:
+	static size_t getBlockSize(size_t size)
+	{
+		return (size + kBlockAlignment - 1) & ~(kBlockAlignment - 1);
+	}
+
+	unsigned char* allocateChunk(size_t size);
+
+private:
+	// not copyable
+	SlabAllocator(const SlabAllocator& rhs);
+	SlabAllocator& operator=(const SlabAllocator& rhs);
+
+protected:
+	mutable std::mutex		m_mutex;
+
+	size_t					m_chunkSize;
+	std::vector<unsigned char*>	m_aChunks;
+	size_t					m_totalChunkSize;
+
+	// the unused part of the chunk blocks are currently being handed out from
+	unsigned char*			m_pCurrentPos;
+	size_t					m_currentRemaining;
+
+	// freed blocks, by block size
+	std::map<size_t, std::vector<void*> >	m_freeBlocks;
+};
+
+#endif // SLAB_ALLOCATOR_H
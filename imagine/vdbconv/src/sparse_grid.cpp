@@ -18,33 +18,81 @@
 
 #include "sparse_grid.h"
 
-SparseGrid::SparseGrid()
+#include <algorithm>
+
+namespace
+{
+
+// spreads the bits of value out so there are two zero bits between each of them
+uint64_t spreadBits3(uint64_t value)
+{
+	value &= 0x1fffff;
+	value = (value | (value << 32)) & 0x1f00000000ffffULL;
+	value = (value | (value << 16)) & 0x1f0000ff0000ffULL;
+	value = (value | (value << 8)) & 0x100f00f00f00f00fULL;
+	value = (value | (value << 4)) & 0x10c30c30c30c30c3ULL;
+	value = (value | (value << 2)) & 0x1249249249249249ULL;
+
+	return value;
+}
+
+uint64_t getMortonCode(unsigned int i, unsigned int j, unsigned int k)
+{
+	return spreadBits3(i) | (spreadBits3(j) << 1) | (spreadBits3(k) << 2);
+}
+
+bool compareCellIndex(const SparseGrid::AllocatedSubCell& a, const SparseGrid::AllocatedSubCell& b)
+{
+	return a.cellIndex < b.cellIndex;
+}
+
+} // namespace
+
+SparseGrid::SparseGrid() : m_storage(eCellStorageAll), m_numCellBlocks(0), m_numCreatedCellBlocks(0), m_cellBlockCountX(0),
+	m_cellBlockCountY(0), m_layout(eSubCellLayoutLinear), m_overallResX(0), m_overallResY(0), m_overallResZ(0), m_cellSize(0),
+	m_numComponents(1), m_cellCountX(0), m_cellCountY(0), m_cellCountZ(0), m_cellCountXY(0)
 {
 	
 }
 
 SparseGrid::~SparseGrid()
 {
-	
+	freeCells();
 }
 
 void SparseGrid::freeCells()
 {
-	std::vector<SparseSubCell*>::iterator itCell = m_aCells.begin();
-	for (; itCell != m_aCells.end(); ++itCell)
+	m_aCells.clear();
+	m_aLayoutIndices.clear();
+
+	freeCellBlocks();
+	m_pCellBlocks.reset();
+	m_numCellBlocks = 0;
+
+	m_payloadAllocator.freeAll();
+}
+
+void SparseGrid::freeCellBlocks()
+{
+	for (size_t blockIndex = 0; blockIndex < m_numCellBlocks; blockIndex++)
 	{
-		SparseSubCell* pCell = *itCell;
-		delete pCell;
+		delete m_pCellBlocks[blockIndex].load(std::memory_order_relaxed);
+		m_pCellBlocks[blockIndex].store(NULL, std::memory_order_relaxed);
 	}
 
-	m_aCells.clear();
+	m_numCreatedCellBlocks = 0;
 }
 
 void SparseGrid::resizeGrid(unsigned int overallResX, unsigned int overallResY, unsigned int overallResZ,
-				unsigned int cellSize)
+				unsigned int cellSize, SubCellLayout layout, unsigned int numComponents, CellStorage storage)
 {
 	freeCells();
 
+	m_storage = storage;
+	// the Morton layout needs the rank of every subcell's code, so needs them all to exist
+	m_layout = (storage == eCellStorageActive) ? eSubCellLayoutLinear : layout;
+	m_numComponents = numComponents;
+
 	m_overallResX = overallResX;
 	m_overallResY = overallResY;
 	m_overallResZ = overallResZ;
@@ -58,50 +106,152 @@ void SparseGrid::resizeGrid(unsigned int overallResX, unsigned int overallResY,
 	m_cellCountZ = m_overallResZ / m_cellSize;
 	m_cellCountZ += (m_overallResZ % m_cellSize > 0);
 	
-	m_cellCountXY = m_cellCountX * m_cellCountY;
+	m_cellCountXY = (uint64_t)m_cellCountX * (uint64_t)m_cellCountY;
+
+	if (m_storage == eCellStorageActive)
+	{
+		// just the (empty) table of blocks - the blocks and their subcells are created as values are set
+		m_cellBlockCountX = (m_cellCountX + kCellBlockSize - 1) >> kCellBlockShift;
+		m_cellBlockCountY = (m_cellCountY + kCellBlockSize - 1) >> kCellBlockShift;
+		size_t cellBlockCountZ = (m_cellCountZ + kCellBlockSize - 1) >> kCellBlockShift;
+
+		m_numCellBlocks = (size_t)m_cellBlockCountX * (size_t)m_cellBlockCountY * cellBlockCountZ;
+		m_pCellBlocks.reset(new std::atomic<CellBlock*>[m_numCellBlocks]);
+
+		for (size_t blockIndex = 0; blockIndex < m_numCellBlocks; blockIndex++)
+		{
+			m_pCellBlocks[blockIndex].store(NULL, std::memory_order_relaxed);
+		}
+
+		return;
+	}
 
-	// create the subcells
-	// for the moment, just lay them out in sequential axis order, but something like Morten codes will possibly
-	// make more sense (for boundary interpolation) in terms of locality...
+	// create the subcells, in the order of the layout. For the Morton layout, the cell counts
+	// generally aren't powers of two, so the codes outside the grid are just skipped
 
-	unsigned int cellSizeX = m_cellSize;
-	unsigned int cellSizeY = m_cellSize;
-	unsigned int cellSizeZ = m_cellSize;
+	uint64_t totalCellCount = m_cellCountXY * m_cellCountZ;
 
-	for (unsigned int k = 0; k < m_cellCountZ; k++)
+	// for the Morton layout, the linear index of each subcell, in layout order
+	std::vector<uint64_t> aLinearIndices;
+
+	if (m_layout == eSubCellLayoutMorton)
 	{
-		unsigned int resRemainingZ = m_overallResZ - (k * m_cellSize);
-		cellSizeZ = std::min(m_cellSize, resRemainingZ);
-		for (unsigned int j = 0; j < m_cellCountY; j++)
+		aLinearIndices.resize(totalCellCount);
+
+		std::vector<std::pair<uint64_t, uint64_t> > aCodes;
+		aCodes.reserve(totalCellCount);
+
+		for (uint64_t linearIndex = 0; linearIndex < totalCellCount; linearIndex++)
 		{
-			unsigned int resRemainingY = m_overallResY - (j * m_cellSize);
-			cellSizeY = std::min(m_cellSize, resRemainingY);
-			for (unsigned int i = 0; i < m_cellCountX; i++)
-			{
-				unsigned int resRemainingX = m_overallResX - (i * m_cellSize);
-				cellSizeX = std::min(m_cellSize, resRemainingX);
+			unsigned int i = (unsigned int)(linearIndex % m_cellCountX);
+			unsigned int j = (unsigned int)((linearIndex / m_cellCountX) % m_cellCountY);
+			unsigned int k = (unsigned int)(linearIndex / m_cellCountXY);
 
-				SparseSubCell* pNewSubCell = new SparseSubCell();
-				pNewSubCell->initNoAllocation(cellSizeX, cellSizeY, cellSizeZ);
+			aCodes.push_back(std::make_pair(getMortonCode(i, j, k), linearIndex));
+		}
 
-				m_aCells.push_back(pNewSubCell);
-			}
+		std::sort(aCodes.begin(), aCodes.end());
+
+		m_aLayoutIndices.resize(totalCellCount);
+
+		for (uint64_t cellIndex = 0; cellIndex < totalCellCount; cellIndex++)
+		{
+			aLinearIndices[cellIndex] = aCodes[cellIndex].second;
+			m_aLayoutIndices[aCodes[cellIndex].second] = cellIndex;
 		}
 	}
+
+	m_aCells.resize(totalCellCount);
+
+	for (uint64_t cellIndex = 0; cellIndex < totalCellCount; cellIndex++)
+	{
+		uint64_t linearIndex = (m_layout == eSubCellLayoutLinear) ? cellIndex : aLinearIndices[cellIndex];
+
+		unsigned int i = (unsigned int)(linearIndex % m_cellCountX);
+		unsigned int j = (unsigned int)((linearIndex / m_cellCountX) % m_cellCountY);
+		unsigned int k = (unsigned int)(linearIndex / m_cellCountXY);
+
+		unsigned int cellSizeX = std::min(m_cellSize, m_overallResX - (i * m_cellSize));
+		unsigned int cellSizeY = std::min(m_cellSize, m_overallResY - (j * m_cellSize));
+		unsigned int cellSizeZ = std::min(m_cellSize, m_overallResZ - (k * m_cellSize));
+
+		m_aCells[cellIndex].initNoAllocation(cellSizeX, cellSizeY, cellSizeZ, m_numComponents);
+	}
 }
 
 void SparseGrid::clear()
 {
-	std::vector<SparseSubCell*>::iterator itCell = m_aCells.begin();
+	// the subcells of the active storage only exist if they have values
+	freeCellBlocks();
+
+	std::vector<SparseSubCell>::iterator itCell = m_aCells.begin();
 	for (; itCell != m_aCells.end(); ++itCell)
 	{
-		SparseSubCell* pCell = *itCell;
+		itCell->m_pFloatData = NULL;
+		itCell->m_pHalfData = NULL;
+	}
+
+	m_payloadAllocator.freeAll();
+}
+
+size_t SparseGrid::getMemorySize() const
+{
+	size_t finalSize = sizeof(*this);
 
-		pCell->freeMemory();
+	finalSize += m_aCells.capacity() * sizeof(SparseSubCell);
+	finalSize += m_aLayoutIndices.capacity() * sizeof(uint64_t);
+	finalSize += m_numCellBlocks * sizeof(std::atomic<CellBlock*>);
+	finalSize += m_numCreatedCellBlocks * sizeof(CellBlock);
+
+	// this is the chunks, so includes any unused space in them
+	finalSize += m_payloadAllocator.getMemorySize();
+
+	return finalSize;
+}
+
+void SparseGrid::allocateSubCellData(uint64_t cellIndex, bool isHalf)
+{
+	allocateSubCellData(m_aCells[cellIndex], isHalf);
+}
+
+void SparseGrid::allocateSubCellData(SparseSubCell& subCell, bool isHalf)
+{
+	if (subCell.isAllocated())
+		return;
+
+	size_t dataSize = (size_t)subCell.getNumValues() * (isHalf ? sizeof(half) : sizeof(float));
+
+	void* pData = m_payloadAllocator.allocateBlock(dataSize);
+	memset(pData, 0, dataSize);
+
+	if (!isHalf)
+	{
+		subCell.m_pFloatData = (float*)pData;
+	}
+	else
+	{
+		subCell.m_pHalfData = (half*)pData;
 	}
 }
 
-void SparseGrid::setVoxelValueFloat(unsigned int i, unsigned int j, unsigned int k, float value)
+void SparseGrid::freeSubCellData(uint64_t cellIndex)
+{
+	SparseSubCell& subCell = m_aCells[cellIndex];
+
+	if (subCell.m_pFloatData)
+	{
+		m_payloadAllocator.freeBlock(subCell.m_pFloatData, (size_t)subCell.getNumValues() * sizeof(float));
+		subCell.m_pFloatData = NULL;
+	}
+
+	if (subCell.m_pHalfData)
+	{
+		m_payloadAllocator.freeBlock(subCell.m_pHalfData, (size_t)subCell.getNumValues() * sizeof(half));
+		subCell.m_pHalfData = NULL;
+	}
+}
+
+void SparseGrid::setVoxelValueFloat(unsigned int i, unsigned int j, unsigned int k, float value, unsigned int component)
 {
 	if (value == 0.0f)
 		return;
@@ -116,16 +266,17 @@ void SparseGrid::setVoxelValueFloat(unsigned int i, unsigned int j, unsigned int
 	unsigned int subcellIndexK = k / m_cellSize;
 	unsigned int subCellVoxelK = k - (subcellIndexK * m_cellSize);
 
-	unsigned int subCellIndex = subcellIndexI + (subcellIndexJ * m_cellCountX) + (subcellIndexK * m_cellCountXY);
-
-	SparseSubCell* pSubCell = m_aCells[subCellIndex];
+	SparseSubCell& subCell = getSubCellForWriting(subcellIndexI, subcellIndexJ, subcellIndexK);
 
-	pSubCell->allocateIfNeeded(false);
+	if (!subCell.isAllocated())
+	{
+		allocateSubCellData(subCell, false);
+	}
 
-	pSubCell->setVoxelValueFloat(subCellVoxelI, subCellVoxelJ, subCellVoxelK, value);
+	subCell.setVoxelValueFloat(subCellVoxelI, subCellVoxelJ, subCellVoxelK, value, component);
 }
 
-void SparseGrid::setVoxelValueHalf(unsigned int i, unsigned int j, unsigned int k, half value)
+void SparseGrid::setVoxelValueHalf(unsigned int i, unsigned int j, unsigned int k, half value, unsigned int component)
 {
 	if (value == 0.0f)
 		return;
@@ -140,11 +291,141 @@ void SparseGrid::setVoxelValueHalf(unsigned int i, unsigned int j, unsigned int
 	unsigned int subcellIndexK = k / m_cellSize;
 	unsigned int subCellVoxelK = k - (subcellIndexK * m_cellSize);
 
-	unsigned int subCellIndex = subcellIndexI + (subcellIndexJ * m_cellCountX) + (subcellIndexK * m_cellCountXY);
+	SparseSubCell& subCell = getSubCellForWriting(subcellIndexI, subcellIndexJ, subcellIndexK);
+
+	if (!subCell.isAllocated())
+	{
+		allocateSubCellData(subCell, true);
+	}
+
+	subCell.setVoxelValueHalf(subCellVoxelI, subCellVoxelJ, subCellVoxelK, value, component);
+}
+
+float SparseGrid::getVoxelValue(unsigned int i, unsigned int j, unsigned int k, unsigned int component) const
+{
+	unsigned int subcellIndexI = i / m_cellSize;
+	unsigned int subCellVoxelI = i - (subcellIndexI * m_cellSize);
+
+	unsigned int subcellIndexJ = j / m_cellSize;
+	unsigned int subCellVoxelJ = j - (subcellIndexJ * m_cellSize);
+
+	unsigned int subcellIndexK = k / m_cellSize;
+	unsigned int subCellVoxelK = k - (subcellIndexK * m_cellSize);
+
+	const SparseSubCell* pSubCell = getSubCell(subcellIndexI, subcellIndexJ, subcellIndexK);
+
+	if (!pSubCell)
+	{
+		return 0.0f;
+	}
+	else if (pSubCell->getRawFloatData())
+	{
+		return pSubCell->getVoxelValueFloat(subCellVoxelI, subCellVoxelJ, subCellVoxelK, component);
+	}
+	else if (pSubCell->getRawHalfData())
+	{
+		return pSubCell->getVoxelValueHalf(subCellVoxelI, subCellVoxelJ, subCellVoxelK, component);
+	}
+
+	return 0.0f;
+}
+
+SparseGrid::SparseSubCell& SparseGrid::getSubCellForWriting(unsigned int cellI, unsigned int cellJ, unsigned int cellK)
+{
+	if (m_storage == eCellStorageAll)
+		return m_aCells[getSubCellIndex(cellI, cellJ, cellK)];
+
+	std::atomic<CellBlock*>& blockPtr = m_pCellBlocks[getCellBlockIndex(cellI, cellJ, cellK)];
+	CellBlock* pBlock = blockPtr.load(std::memory_order_acquire);
+
+	if (!pBlock)
+	{
+		CellBlock* pNewBlock = new CellBlock();
+
+		unsigned int blockStartI = (cellI >> kCellBlockShift) << kCellBlockShift;
+		unsigned int blockStartJ = (cellJ >> kCellBlockShift) << kCellBlockShift;
+		unsigned int blockStartK = (cellK >> kCellBlockShift) << kCellBlockShift;
+
+		// subcells of blocks at the edges which are outside the grid are left empty, and never used
+		for (unsigned int k = blockStartK; k < std::min(blockStartK + kCellBlockSize, m_cellCountZ); k++)
+		{
+			for (unsigned int j = blockStartJ; j < std::min(blockStartJ + kCellBlockSize, m_cellCountY); j++)
+			{
+				for (unsigned int i = blockStartI; i < std::min(blockStartI + kCellBlockSize, m_cellCountX); i++)
+				{
+					unsigned int cellSizeX = std::min(m_cellSize, m_overallResX - (i * m_cellSize));
+					unsigned int cellSizeY = std::min(m_cellSize, m_overallResY - (j * m_cellSize));
+					unsigned int cellSizeZ = std::min(m_cellSize, m_overallResZ - (k * m_cellSize));
+
+					pNewBlock->cells[getCellBlockOffset(i, j, k)].initNoAllocation(cellSizeX, cellSizeY, cellSizeZ, m_numComponents);
+				}
+			}
+		}
+
+		// another thread might have created the same block (for a different subcell) in the meantime,
+		// in which case we use theirs
+		if (blockPtr.compare_exchange_strong(pBlock, pNewBlock, std::memory_order_acq_rel, std::memory_order_acquire))
+		{
+			pBlock = pNewBlock;
+			m_numCreatedCellBlocks++;
+		}
+		else
+		{
+			delete pNewBlock;
+		}
+	}
+
+	return pBlock->cells[getCellBlockOffset(cellI, cellJ, cellK)];
+}
+
+void SparseGrid::getAllocatedSubCells(std::vector<AllocatedSubCell>& subCells) const
+{
+	subCells.clear();
+
+	if (m_storage == eCellStorageAll)
+	{
+		for (uint64_t cellIndex = 0; cellIndex < m_aCells.size(); cellIndex++)
+		{
+			if (m_aCells[cellIndex].isAllocated())
+			{
+				AllocatedSubCell allocatedSubCell = { cellIndex, &m_aCells[cellIndex] };
+				subCells.push_back(allocatedSubCell);
+			}
+		}
+
+		return;
+	}
+
+	size_t blockCountXY = (size_t)m_cellBlockCountX * (size_t)m_cellBlockCountY;
 
-	SparseSubCell* pSubCell = m_aCells[subCellIndex];
+	for (size_t blockIndex = 0; blockIndex < m_numCellBlocks; blockIndex++)
+	{
+		const CellBlock* pBlock = m_pCellBlocks[blockIndex].load(std::memory_order_acquire);
+		if (!pBlock)
+			continue;
 
-	pSubCell->allocateIfNeeded(true);
+		unsigned int blockStartI = (unsigned int)(blockIndex % m_cellBlockCountX) << kCellBlockShift;
+		unsigned int blockStartJ = (unsigned int)((blockIndex / m_cellBlockCountX) % m_cellBlockCountY) << kCellBlockShift;
+		unsigned int blockStartK = (unsigned int)(blockIndex / blockCountXY) << kCellBlockShift;
+
+		for (unsigned int k = blockStartK; k < std::min(blockStartK + kCellBlockSize, m_cellCountZ); k++)
+		{
+			for (unsigned int j = blockStartJ; j < std::min(blockStartJ + kCellBlockSize, m_cellCountY); j++)
+			{
+				for (unsigned int i = blockStartI; i < std::min(blockStartI + kCellBlockSize, m_cellCountX); i++)
+				{
+					const SparseSubCell* pSubCell = &pBlock->cells[getCellBlockOffset(i, j, k)];
+
+					if (pSubCell->isAllocated())
+					{
+						AllocatedSubCell allocatedSubCell = { getSubCellIndex(i, j, k), pSubCell };
+						subCells.push_back(allocatedSubCell);
+					}
+				}
+			}
+		}
+	}
 
-	pSubCell->setVoxelValueHalf(subCellVoxelI, subCellVoxelJ, subCellVoxelK, value);
+	// the blocks cover several rows, so the subcells need sorting to be in the (linear) layout order
+	std::sort(subCells.begin(), subCells.end(), compareCellIndex);
 }
@@ -20,71 +20,58 @@
 #define SPARSE_GRID_H
 
 #include <vector>
+#include <atomic>
+#include <memory>
 #include <string.h> // for memset
 
 #include <half.h>
 
+#include "slab_allocator.h"
 
 class SparseGrid
 {
 public:
+	// the order the subcells are stored in
+	enum SubCellLayout
+	{
+		// i, then j, then k
+		eSubCellLayoutLinear,
+		// Morton (Z-order) of the subcell indices, so subcells which are close in all three
+		// dimensions are generally close in memory and on disk
+		eSubCellLayoutMorton
+	};
+
+	// how the subcells themselves are stored
+	enum CellStorage
+	{
+		// all the subcells exist, in one array in layout order
+		eCellStorageAll,
+		// subcells only exist once a value has been set within them, in small blocks of subcells which
+		// are created as needed, so memory use scales with the active region rather than the whole
+		// domain. This always uses the linear layout.
+		eCellStorageActive
+	};
+
 	SparseGrid();
 	~SparseGrid();
 	
+	// the subcells are stored by value in one array, and their data is allocated (and owned) by the SparseGrid
 	class SparseSubCell
 	{
 	public:
-		SparseSubCell() : m_resX(0), m_resY(0), m_resZ(0), m_resXY(0),
+		SparseSubCell() : m_resX(0), m_resY(0), m_resZ(0), m_resXY(0), m_numComponents(1),
 			m_pFloatData(NULL), m_pHalfData(NULL)
 		{
 
 		}
 
-		~SparseSubCell()
-		{
-			freeMemory();
-		}
-
-		void freeMemory()
-		{
-			if (m_pFloatData)
-			{
-				delete [] m_pFloatData;
-				m_pFloatData = NULL;
-			}
-
-			if (m_pHalfData)
-			{
-				delete [] m_pHalfData;
-				m_pHalfData = NULL;
-			}
-		}
-
-		inline void initNoAllocation(unsigned int resX, unsigned int resY, unsigned int resZ)
+		inline void initNoAllocation(unsigned int resX, unsigned int resY, unsigned int resZ, unsigned int numComponents = 1)
 		{
 			m_resX = resX;
 			m_resY = resY;
 			m_resZ = resZ;
 			m_resXY = resX * resY;
-		}
-
-		void allocateIfNeeded(bool isHalf)
-		{
-			if (m_pFloatData || m_pHalfData)
-				return;
-
-			unsigned int size = m_resXY * m_resZ;
-
-			if (!isHalf)
-			{
-				m_pFloatData = new float[size];
-				memset(m_pFloatData, 0, size * sizeof(float));
-			}
-			else
-			{
-				m_pHalfData = new half[size];
-				memset(m_pHalfData, 0, size * sizeof(half));
-			}
+			m_numComponents = numComponents;
 		}
 
 		inline bool isAllocated() const
@@ -96,31 +83,31 @@ public:
 		}
 
 		// these currently use local coordinates within the subCell, and assume the data
-		// pointers are valid...
-		inline void setVoxelValueFloat(unsigned int i, unsigned int j, unsigned int k, float value)
+		// pointers are valid... The components of each voxel are interleaved.
+		inline void setVoxelValueFloat(unsigned int i, unsigned int j, unsigned int k, float value, unsigned int component = 0)
 		{
-			unsigned int overallIndex = i + (j * m_resX) + (k * m_resXY);
+			unsigned int overallIndex = (i + (j * m_resX) + (k * m_resXY)) * m_numComponents + component;
 
 			m_pFloatData[overallIndex] = value;
 		}
 
-		inline float getVoxelValueFloat(unsigned int i, unsigned int j, unsigned int k) const
+		inline float getVoxelValueFloat(unsigned int i, unsigned int j, unsigned int k, unsigned int component = 0) const
 		{
-			unsigned int overallIndex = i + (j * m_resX) + (k * m_resXY);
+			unsigned int overallIndex = (i + (j * m_resX) + (k * m_resXY)) * m_numComponents + component;
 
 			return m_pFloatData[overallIndex];
 		}
 
-		inline void setVoxelValueHalf(unsigned int i, unsigned int j, unsigned int k, half value)
+		inline void setVoxelValueHalf(unsigned int i, unsigned int j, unsigned int k, half value, unsigned int component = 0)
 		{
-			unsigned int overallIndex = i + (j * m_resX) + (k * m_resXY);
+			unsigned int overallIndex = (i + (j * m_resX) + (k * m_resXY)) * m_numComponents + component;
 
 			m_pHalfData[overallIndex] = value;
 		}
 
-		inline half getVoxelValueHalf(unsigned int i, unsigned int j, unsigned int k) const
+		inline half getVoxelValueHalf(unsigned int i, unsigned int j, unsigned int k, unsigned int component = 0) const
 		{
-			unsigned int overallIndex = i + (j * m_resX) + (k * m_resXY);
+			unsigned int overallIndex = (i + (j * m_resX) + (k * m_resXY)) * m_numComponents + component;
 
 			return m_pHalfData[overallIndex];
 		}
@@ -146,6 +133,17 @@ public:
 			return m_resXY;
 		}
 
+		unsigned int getNumComponents() const
+		{
+			return m_numComponents;
+		}
+
+		// the number of values in the subcell's data, including all the components
+		unsigned int getNumValues() const
+		{
+			return m_resXY * m_resZ * m_numComponents;
+		}
+
 		size_t getMemorySize() const
 		{
 			size_t finalSize = 0;
@@ -154,12 +152,12 @@ public:
 
 			if (m_pFloatData)
 			{
-				finalSize += m_resX * m_resY * m_resZ * sizeof(float);
+				finalSize += getNumValues() * sizeof(float);
 			}
 
 			if (m_pHalfData)
 			{
-				finalSize += m_resX * m_resY * m_resZ * sizeof(half);
+				finalSize += getNumValues() * sizeof(half);
 			}
 
 			return finalSize;
@@ -186,38 +184,181 @@ public:
 		}
 
 	protected:
+		friend class SparseGrid;
+
 		uint32_t		m_resX;
 		uint32_t		m_resY;
 		uint32_t		m_resZ;
 		uint32_t		m_resXY;
+		// the number of values per voxel - 3 for vector grids
+		uint32_t		m_numComponents;
 
 		float*			m_pFloatData;
 		half*			m_pHalfData;
 	};
+
+	// an allocated subcell, and its index in the layout order
+	struct AllocatedSubCell
+	{
+		uint64_t					cellIndex;
+		const SparseSubCell*		pSubCell;
+	};
 	
 	void freeCells();
 
 	void resizeGrid(unsigned int overallResX, unsigned int overallResY, unsigned int overallResZ,
-					unsigned int cellSize);
+					unsigned int cellSize, SubCellLayout layout = eSubCellLayoutLinear, unsigned int numComponents = 1,
+					CellStorage storage = eCellStorageAll);
 
 	void clear();
+
+	size_t getMemorySize() const;
 	
-	void setVoxelValueFloat(unsigned int i, unsigned int j, unsigned int k, float value);
-	void setVoxelValueHalf(unsigned int i, unsigned int j, unsigned int k, half value);
-	
-	std::vector<SparseSubCell*>& getSubCells() { return m_aCells; }
-	const std::vector<SparseSubCell*>& getSubCells() const { return m_aCells; }
+	// allocates (and zeroes) the data of the subcell at this index within getSubCells() if it's not already
+	// allocated. Different threads can allocate different subcells at the same time. eCellStorageAll only.
+	void allocateSubCellData(uint64_t cellIndex, bool isHalf);
+	// the data is kept by the grid's allocator, to be reused by later subcells. eCellStorageAll only.
+	void freeSubCellData(uint64_t cellIndex);
+
+	// different threads can set values in different subcells at the same time, with either storage
+	void setVoxelValueFloat(unsigned int i, unsigned int j, unsigned int k, float value, unsigned int component = 0);
+	void setVoxelValueHalf(unsigned int i, unsigned int j, unsigned int k, half value, unsigned int component = 0);
+
+	// returns 0 for voxels in subcells which aren't allocated
+	float getVoxelValue(unsigned int i, unsigned int j, unsigned int k, unsigned int component = 0) const;
+
+	// the index within getSubCells() of the subcell with these subcell indices. Subcell indices and counts are 64-bit,
+	// as huge domains with small subcells can have more than 2^32 of them.
+	inline uint64_t getSubCellIndex(unsigned int cellI, unsigned int cellJ, unsigned int cellK) const
+	{
+		uint64_t linearIndex = (uint64_t)cellI + ((uint64_t)cellJ * m_cellCountX) + ((uint64_t)cellK * m_cellCountXY);
+
+		return (m_layout == eSubCellLayoutLinear) ? linearIndex : m_aLayoutIndices[linearIndex];
+	}
+
+	// for eCellStorageActive, this is NULL if the subcell doesn't exist
+	const SparseSubCell* getSubCell(unsigned int cellI, unsigned int cellJ, unsigned int cellK) const
+	{
+		if (m_storage == eCellStorageActive)
+		{
+			const CellBlock* pBlock = m_pCellBlocks[getCellBlockIndex(cellI, cellJ, cellK)].load(std::memory_order_acquire);
+
+			return pBlock ? &pBlock->cells[getCellBlockOffset(cellI, cellJ, cellK)] : NULL;
+		}
+
+		return &m_aCells[getSubCellIndex(cellI, cellJ, cellK)];
+	}
+
+	// for changing the values of subcells which are already allocated
+	SparseSubCell* getSubCell(unsigned int cellI, unsigned int cellJ, unsigned int cellK)
+	{
+		return const_cast<SparseSubCell*>(static_cast<const SparseGrid*>(this)->getSubCell(cellI, cellJ, cellK));
+	}
+
+	bool isSubCellAllocated(unsigned int cellI, unsigned int cellJ, unsigned int cellK) const
+	{
+		const SparseSubCell* pSubCell = getSubCell(cellI, cellJ, cellK);
+
+		return pSubCell && pSubCell->isAllocated();
+	}
+
+	// all the subcells, in layout order - eCellStorageAll only
+	std::vector<SparseSubCell>& getSubCells() { return m_aCells; }
+	const std::vector<SparseSubCell>& getSubCells() const { return m_aCells; }
+
+	// the allocated subcells in layout order, which works with either storage, and is what the writers use
+	void getAllocatedSubCells(std::vector<AllocatedSubCell>& subCells) const;
+
+	// the number of subcells in the whole grid, whether they exist or not
+	uint64_t getNumSubCells() const
+	{
+		return m_cellCountXY * m_cellCountZ;
+	}
 	
 	uint32_t getSubCellSize() const
 	{
 		return m_cellSize;
-	}	
+	}
+
+	SubCellLayout getSubCellLayout() const
+	{
+		return m_layout;
+	}
+
+	CellStorage getCellStorage() const
+	{
+		return m_storage;
+	}
+
+	uint32_t getNumComponents() const
+	{
+		return m_numComponents;
+	}
+
+	uint32_t getCellCountX() const
+	{
+		return m_cellCountX;
+	}
+
+	uint32_t getCellCountY() const
+	{
+		return m_cellCountY;
+	}
+
+	uint32_t getCellCountZ() const
+	{
+		return m_cellCountZ;
+	}
 	
 protected:
-	// currently, the implementation is such that all sub-cells of the sparse grid
-	// are allocated (to make the lookup of them easy), but sub-cells themselves only
-	// allocate the raw data if they have values within them
-	std::vector<SparseSubCell*>		m_aCells;
+	// eCellStorageActive subcells are in blocks of this many subcells in each dimension
+	static const unsigned int kCellBlockShift = 2;
+	static const unsigned int kCellBlockSize = 1 << kCellBlockShift;
+
+	struct CellBlock
+	{
+		SparseSubCell		cells[kCellBlockSize * kCellBlockSize * kCellBlockSize];
+	};
+
+	inline size_t getCellBlockIndex(unsigned int cellI, unsigned int cellJ, unsigned int cellK) const
+	{
+		return (size_t)(cellI >> kCellBlockShift) + ((size_t)(cellJ >> kCellBlockShift) * m_cellBlockCountX) +
+				((size_t)(cellK >> kCellBlockShift) * m_cellBlockCountX * m_cellBlockCountY);
+	}
+
+	inline unsigned int getCellBlockOffset(unsigned int cellI, unsigned int cellJ, unsigned int cellK) const
+	{
+		const unsigned int mask = kCellBlockSize - 1;
+		return (cellI & mask) + ((cellJ & mask) * kCellBlockSize) + ((cellK & mask) * kCellBlockSize * kCellBlockSize);
+	}
+
+	// the subcell to set a value in, which for eCellStorageActive creates it if needed
+	SparseSubCell& getSubCellForWriting(unsigned int cellI, unsigned int cellJ, unsigned int cellK);
+
+	void allocateSubCellData(SparseSubCell& subCell, bool isHalf);
+
+	void freeCellBlocks();
+
+	CellStorage			m_storage;
+
+	// for eCellStorageAll, all sub-cells of the sparse grid exist (to make the lookup of them
+	// easy), but the raw data is only allocated for sub-cells which have values within them
+	std::vector<SparseSubCell>		m_aCells;
+
+	// for eCellStorageActive, a table of all the blocks of subcells, which are only created once a
+	// subcell within them has a value set. Different threads can create them at the same time.
+	std::unique_ptr<std::atomic<CellBlock*>[]>	m_pCellBlocks;
+	size_t				m_numCellBlocks;
+	std::atomic<size_t>	m_numCreatedCellBlocks;
+	uint32_t			m_cellBlockCountX;
+	uint32_t			m_cellBlockCountY;
+
+	// the raw data of the sub-cells, which is all freed together
+	SlabAllocator		m_payloadAllocator;
+
+	SubCellLayout		m_layout;
+	// for non-linear layouts, the index in m_aCells of each subcell, in linear order
+	std::vector<uint64_t>	m_aLayoutIndices;
 	
 	uint32_t			m_overallResX;
 	uint32_t			m_overallResY;
@@ -225,12 +366,13 @@ protected:
 	
 	// currently, the cell size is the same in all 3 dimensions...
 	uint32_t			m_cellSize;
+	uint32_t			m_numComponents;
 
 	// these are worked out based on the overall volume res and the cell size...
 	uint32_t			m_cellCountX;
 	uint32_t			m_cellCountY;
 	uint32_t			m_cellCountZ;
-	uint32_t			m_cellCountXY;
+	uint64_t			m_cellCountXY;
 };
 
 #endif // SPARSE_GRID_H
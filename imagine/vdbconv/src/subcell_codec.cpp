@@ -0,0 +1,247 @@
+/*
+ vdbconv
+ Copyright 2014-2017 Peter Pearson.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ You may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ ---------
+*/
+
+#include "subcell_codec.h"
+
+#include <string.h>
+
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+
+bool isCodecAvailable(unsigned char codec)
+{
+	if (codec == eIVVCodecNone)
+		return true;
+
+#ifdef USE_LZ4
+	if (codec == eIVVCodecLZ4)
+		return true;
+#endif
+
+	return false;
+}
+
+size_t compressSubCellData(unsigned char codec, unsigned char filter, const void* pSrc, size_t srcSize, size_t valueSize,
+						   std::vector<unsigned char>& compressedData)
+{
+	const unsigned char* pSrcBytes = (const unsigned char*)pSrc;
+
+	std::vector<unsigned char> shuffledData;
+	if (filter == eIVVFilterByteShuffle && valueSize > 1)
+	{
+		shuffledData.resize(srcSize);
+		byteShuffle(pSrcBytes, &shuffledData[0], srcSize / valueSize, valueSize);
+		pSrcBytes = &shuffledData[0];
+	}
+
+	switch (codec)
+	{
+#ifdef USE_LZ4
+		case eIVVCodecLZ4:
+		{
+			int maxCompressedSize = LZ4_compressBound((int)srcSize);
+			compressedData.resize(maxCompressedSize);
+
+			int compressedSize = LZ4_compress_default((const char*)pSrcBytes, (char*)&compressedData[0], (int)srcSize, maxCompressedSize);
+
+			if (compressedSize <= 0 || (size_t)compressedSize >= srcSize)
+				return 0;
+
+			compressedData.resize(compressedSize);
+			return compressedSize;
+		}
+#endif
+		default:
+			return 0;
+	}
+}
+
+bool decompressSubCellData(unsigned char codec, unsigned char filter, const void* pSrc, size_t srcSize, void* pDst, size_t dstSize,
+						   size_t valueSize)
+{
+	bool shuffled = (filter == eIVVFilterByteShuffle && valueSize > 1);
+
+	std::vector<unsigned char> shuffledData;
+	unsigned char* pDecompressed = (unsigned char*)pDst;
+	if (shuffled)
+	{
+		shuffledData.resize(dstSize);
+		pDecompressed = &shuffledData[0];
+	}
+
+	bool result = false;
+
+	switch (codec)
+	{
+#ifdef USE_LZ4
+		case eIVVCodecLZ4:
+		{
+			int decompressedSize = LZ4_decompress_safe((const char*)pSrc, (char*)pDecompressed, (int)srcSize, (int)dstSize);
+			result = (decompressedSize == (int)dstSize);
+			break;
+		}
+#endif
+		default:
+			break;
+	}
+
+	if (result && shuffled)
+	{
+		byteUnshuffle(pDecompressed, (unsigned char*)pDst, dstSize / valueSize, valueSize);
+	}
+
+	return result;
+}
+
+bool isConstantSubCellData(const void* pSrc, size_t numValues, size_t valueSize)
+{
+	const unsigned char* pValues = (const unsigned char*)pSrc;
+
+	for (size_t i = 1; i < numValues; i++)
+	{
+		if (memcmp(pValues + i * valueSize, pValues, valueSize) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+namespace
+{
+
+bool isZeroVoxel(const unsigned char* pVoxel, size_t voxelSize)
+{
+	for (size_t i = 0; i < voxelSize; i++)
+	{
+		if (pVoxel[i] != 0)
+			return false;
+	}
+
+	return true;
+}
+
+inline uint64_t readMaskWord(const unsigned char* pMask, size_t wordIndex)
+{
+	uint64_t word;
+	memcpy(&word, pMask + wordIndex * sizeof(uint64_t), sizeof(uint64_t));
+	return word;
+}
+
+} // namespace
+
+size_t maskSubCellData(const void* pOccupancySrc, size_t occupancyVoxelSize, const void* pValueSrc, size_t valueVoxelSize,
+					   size_t numVoxels, std::vector<unsigned char>& maskedData)
+{
+	const unsigned char* pOccupancy = (const unsigned char*)pOccupancySrc;
+	const unsigned char* pValues = (const unsigned char*)pValueSrc;
+
+	size_t numWords = getMaskWordCount(numVoxels);
+	std::vector<uint64_t> aMaskWords(numWords, 0);
+
+	size_t numSet = 0;
+	for (size_t i = 0; i < numVoxels; i++)
+	{
+		if (!isZeroVoxel(pOccupancy + i * occupancyVoxelSize, occupancyVoxelSize))
+		{
+			aMaskWords[i / 64] |= (uint64_t)1 << (i % 64);
+			numSet++;
+		}
+	}
+
+	size_t maskSize = numWords * sizeof(uint64_t);
+	maskedData.resize(maskSize + numSet * valueVoxelSize);
+
+	memcpy(&maskedData[0], &aMaskWords[0], maskSize);
+
+	unsigned char* pDst = &maskedData[0] + maskSize;
+	for (size_t wordIndex = 0; wordIndex < numWords; wordIndex++)
+	{
+		// just visit the set bits
+		uint64_t word = aMaskWords[wordIndex];
+		while (word)
+		{
+			size_t voxelIndex = wordIndex * 64 + __builtin_ctzll(word);
+			word &= word - 1;
+
+			memcpy(pDst, pValues + voxelIndex * valueVoxelSize, valueVoxelSize);
+			pDst += valueVoxelSize;
+		}
+	}
+
+	return maskedData.size();
+}
+
+void buildMaskRanks(const void* pMask, size_t numVoxels, uint32_t* pRanks)
+{
+	size_t numWords = getMaskWordCount(numVoxels);
+
+	uint32_t count = 0;
+	for (size_t wordIndex = 0; wordIndex < numWords; wordIndex++)
+	{
+		pRanks[wordIndex] = count;
+		count += __builtin_popcountll(readMaskWord((const unsigned char*)pMask, wordIndex));
+	}
+
+	pRanks[numWords] = count;
+}
+
+bool getMaskedValueIndex(const void* pMask, const uint32_t* pRanks, size_t voxelIndex, size_t& valueIndex)
+{
+	size_t wordIndex = voxelIndex / 64;
+	uint64_t bit = (uint64_t)1 << (voxelIndex % 64);
+	uint64_t word = readMaskWord((const unsigned char*)pMask, wordIndex);
+
+	if (!(word & bit))
+		return false;
+
+	// the set bits before it in its own word
+	valueIndex = pRanks[wordIndex] + __builtin_popcountll(word & (bit - 1));
+
+	return true;
+}
+
+void byteShuffle(const unsigned char* pSrc, unsigned char* pDst, size_t numValues, size_t valueSize)
+{
+	for (size_t byteIndex = 0; byteIndex < valueSize; byteIndex++)
+	{
+		const unsigned char* pSrcByte = pSrc + byteIndex;
+		unsigned char* pDstByte = pDst + byteIndex * numValues;
+
+		for (size_t i = 0; i < numValues; i++)
+		{
+			*pDstByte++ = *pSrcByte;
+			pSrcByte += valueSize;
+		}
+	}
+}
+
+void byteUnshuffle(const unsigned char* pSrc, unsigned char* pDst, size_t numValues, size_t valueSize)
+{
+	for (size_t byteIndex = 0; byteIndex < valueSize; byteIndex++)
+	{
+		const unsigned char* pSrcByte = pSrc + byteIndex * numValues;
+		unsigned char* pDstByte = pDst + byteIndex;
+
+		for (size_t i = 0; i < numValues; i++)
+		{
+			*pDstByte = *pSrcByte++;
+			pDstByte += valueSize;
+		}
+	}
+}
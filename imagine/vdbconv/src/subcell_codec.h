@@ -0,0 +1,70 @@
+/*
+ vdbconv
+ Copyright 2014-2017 Peter Pearson.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ You may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ ---------
+*/
+
+#ifndef SUBCELL_CODEC_H
+#define SUBCELL_CODEC_H
+
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ivv_format.h"
+
+// compression of sparse subcell data - each subcell is compressed independently, so they
+// can be decompressed in parallel or on demand
+
+bool isCodecAvailable(unsigned char codec);
+
+// returns the compressed size, or 0 if the data couldn't be compressed to smaller than it was
+size_t compressSubCellData(unsigned char codec, unsigned char filter, const void* pSrc, size_t srcSize, size_t valueSize,
+						   std::vector<unsigned char>& compressedData);
+
+bool decompressSubCellData(unsigned char codec, unsigned char filter, const void* pSrc, size_t srcSize, void* pDst, size_t dstSize,
+						   size_t valueSize);
+
+// returns true if every value is the same (bitwise) as the first one
+bool isConstantSubCellData(const void* pSrc, size_t numValues, size_t valueSize);
+
+// occupancy masking (eIVVSubCellMasked) - a uint64 word of bits for every 64 voxels saying which of them
+// are non-zero, followed by the values of just those voxels
+
+inline size_t getMaskWordCount(size_t numVoxels)
+{
+	return (numVoxels + 63) / 64;
+}
+
+// which voxels are set is based on pOccupancySrc (any voxel whose bytes aren't all zero), and the values come
+// from pValueSrc, which can be a different representation of the same voxels (i.e. quantized ones).
+// Returns the masked size.
+size_t maskSubCellData(const void* pOccupancySrc, size_t occupancyVoxelSize, const void* pValueSrc, size_t valueVoxelSize,
+					   size_t numVoxels, std::vector<unsigned char>& maskedData);
+
+// the number of set bits before each mask word (and the total at the end), so a voxel's position within the
+// values can be found in constant time. pRanks needs getMaskWordCount(numVoxels) + 1 entries. The mask doesn't
+// need to be aligned.
+void buildMaskRanks(const void* pMask, size_t numVoxels, uint32_t* pRanks);
+
+// returns false if the voxel isn't set (so is zero), otherwise sets valueIndex to the index of its value
+bool getMaskedValueIndex(const void* pMask, const uint32_t* pRanks, size_t voxelIndex, size_t& valueIndex);
+
+// groups the bytes of each value by their significance (i.e. all the first bytes, then all the second bytes),
+// which makes smoothly-varying float data compress much better
+void byteShuffle(const unsigned char* pSrc, unsigned char* pDst, size_t numValues, size_t valueSize);
+void byteUnshuffle(const unsigned char* pSrc, unsigned char* pDst, size_t numValues, size_t valueSize);
+
+#endif // SUBCELL_CODEC_H
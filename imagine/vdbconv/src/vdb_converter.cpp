@@ -18,593 +18,3386 @@
 
 #include "vdb_converter.h"
 
-#include "sparse_grid.h"
+#include <unistd.h>
+#include <dirent.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+#include "bounds_manifest.h"
+#include "conversion_stats.h"
+#include "half_convert.h"
+#include "ivv_format.h"
+#include "quantize.h"
+#include "sequence_pipeline.h"
+#include "subcell_codec.h"
+
+const unsigned int VDBConverter::kAutoSubCellSizes[VDBConverter::kNumAutoSubCellSizes] = { 8, 16, 32, 64 };
 
 VDBConverter::VDBConverter()
 {
 	m_sizeMultiplier = 2.0f;
 	m_valueMultiplier = 1.0f;
 	m_subCellSize = 32;
+	m_autoSubCellSize = false;
+	m_subCellLayout = SparseGrid::eSubCellLayoutLinear;
+	m_cellStorage = SparseGrid::eCellStorageAll;
+	m_numThreads = 0;
+
+	m_maxFramesInFlight = 0;
+	m_memoryLimit = 0;
+
+	m_haveFrameRange = false;
+	m_startFrame = 0;
+	m_endFrame = 0;
+	m_shardIndex = 0;
+	m_shardCount = 1;
+	m_boundsOnly = false;
+
+	m_compressionCodec = eIVVCodecNone;
+	m_compressionFilter = eIVVFilterNone;
+	m_collapseConstantSubCells = false;
+	m_maskSubCells = false;
+
+	m_writeSubCellIndex = false;
+	m_writeMultiChannel = false;
+
+	m_mipLevels = 0;
+	m_mipFilter = eIVVMipFilterBox;
+
+	m_resampleFactor = 1;
+	m_resampleFilter = eIVVMipFilterBox;
+
+	m_perFrameBounds = false;
+
+	m_temporalDelta = false;
+	m_temporalTolerance = 0.0f;
+	m_keyframeInterval = 10;
 
 	m_storeAsHalf = false;
+	m_quantizeBits = 0;
 	m_useSparseGrids = false;
+	m_streamDenseGrids = false;
+
+	m_pStats = NULL;
 }
 
-bool VDBConverter::convertSingle(const std::string& srcPath, const std::string& dstPath)
+void ConvertedGrid::freeData()
 {
-	GridBounds bounds;
+	for (unsigned int i = 0; i < mipLevels.size(); i++)
+	{
+		delete mipLevels[i];
+	}
+	mipLevels.clear();
 
-	openvdb::io::File file(srcPath);
+	if (pDenseFloatValues)
+	{
+		delete [] pDenseFloatValues;
+		pDenseFloatValues = NULL;
+	}
 
-	if (!file.open())
+	if (pDenseHalfValues)
 	{
-		fprintf(stderr, "Can't open VDB file: %s\n", srcPath.c_str());
-		return false;
+		delete [] pDenseHalfValues;
+		pDenseHalfValues = NULL;
 	}
 
-	openvdb::GridBase::Ptr baseGrid;
+	pStreamGrid.reset();
+	isStreamed = false;
 
-	openvdb::io::File::NameIterator nameIter = file.beginName();
+	sparseGrid.freeCells();
 
-	unsigned int count = 0;
+	std::vector<unsigned char>().swap(temporalReferences);
+}
 
-	for (; nameIter != file.endName(); ++nameIter)
+size_t ConvertedGrid::getMemorySize() const
+{
+	size_t mipLevelsSize = 0;
+	for (unsigned int i = 0; i < mipLevels.size(); i++)
 	{
-		count++;
-
-		baseGrid = file.readGrid(nameIter.gridName());
+		mipLevelsSize += mipLevels[i]->getMemorySize();
+	}
 
-		openvdb::FloatGrid::Ptr grid = openvdb::gridPtrCast<openvdb::FloatGrid>(baseGrid);
-		
-		if (!grid)
-			continue;
+	if (isSparse)
+	{
+		return sparseGrid.getMemorySize() + mipLevelsSize;
+	}
 
-		bounds.mergeGrid(grid);
+	if (isStreamed)
+	{
+		// we're still holding on to the source grid, but only need a fixed-size buffer
+		return pStreamGrid->memUsage() + VDBConverter::kDenseStreamBufferSize + mipLevelsSize;
 	}
 
-	nameIter = file.beginName();
+	size_t totalNumVoxels = (size_t)resX * (size_t)resY * (size_t)resZ;
+
+	return totalNumVoxels * (isHalf ? sizeof(half) : sizeof(float)) + mipLevelsSize;
+}
+
+bool VDBConverter::convertSingle(const std::string& srcPath, const std::string& dstPath)
+{
+	initTaskArena();
 
-	// if we've only got one grid, save only that one out
-	if (count == 1)
+	if (m_writeMultiChannel && !m_useSparseGrids)
 	{
-		baseGrid = file.readGrid(nameIter.gridName());
+		fprintf(stderr, "Multi-channel files are only supported for sparse grids.\n");
+		return false;
+	}
+
+	GridBounds bounds;
 
-		fprintf(stderr, "Converting single grid: %s...\n", nameIter.gridName().c_str());
+	openvdb::io::File file(srcPath);
 
-		openvdb::FloatGrid::Ptr grid = openvdb::gridPtrCast<openvdb::FloatGrid>(baseGrid);
+	if (!file.open())
+	{
+		fprintf(stderr, "Can't open VDB file: %s\n", srcPath.c_str());
+		return false;
+	}
 
-		saveGrid(grid, bounds, dstPath);
+	if (m_pStats)
+	{
+		m_pStats->addFileRead(srcPath);
 	}
-	else
+
+	mergeFileBounds(file, bounds);
+	resampleBounds(bounds);
+
+	std::vector<GridConversion> grids;
+	bool result = readGridsToConvert(file, dstPath, grids);
+
+	file.close();
+
+	if (m_autoSubCellSize && m_useSparseGrids && !grids.empty())
 	{
-		// otherwise, work out how we're going to name them...
+		m_subCellSize = chooseSubCellSize(grids, bounds);
+	}
 
-		unsigned int dotPos = dstPath.find_last_of(".");
+	if (m_writeMultiChannel && !grids.empty())
+	{
+		// all the grids need to be converted before the file can be written
+		std::vector<ConvertedGrid*> convertedGrids;
+		std::vector<const ConvertedGrid*> channels;
+		std::vector<std::string> channelNames;
 
-		if (dotPos == -1)
+		for (unsigned int i = 0; i < grids.size(); i++)
 		{
-			file.close();
-			return false;
-		}
+			fprintf(stderr, "Converting grid: %s...\n", grids[i].gridName.c_str());
+
+			ConvertedGrid* pConvertedGrid = new ConvertedGrid();
+			result &= convertGrid(grids[i], bounds, *pConvertedGrid);
+			grids[i].resetGrid();
 
-		std::string fileName1 = dstPath.substr(0, dotPos);
-		fileName1 += "_";
+			convertedGrids.push_back(pConvertedGrid);
+			channels.push_back(pConvertedGrid);
+			channelNames.push_back(grids[i].channelName);
+		}
 
-		std::string fileName2 = dstPath.substr(dotPos);
+		result &= writeConvertedChannels(channels, channelNames, dstPath);
 
-		for (; nameIter != file.endName(); ++nameIter)
+		for (unsigned int i = 0; i < convertedGrids.size(); i++)
 		{
-			if (nameIter.gridName() == "density")
-			{
-				baseGrid = file.readGrid(nameIter.gridName());
+			delete convertedGrids[i];
+		}
 
-				fprintf(stderr, "Converting grid: %s...\n", nameIter.gridName().c_str());
+		return result;
+	}
 
-				openvdb::FloatGrid::Ptr grid = openvdb::gridPtrCast<openvdb::FloatGrid>(baseGrid);
+	for (unsigned int i = 0; i < grids.size(); i++)
+	{
+		const GridConversion& gridConversion = grids[i];
 
-				std::string gridSaveFilename = fileName1 + "den" + fileName2;
+		fprintf(stderr, "Converting grid: %s...\n", gridConversion.gridName.c_str());
 
-				saveGrid(grid, bounds, gridSaveFilename);
-			}
-			else if (nameIter.gridName() == "temperature")
-			{
-				baseGrid = file.readGrid(nameIter.gridName());
+		result &= saveGrid(gridConversion, bounds);
+	}
 
-				fprintf(stderr, "Converting grid: %s...\n", nameIter.gridName().c_str());
+	return result;
+}
 
-				openvdb::FloatGrid::Ptr grid = openvdb::gridPtrCast<openvdb::FloatGrid>(baseGrid);
+namespace
+{
 
-				std::string gridSaveFilename = fileName1 + "temp" + fileName2;
+// a frame passing through the sequence conversion pipeline
+struct SequenceFrame
+{
+	SequenceFrame(unsigned int _frame) : frame(_frame), orderIndex(0), memoryCharge(0), failed(false)
+	{
+	}
 
-				saveGrid(grid, bounds, gridSaveFilename);
-			}
+	~SequenceFrame()
+	{
+		for (unsigned int i = 0; i < convertedGrids.size(); i++)
+		{
+			delete convertedGrids[i];
 		}
 	}
 
-	file.close();
+	unsigned int					frame;
+	// the position of the frame within the ones being converted, for writing them in order
+	unsigned int					orderIndex;
 
-	return true;
-}
+	// the bounds to convert the frame with - the sequence's, unless it's using per-frame bounds
+	GridBounds						bounds;
+
+	std::vector<GridConversion>		grids;
+	std::vector<ConvertedGrid*>		convertedGrids;
+
+	// the memory this frame is charged for in the FrameBudget
+	size_t							memoryCharge;
+
+	// if any of the grids couldn't be converted, in which case none of them are written
+	bool							failed;
+};
+
+} // namespace
 
 bool VDBConverter::convertSequence(const std::string& srcPath, const std::string& dstPath)
 {
-	GridBounds bounds;
+	initTaskArena();
 
-	unsigned int startFrame = 1;
-	unsigned int endFrame = 137;
-	endFrame = 45;
+	if (m_writeMultiChannel && !m_useSparseGrids)
+	{
+		fprintf(stderr, "Multi-channel files are only supported for sparse grids.\n");
+		return false;
+	}
 
-	// work out the overall bounds for all frames up-front...
+	// find the full frame range of the sequence on disk - even if we're only converting some of the
+	// frames, the bounds need to cover all of them, so that every frame's consistent
+	unsigned int sequenceStartFrame = 0;
+	unsigned int sequenceEndFrame = 0;
 
-	for (unsigned int fr = startFrame; fr <= endFrame; fr++)
+	if (!findSequenceFrameRange(srcPath, sequenceStartFrame, sequenceEndFrame))
 	{
-		std::string realSourceFile = getFrameFileName(srcPath, fr);
-
-		openvdb::io::File file(realSourceFile);
+		fprintf(stderr, "Couldn't find any frames for sequence: %s\n", srcPath.c_str());
+		return false;
+	}
 
-		file.open();
+	// work out the overall bounds for all frames up-front...
 
-		openvdb::GridBase::Ptr baseGrid;
-		openvdb::io::File::NameIterator nameIter = file.beginName();
+	GridBounds bounds;
 
-		for (; nameIter != file.endName(); ++nameIter)
-		{
-			// readGridMetadata doesn't seem to be any faster than just readGrid() in 3.0...
-			baseGrid = file.readGrid(nameIter.gridName());
+	if (!getSequenceBounds(srcPath, dstPath, sequenceStartFrame, sequenceEndFrame, bounds))
+		return false;
 
-			openvdb::FloatGrid::Ptr grid = openvdb::gridPtrCast<openvdb::FloatGrid>(baseGrid);
+	if (m_boundsOnly)
+		return true;
 
-			bounds.mergeGrid(grid);
-		}
+	// the manifest always has the source bounds, so it doesn't depend on the resampling
+	resampleBounds(bounds);
 
-		file.close();
+	if (m_temporalDelta && !m_useSparseGrids)
+	{
+		fprintf(stderr, "Temporal delta encoding is only supported for sparse grids, so won't be used.\n");
 	}
 
-	// now loop through again
+	if (m_autoSubCellSize && m_useSparseGrids)
+	{
+		// this is chosen from the middle frame of the whole sequence (or the first one if that's missing), rather
+		// than from the frames being converted, so every frame - and every shard - uses the same size
+		unsigned int sampleFrames[2] = { sequenceStartFrame + (sequenceEndFrame - sequenceStartFrame) / 2, sequenceStartFrame };
 
-	openvdb::Coord lastDenMin;
-	openvdb::Coord lastDenMax;
-	openvdb::Coord lastTempMin;
-	openvdb::Coord lastTempMax;
+		for (unsigned int i = 0; i < 2; i++)
+		{
+			openvdb::io::File file(getFrameFileName(srcPath, sampleFrames[i]));
 
-	for (unsigned int fr = startFrame; fr <= endFrame; fr++)
-	{
-		std::string realSourceFile = getFrameFileName(srcPath, fr);
+			if (!file.open())
+				continue;
 
-		std::string realDestFile = getFrameFileName(dstPath, fr);
+			std::vector<GridConversion> grids;
+			readGridsToConvert(file, getFrameFileName(dstPath, sampleFrames[i]), grids);
 
-		openvdb::io::File file(realSourceFile);
+			file.close();
 
-		if (!file.open())
-		{
-			fprintf(stderr, "Can't open VDB file: %s\n", realSourceFile.c_str());
-			continue;
+			if (!grids.empty())
+			{
+				fprintf(stderr, "Choosing sub cell size from frame: %u\n", sampleFrames[i]);
+				m_subCellSize = chooseSubCellSize(grids, bounds);
+				break;
+			}
 		}
+	}
 
-		openvdb::GridBase::Ptr baseGrid;
+	unsigned int startFrame = sequenceStartFrame;
+	unsigned int endFrame = sequenceEndFrame;
 
-		openvdb::io::File::NameIterator nameIter = file.beginName();
+	if (m_haveFrameRange)
+	{
+		startFrame = m_startFrame;
+		endFrame = m_endFrame;
+	}
 
-		unsigned int count = 0;
+	std::vector<unsigned int> framesToConvert;
+	getShardFrames(startFrame, endFrame, framesToConvert);
 
-		for (; nameIter != file.endName(); ++nameIter)
-		{
-			count++;
-		}
+	if (m_pStats)
+	{
+		m_pStats->setOverlappingPhases(true);
+	}
+
+	if (m_shardCount > 1)
+	{
+		fprintf(stderr, "Converting %u frames for shard %u/%u.\n", (unsigned int)framesToConvert.size(), m_shardIndex, m_shardCount);
+	}
 
-		nameIter = file.beginName();
+	// now convert the frames. This is done as a pipeline so that multiple frames can be in flight
+	// at once: a reader thread reads the grids for each frame in order, a set of converter threads
+	// extract the voxel values, and this thread writes them out. The number of frames in flight
+	// and the memory they use is limited by the FrameBudget, which the reader waits on.
 
-		// if we've only got one grid, save only that one out
-		if (count == 1)
-		{
-			baseGrid = file.readGrid(nameIter.gridName());
+	unsigned int maxFramesInFlight = m_maxFramesInFlight;
+	if (maxFramesInFlight == 0)
+	{
+		maxFramesInFlight = (m_numThreads > 0) ? m_numThreads : std::max(std::thread::hardware_concurrency(), 1u);
+	}
 
-			fprintf(stderr, "Converting single grid: %s, frame %d...\n", nameIter.gridName().c_str(), fr);
+	size_t memoryLimit = m_memoryLimit;
+	if (memoryLimit == 0)
+	{
+		// default to half the physical memory
+		memoryLimit = (size_t)sysconf(_SC_PHYS_PAGES) * (size_t)sysconf(_SC_PAGE_SIZE) / 2;
+	}
 
-			openvdb::FloatGrid::Ptr grid = openvdb::gridPtrCast<openvdb::FloatGrid>(baseGrid);
+	FrameBudget frameBudget(maxFramesInFlight, memoryLimit);
 
-			saveGrid(grid, bounds, realDestFile);
-		}
-		else
-		{
-			// otherwise, work out how we're going to name them...
+	PipelineQueue<SequenceFrame*> convertQueue;
+	PipelineQueue<SequenceFrame*> writeQueue;
 
-			unsigned int dotPos = realDestFile.find_last_of(".");
+	// frames which couldn't be read, converted or written, from both the reader thread and this one
+	std::mutex failedFramesLock;
+	std::vector<unsigned int> failedFrames;
 
-			if (dotPos == -1)
-			{
-				file.close();
-				return -1;
-			}
+	auto addFailedFrame = [&](unsigned int frame)
+	{
+		std::lock_guard<std::mutex> guard(failedFramesLock);
+		failedFrames.push_back(frame);
+	};
 
-			fprintf(stderr, "Converting grid frame: %d: ", fr);
+	std::thread readerThread([&]()
+	{
+		unsigned int numFramesRead = 0;
 
-			std::string fileName1 = realDestFile.substr(0, dotPos);
-			fileName1 += "_";
+		for (unsigned int frameIndex = 0; frameIndex < framesToConvert.size(); frameIndex++)
+		{
+			unsigned int fr = framesToConvert[frameIndex];
 
-			std::string fileName2 = realDestFile.substr(dotPos);
+			std::string realSourceFile = getFrameFileName(srcPath, fr);
 
-			for (; nameIter != file.endName(); ++nameIter)
-			{
-				if (nameIter.gridName() == "density")
-				{
-					baseGrid = file.readGrid(nameIter.gridName());
+			std::string realDestFile = getFrameFileName(dstPath, fr);
 
-					fprintf(stderr, "%s,", nameIter.gridName().c_str());
+			// OpenVDB throws on corrupt files, which would otherwise terminate the whole conversion
+			SequenceFrame* pFrame = NULL;
+			bool frameAcquired = false;
 
-					openvdb::FloatGrid::Ptr grid = openvdb::gridPtrCast<openvdb::FloatGrid>(baseGrid);
+			try
+			{
+				openvdb::io::File file(realSourceFile);
 
-					openvdb::CoordBBox bbox = grid->evalActiveVoxelBoundingBox();
+				if (!file.open())
+				{
+					fprintf(stderr, "Can't open VDB file: %s\n", realSourceFile.c_str());
+					addFailedFrame(fr);
+					continue;
+				}
 
-					openvdb::Coord thisDenMin = bbox.min();
-					openvdb::Coord thisDenMax = bbox.max();
+				if (m_pStats)
+				{
+					m_pStats->addFileRead(realSourceFile);
+				}
 
-					std::string gridSaveName = fileName1 + "den" + fileName2;
+				pFrame = new SequenceFrame(fr);
 
-					int offsetX = (thisDenMax - lastDenMin).x() / 2;
-					int offsetZ = (thisDenMax - lastDenMin).z() / 2;
+				pFrame->bounds = bounds;
+				if (m_perFrameBounds)
+				{
+					// the frame's own bounds, which are within the sequence's. Frames with nothing in them
+					// still need a valid grid, so get a single voxel.
+					pFrame->bounds = GridBounds();
+					mergeFileBounds(file, pFrame->bounds);
+					resampleBounds(pFrame->bounds);
 
-					if (fr == startFrame)
+					if (pFrame->bounds.isEmpty())
 					{
-						saveGrid(grid, bounds, gridSaveName);
+						pFrame->bounds.min = bounds.min;
+						pFrame->bounds.max = bounds.min;
 					}
-					else
-					{
-						saveGrid(grid, bounds, gridSaveName);
-					}
-
-					lastDenMin = thisDenMin;
-					lastDenMax = thisDenMax;
 				}
-				else if (nameIter.gridName() == "temperature")
-				{
-					baseGrid = file.readGrid(nameIter.gridName());
 
-					fprintf(stderr, "%s,", nameIter.gridName().c_str());
+				// the frame has to fit in the budget before its grids are read, otherwise a whole extra frame would
+				// be in memory while it waited, so it's charged for an estimate from the grids' metadata first
+				size_t estimatedMemory = estimateFileMemorySize(file, pFrame->bounds);
 
-					openvdb::FloatGrid::Ptr grid = openvdb::gridPtrCast<openvdb::FloatGrid>(baseGrid);
+				frameBudget.acquire(estimatedMemory);
+				pFrame->memoryCharge = estimatedMemory;
+				frameAcquired = true;
 
-					openvdb::CoordBBox bbox = grid->evalActiveVoxelBoundingBox();
+				if (!readGridsToConvert(file, realDestFile, pFrame->grids))
+				{
+					fprintf(stderr, "Couldn't read the grids to convert from VDB file: %s\n", realSourceFile.c_str());
+					frameBudget.release(pFrame->memoryCharge);
+					delete pFrame;
+					addFailedFrame(fr);
+					continue;
+				}
 
-					openvdb::Coord thisTempMin = bbox.min();
-					openvdb::Coord thisTempMax = bbox.max();
+				file.close();
 
-					std::string gridSaveName = fileName1 + "temp" + fileName2;
+				// now the grids are read, the frame's charged for their real size and our estimate of the converted
+				// data - the converter will correct this once it knows the real converted size
+				size_t frameMemory = 0;
+				for (unsigned int i = 0; i < pFrame->grids.size(); i++)
+				{
+					const GridConversion& gridConversion = pFrame->grids[i];
+					frameMemory += gridConversion.getGrid()->memUsage() + estimateConvertedMemorySize(gridConversion.vectorGrid != NULL,
+																									   gridConversion.getGrid()->activeVoxelCount(), pFrame->bounds);
+				}
 
-					int offsetX = (thisTempMax - lastTempMax).x() / 2;
-					int offsetZ = (thisTempMax - lastTempMax).z() / 2;
+				frameBudget.adjust(pFrame->memoryCharge, frameMemory);
+				pFrame->memoryCharge = frameMemory;
 
-					if (fr == startFrame)
-					{
-						saveGrid(grid, bounds, gridSaveName);
-					}
-					else
-					{
-						saveGrid(grid, bounds, gridSaveName);
-					}
+				// the order index is only given to frames which get converted, as the writer waits for each in turn
+				pFrame->orderIndex = numFramesRead++;
 
-					lastTempMax = thisTempMax;
-					lastTempMin = thisTempMin;
+				convertQueue.push(pFrame);
+			}
+			catch (const std::exception& e)
+			{
+				fprintf(stderr, "Couldn't read VDB file: %s: %s\n", realSourceFile.c_str(), e.what());
+				if (frameAcquired)
+				{
+					frameBudget.release(pFrame->memoryCharge);
 				}
+				delete pFrame;
+				addFailedFrame(fr);
 			}
-
-			fprintf(stderr, "\n");
 		}
 
-		file.close();
-	}
+		convertQueue.close();
+	});
 
-	return true;
-}
+	unsigned int numConverters = maxFramesInFlight;
+	std::atomic<unsigned int> activeConverters(numConverters);
 
-bool VDBConverter::saveGrid(openvdb::FloatGrid::Ptr grid, const GridBounds& bounds, const std::string& path) const
-{
-	if (!m_useSparseGrids)
+	std::vector<std::thread> converterThreads;
+	for (unsigned int i = 0; i < numConverters; i++)
 	{
-		return saveDenseGrid(grid, bounds, path);
-	}
-	else
-	{
-		return saveSparseGrid(grid, bounds, path);
-	}
-}
+		converterThreads.push_back(std::thread([&]()
+		{
+			SequenceFrame* pFrame = NULL;
+			while (convertQueue.pop(pFrame))
+			{
+				// failed frames still go to the writer, so it can keep the frames in order
+				try
+				{
+					for (unsigned int gridIndex = 0; gridIndex < pFrame->grids.size(); gridIndex++)
+					{
+						ConvertedGrid* pConvertedGrid = new ConvertedGrid();
+						pFrame->convertedGrids.push_back(pConvertedGrid);
 
-bool VDBConverter::saveDenseGrid(openvdb::FloatGrid::Ptr grid, const GridBounds& bounds, const std::string& path) const
-{
-	openvdb::FloatGrid::Accessor accessor = grid->getAccessor();
+						if (!convertGrid(pFrame->grids[gridIndex], pFrame->bounds, *pConvertedGrid))
+						{
+							fprintf(stderr, "Couldn't convert grid: %s of frame: %u\n", pFrame->grids[gridIndex].gridName.c_str(), pFrame->frame);
+							pFrame->failed = true;
+						}
 
-	openvdb::Coord ijk;
-	int &i = ijk[0];
-	int &j = ijk[1];
-	int &k = ijk[2];
+						// we don't need the source grid any more
+						pFrame->grids[gridIndex].resetGrid();
+					}
+				}
+				catch (const std::exception& e)
+				{
+					fprintf(stderr, "Couldn't convert frame: %u: %s\n", pFrame->frame, e.what());
+					pFrame->failed = true;
+				}
+
+				size_t convertedMemory = 0;
+				for (unsigned int gridIndex = 0; gridIndex < pFrame->convertedGrids.size(); gridIndex++)
+				{
+					convertedMemory += pFrame->convertedGrids[gridIndex]->getMemorySize();
+				}
 
-	float value = 0.0f;
+				frameBudget.adjust(pFrame->memoryCharge, convertedMemory);
+				pFrame->memoryCharge = convertedMemory;
 
-	unsigned char version = 3;
+				writeQueue.push(pFrame);
+			}
 
-	unsigned int gridResX = bounds.max.x() - bounds.min.x() + 1;
-	unsigned int gridResY = bounds.max.y() - bounds.min.y() + 1;
-	unsigned int gridResZ = bounds.max.z() - bounds.min.z() + 1;
+			// the last converter to finish closes the write queue
+			if (--activeConverters == 0)
+			{
+				writeQueue.close();
+			}
+		}));
+	}
 
-	openvdb::Vec3f extent((float)gridResX, (float)gridResY, (float)gridResZ);
-	extent.normalize();
+	// for temporal delta encoding, the previous frame written, and its grids (by name) with the values
+	// the next frame's subcells are compared against
+	bool temporalDelta = m_temporalDelta && m_useSparseGrids;
+	bool haveReferenceFrame = false;
+	unsigned int referenceFrame = 0;
+	unsigned int framesSinceKeyframe = 0;
+	std::map<std::string, ConvertedGrid*> referenceGrids;
+	// the reference grids are outside any frame, but still count towards the memory limit
+	size_t referenceMemory = 0;
+
+	auto clearReferenceGrids = [&]()
+	{
+		for (std::map<std::string, ConvertedGrid*>::iterator itReference = referenceGrids.begin(); itReference != referenceGrids.end(); ++itReference)
+		{
+			delete itReference->second;
+		}
+		referenceGrids.clear();
+	};
 
-	extent *= m_sizeMultiplier;
+	// frames converted before the ones before them wait here if they need to be written in order
+	std::map<unsigned int, SequenceFrame*> readyFrames;
+	unsigned int nextOrderIndex = 0;
 
-	float bbMinX = -extent.x();
-	float bbMinY = -extent.y();
-	float bbMinZ = -extent.z();
+	SequenceFrame* pFrame = NULL;
+	while (writeQueue.pop(pFrame))
+	{
+		readyFrames[pFrame->orderIndex] = pFrame;
 
-	float bbMaxX = extent.x();
-	float bbMaxY = extent.y();
-	float bbMaxZ = extent.z();
+		// temporal delta encoding needs the frames in order - otherwise it's whatever's ready first
+		while (!readyFrames.empty() && (!temporalDelta || readyFrames.begin()->first == nextOrderIndex))
+		{
+			pFrame = readyFrames.begin()->second;
+			readyFrames.erase(readyFrames.begin());
+			nextOrderIndex++;
 
-	FILE* pFinalFile = fopen(path.c_str(), "wb");
+			bool frameWritten = false;
 
-	if (!pFinalFile)
-	{
-		fprintf(stderr, "Couldn't open file: %s for writing.\n", path.c_str());
-		return false;
-	}
+			if (pFrame->failed)
+			{
+				fprintf(stderr, "Not writing frame: %u, as it couldn't be converted.\n", pFrame->frame);
+			}
+			else
+			{
+				try
+				{
+					fprintf(stderr, "Converting grid frame: %d: ", pFrame->frame);
 
-	fwrite(&version, 1, 1, pFinalFile);
+					bool keyframe = !haveReferenceFrame || framesSinceKeyframe + 1 >= m_keyframeInterval;
 
-	unsigned char dataType = 0;
-	if (m_storeAsHalf)
-		dataType = 1;
+					std::vector<const ConvertedGrid*> channels;
+					std::vector<std::string> channelNames;
 
-	fwrite(&dataType, 1, 1, pFinalFile);
+					frameWritten = true;
 
-	unsigned char gridType = 0; // dense
-	fwrite(&gridType, sizeof(unsigned char), 1, pFinalFile);
+					for (unsigned int i = 0; i < pFrame->convertedGrids.size(); i++)
+					{
+						fprintf(stderr, "%s,", pFrame->grids[i].gridName.c_str());
+
+						ConvertedGrid* pConvertedGrid = pFrame->convertedGrids[i];
+
+						if (m_perFrameBounds)
+						{
+							pConvertedGrid->hasFrameOffset = true;
+							pConvertedGrid->sequenceBounds = bounds;
+						}
+
+						if (temporalDelta)
+						{
+							pConvertedGrid->temporalDelta = true;
+							pConvertedGrid->frame = pFrame->frame;
+							pConvertedGrid->referenceFrame = keyframe ? pFrame->frame : referenceFrame;
+
+							// grids which weren't in the previous frame just don't have any references
+							std::map<std::string, ConvertedGrid*>::const_iterator itReference = referenceGrids.find(pFrame->grids[i].gridName);
+							if (!keyframe && itReference != referenceGrids.end())
+							{
+								applyTemporalReference(*pConvertedGrid, *itReference->second);
+							}
+						}
+
+						if (m_writeMultiChannel)
+						{
+							channels.push_back(pConvertedGrid);
+							channelNames.push_back(pFrame->grids[i].channelName);
+						}
+						else
+						{
+							frameWritten &= writeConvertedGrid(*pConvertedGrid, pFrame->grids[i].destPath);
+						}
+					}
 
-	fwrite(&gridResX, sizeof(unsigned int), 1, pFinalFile);
-	fwrite(&gridResY, sizeof(unsigned int), 1, pFinalFile);
-	fwrite(&gridResZ, sizeof(unsigned int), 1, pFinalFile);
+					if (!channels.empty())
+					{
+						// all the grids have the same destination path
+						frameWritten &= writeConvertedChannels(channels, channelNames, pFrame->grids[0].destPath);
+					}
 
-	fwrite(&bbMinX, sizeof(float), 1, pFinalFile);
-	fwrite(&bbMinY, sizeof(float), 1, pFinalFile);
-	fwrite(&bbMinZ, sizeof(float), 1, pFinalFile);
+					fprintf(stderr, "\n");
 
-	fwrite(&bbMaxX, sizeof(float), 1, pFinalFile);
-	fwrite(&bbMaxY, sizeof(float), 1, pFinalFile);
-	fwrite(&bbMaxZ, sizeof(float), 1, pFinalFile);
+					if (temporalDelta && frameWritten)
+					{
+						// this frame's grids are now what the next frame refers to, so they're kept rather than freed with the frame
+						clearReferenceGrids();
 
-	unsigned int totalNumVoxels = gridResX * gridResY * gridResZ;
+						size_t newReferenceMemory = 0;
 
-	// TODO: do we even need to allocate this memory? we can just write the values
-	//       directly... - assuming the axis order is correct, but we can modify that
-	//       on the read side of things if needed (but that will make reading slower)...
+						for (unsigned int i = 0; i < pFrame->convertedGrids.size(); i++)
+						{
+							newReferenceMemory += pFrame->convertedGrids[i]->getMemorySize();
 
-	if (!m_storeAsHalf)
-	{
-		float* pFinalValues = new float[totalNumVoxels];
-		memset(pFinalValues, 0, sizeof(float) * totalNumVoxels);
+							referenceGrids[pFrame->grids[i].gridName] = pFrame->convertedGrids[i];
+							pFrame->convertedGrids[i] = NULL;
+						}
 
-		float* pFin = pFinalValues;
+						frameBudget.adjust(referenceMemory, newReferenceMemory);
+						referenceMemory = newReferenceMemory;
 
-		for (k = bounds.min.z(); k <= bounds.max.z(); k++)
-		{
-			for (j = bounds.min.y(); j <= bounds.max.y(); j++)
+						haveReferenceFrame = true;
+						referenceFrame = pFrame->frame;
+						framesSinceKeyframe = keyframe ? 0 : framesSinceKeyframe + 1;
+					}
+				}
+				catch (const std::exception& e)
+				{
+					fprintf(stderr, "\nCouldn't write frame: %u: %s\n", pFrame->frame, e.what());
+					frameWritten = false;
+				}
+			}
+
+			if (!frameWritten)
 			{
-				for (i = bounds.min.x(); i <= bounds.max.x(); i++)
+				addFailedFrame(pFrame->frame);
+
+				// the next frame can't refer to one which wasn't written, so it has to be a keyframe
+				if (temporalDelta)
 				{
-					value = accessor.getValue(ijk) * m_valueMultiplier;
-					*(pFin++) = value;
+					clearReferenceGrids();
+					frameBudget.adjust(referenceMemory, 0);
+					referenceMemory = 0;
+					haveReferenceFrame = false;
 				}
 			}
+
+			frameBudget.release(pFrame->memoryCharge);
+			delete pFrame;
 		}
+	}
 
-		fwrite(pFinalValues, sizeof(float) * totalNumVoxels, 1, pFinalFile);
+	clearReferenceGrids();
 
-		delete [] pFinalValues;
-	}
-	else
+	readerThread.join();
+
+	for (unsigned int i = 0; i < converterThreads.size(); i++)
 	{
-		half* pFinalValues = new half[totalNumVoxels];
-		memset(pFinalValues, 0, sizeof(half) * totalNumVoxels);
+		converterThreads[i].join();
+	}
 
-		half* pFin = pFinalValues;
+	if (!failedFrames.empty())
+	{
+		std::sort(failedFrames.begin(), failedFrames.end());
 
-		for (k = bounds.min.z(); k <= bounds.max.z(); k++)
+		fprintf(stderr, "Failed to convert %u of %u frames:", (unsigned int)failedFrames.size(), (unsigned int)framesToConvert.size());
+		for (unsigned int i = 0; i < failedFrames.size(); i++)
 		{
-			for (j = bounds.min.y(); j <= bounds.max.y(); j++)
-			{
-				for (i = bounds.min.x(); i <= bounds.max.x(); i++)
-				{
-					value = accessor.getValue(ijk) * m_storeAsHalf;
-					*(pFin++) = (half)value;
-				}
-			}
+			fprintf(stderr, " %u", failedFrames[i]);
 		}
+		fprintf(stderr, "\n");
 
-		fwrite(pFinalValues, sizeof(half) * totalNumVoxels, 1, pFinalFile);
-
-		delete [] pFinalValues;
+		return false;
 	}
 
-	fclose(pFinalFile);
-
 	return true;
 }
 
-bool VDBConverter::saveSparseGrid(openvdb::FloatGrid::Ptr grid, const GridBounds& bounds, const std::string& path) const
+bool VDBConverter::getSequenceBounds(const std::string& srcPath, const std::string& dstPath, unsigned int startFrame,
+									 unsigned int endFrame, GridBounds& bounds) const
 {
-	openvdb::FloatGrid::Accessor accessor = grid->getAccessor();
+	std::string manifestPath = m_boundsManifestPath.empty() ? getDefaultBoundsManifestPath(dstPath) : m_boundsManifestPath;
 
-	openvdb::Coord ijk;
-	int &i = ijk[0];
-	int &j = ijk[1];
+	// it's fine if this doesn't exist yet
+	BoundsManifest manifest;
+	manifest.load(manifestPath, getBoundsSettingsKey());
+
+	// work out which frames we don't have up-to-date bounds for
+	std::vector<unsigned int> missingFrames;
+	std::vector<int64_t> missingFrameMTimes;
+
+	for (unsigned int fr = startFrame; fr <= endFrame; fr++)
+	{
+		std::string realSourceFile = getFrameFileName(srcPath, fr);
+
+		int64_t sourceMTime = BoundsManifest::getFileModificationTime(realSourceFile);
+
+		if (sourceMTime == 0)
+		{
+			fprintf(stderr, "Can't find VDB file: %s\n", realSourceFile.c_str());
+			continue;
+		}
+
+		if (!manifest.getFrameEntry(fr, sourceMTime))
+		{
+			missingFrames.push_back(fr);
+			missingFrameMTimes.push_back(sourceMTime);
+		}
+	}
+
+	if (!missingFrames.empty())
+	{
+		fprintf(stderr, "Calculating bounds for %u frames...\n", (unsigned int)missingFrames.size());
+
+		// the frames are independent, so can be done in parallel
+		std::vector<GridBounds> missingFrameBounds(missingFrames.size());
+		std::vector<char> missingFrameValid(missingFrames.size(), 0);
+
+		m_taskArena.execute([&]()
+		{
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, missingFrames.size(), 1), [&](const tbb::blocked_range<size_t>& range)
+			{
+				for (size_t i = range.begin(); i != range.end(); i++)
+				{
+					std::string realSourceFile = getFrameFileName(srcPath, missingFrames[i]);
+
+					openvdb::io::File file(realSourceFile);
+
+					if (!file.open())
+					{
+						fprintf(stderr, "Can't open VDB file: %s\n", realSourceFile.c_str());
+						continue;
+					}
+
+					mergeFileBounds(file, missingFrameBounds[i]);
+
+					file.close();
+
+					missingFrameValid[i] = 1;
+				}
+			});
+		});
+
+		for (unsigned int i = 0; i < missingFrames.size(); i++)
+		{
+			if (missingFrameValid[i])
+			{
+				manifest.setFrameEntry(missingFrames[i], missingFrameMTimes[i], missingFrameBounds[i]);
+			}
+		}
+
+		// not being able to save it isn't fatal, it just means it'll need to be worked out again next time
+		manifest.save(manifestPath);
+	}
+
+	bounds = manifest.getGlobalBounds(startFrame, endFrame);
+
+	if (bounds.isEmpty())
+	{
+		fprintf(stderr, "No active voxels found in sequence: %s\n", srcPath.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+void VDBConverter::getShardFrames(unsigned int startFrame, unsigned int endFrame, std::vector<unsigned int>& frames) const
+{
+	if (endFrame < startFrame)
+		return;
+
+	uint64_t numFrames = endFrame - startFrame + 1;
+	uint64_t shardCount = std::max(m_shardCount, 1u);
+
+	// split the frames into contiguous blocks, as evenly as possible
+	unsigned int shardStart = startFrame + (unsigned int)((numFrames * m_shardIndex) / shardCount);
+	unsigned int shardEnd = startFrame + (unsigned int)((numFrames * (m_shardIndex + 1)) / shardCount);
+
+	for (unsigned int fr = shardStart; fr < shardEnd; fr++)
+	{
+		frames.push_back(fr);
+	}
+}
+
+std::string VDBConverter::getBoundsSettingsKey() const
+{
+	// the grids which are converted change the bounds. The manifest has the source bounds, so they don't really
+	// depend on multi-channel output or the resampling, but they're included so a manifest is never shared between
+	// different conversions
+	std::vector<std::string> gridNames;
+	for (unsigned int i = 0; i < m_gridMappings.size(); i++)
+	{
+		gridNames.push_back(m_gridMappings[i].first);
+	}
+
+	std::sort(gridNames.begin(), gridNames.end());
+
+	std::string settingsKey = "grids";
+	if (gridNames.empty())
+	{
+		settingsKey += " <default>";
+	}
+
+	for (unsigned int i = 0; i < gridNames.size(); i++)
+	{
+		settingsKey += " " + gridNames[i];
+	}
+
+	if (m_writeMultiChannel)
+	{
+		settingsKey += " channels";
+	}
+
+	char szResample[32];
+	sprintf(szResample, " resample %u", std::max(m_resampleFactor, 1u));
+	settingsKey += szResample;
+
+	return settingsKey;
+}
+
+void VDBConverter::mergeFileBounds(openvdb::io::File& file, GridBounds& bounds) const
+{
+	// VDB files store the active voxel bounds of each grid as metadata when they're written, so
+	// we can get those from just the grid metadata, without having to read and decompress the
+	// grids themselves. If the metadata's not there (old or unusually-written files), we have
+	// to fall back to reading the full grid.
+
+	ScopedPhaseTimer timer(m_pStats, eConversionPhaseBounds);
+
+	openvdb::GridPtrVecPtr gridsMetadata = file.readAllGridMetadata();
+
+	openvdb::GridPtrVec::const_iterator itGrid = gridsMetadata->begin();
+	for (; itGrid != gridsMetadata->end(); ++itGrid)
+	{
+		const openvdb::GridBase::Ptr& baseGrid = *itGrid;
+
+		// vector grids are only converted if they're asked for (or are the only grid), so they
+		// don't change the bounds otherwise
+		bool isVectorGrid = baseGrid->isType<openvdb::Vec3SGrid>();
+		bool vectorGridUsed = m_gridMappings.empty() ? gridsMetadata->size() == 1 : !getMappedChannelName(baseGrid->getName()).empty();
+
+		if (!baseGrid->isType<openvdb::FloatGrid>() && !(isVectorGrid && vectorGridUsed))
+			continue;
+
+		openvdb::Vec3IMetadata::Ptr bboxMin = baseGrid->getMetadata<openvdb::Vec3IMetadata>(openvdb::GridBase::META_FILE_BBOX_MIN);
+		openvdb::Vec3IMetadata::Ptr bboxMax = baseGrid->getMetadata<openvdb::Vec3IMetadata>(openvdb::GridBase::META_FILE_BBOX_MAX);
+
+		if (bboxMin && bboxMax)
+		{
+			bounds.mergeBBox(openvdb::CoordBBox(openvdb::Coord(bboxMin->value()), openvdb::Coord(bboxMax->value())));
+			continue;
+		}
+
+		openvdb::GridBase::Ptr grid = file.readGrid(baseGrid->getName());
+
+		if (grid)
+		{
+			bounds.mergeGrid(grid);
+		}
+	}
+}
+
+bool VDBConverter::readGridsToConvert(openvdb::io::File& file, const std::string& dstPath, std::vector<GridConversion>& grids) const
+{
+	ScopedPhaseTimer timer(m_pStats, eConversionPhaseRead);
+
+	// work out which grids we're going to convert, and what's added to the destination path for each of them
+	std::vector<GridConversion> gridsToConvert;
+	std::vector<std::string> pathSuffixes;
+
+	// whether there's only one grid, which is saved to the destination path as-is
+	bool singleGrid = false;
+
+	if (!m_gridMappings.empty())
+	{
+		for (unsigned int i = 0; i < m_gridMappings.size(); i++)
+		{
+			GridConversion gridConversion;
+			gridConversion.gridName = m_gridMappings[i].first;
+			gridConversion.channelName = m_gridMappings[i].second;
+
+			gridsToConvert.push_back(gridConversion);
+			pathSuffixes.push_back(m_gridMappings[i].second);
+		}
+
+		singleGrid = (m_gridMappings.size() == 1);
+	}
+	else
+	{
+		unsigned int count = 0;
+
+		openvdb::io::File::NameIterator nameIter = file.beginName();
+
+		for (; nameIter != file.endName(); ++nameIter)
+		{
+			count++;
+		}
+
+		// if we've only got one grid, save only that one out
+		singleGrid = (count == 1);
+
+		for (nameIter = file.beginName(); nameIter != file.endName(); ++nameIter)
+		{
+			std::string suffix;
+
+			if (nameIter.gridName() == "density")
+			{
+				suffix = "den";
+			}
+			else if (nameIter.gridName() == "temperature")
+			{
+				suffix = "temp";
+			}
+			else if (!singleGrid)
+			{
+				continue;
+			}
+
+			GridConversion gridConversion;
+			gridConversion.gridName = nameIter.gridName();
+			gridConversion.channelName = nameIter.gridName();
+
+			gridsToConvert.push_back(gridConversion);
+			pathSuffixes.push_back(suffix);
+		}
+	}
+
+	// if there's more than one, work out how we're going to name them...
+
+	std::string fileName1;
+	std::string fileName2;
+
+	if (!singleGrid && !m_writeMultiChannel)
+	{
+		size_t dotPos = dstPath.find_last_of(".");
+
+		if (dotPos == std::string::npos)
+		{
+			fprintf(stderr, "Destination path: %s needs an extension to save multiple grids.\n", dstPath.c_str());
+			return false;
+		}
+
+		fileName1 = dstPath.substr(0, dotPos) + "_";
+		fileName2 = dstPath.substr(dotPos);
+	}
+
+	for (unsigned int i = 0; i < gridsToConvert.size(); i++)
+	{
+		GridConversion& gridConversion = gridsToConvert[i];
+
+		// for multi-channel files, all the grids go in the same file
+		bool useDstPath = singleGrid || m_writeMultiChannel;
+		gridConversion.destPath = useDstPath ? dstPath : fileName1 + pathSuffixes[i] + fileName2;
+
+		if (!readGridToConvert(file, gridConversion))
+		{
+			if (singleGrid)
+				return false;
+
+			continue;
+		}
+
+		grids.push_back(gridConversion);
+	}
+
+	return true;
+}
+
+bool VDBConverter::readGridToConvert(openvdb::io::File& file, GridConversion& gridConversion) const
+{
+	if (!file.hasGrid(gridConversion.gridName))
+	{
+		fprintf(stderr, "Can't find grid: %s\n", gridConversion.gridName.c_str());
+		return false;
+	}
+
+	openvdb::GridBase::Ptr baseGrid = file.readGrid(gridConversion.gridName);
+
+	if (baseGrid->isType<openvdb::FloatGrid>())
+	{
+		gridConversion.grid = openvdb::gridPtrCast<openvdb::FloatGrid>(baseGrid);
+
+		if (m_resampleFactor > 1)
+		{
+			gridConversion.grid = resampleGrid<openvdb::FloatGrid>(gridConversion.grid);
+		}
+		return true;
+	}
+
+	if (baseGrid->isType<openvdb::Vec3SGrid>())
+	{
+		if (!m_useSparseGrids)
+		{
+			fprintf(stderr, "Vector grid: %s can only be converted to a sparse grid.\n", gridConversion.gridName.c_str());
+			return false;
+		}
+
+		gridConversion.vectorGrid = openvdb::gridPtrCast<openvdb::Vec3SGrid>(baseGrid);
+
+		if (m_resampleFactor > 1)
+		{
+			gridConversion.vectorGrid = resampleGrid<openvdb::Vec3SGrid>(gridConversion.vectorGrid);
+		}
+		return true;
+	}
+
+	fprintf(stderr, "Grid: %s is not a float or vector grid.\n", gridConversion.gridName.c_str());
+	return false;
+}
+
+void VDBConverter::resampleBounds(GridBounds& bounds) const
+{
+	if (m_resampleFactor <= 1 || bounds.isEmpty())
+		return;
+
+	// each resampled voxel covers the source voxels from factor times its index, so this rounds
+	// down for negative indices too
+	float factor = (float)m_resampleFactor;
+
+	for (unsigned int axis = 0; axis < 3; axis++)
+	{
+		bounds.min[axis] = std::floor(bounds.min[axis] / factor);
+		bounds.max[axis] = std::floor(bounds.max[axis] / factor);
+	}
+}
+
+size_t VDBConverter::estimateFileMemorySize(openvdb::io::File& file, const GridBounds& bounds) const
+{
+	openvdb::GridPtrVecPtr gridsMetadata = file.readAllGridMetadata();
+
+	size_t memorySize = 0;
+
+	openvdb::GridPtrVec::const_iterator itGrid = gridsMetadata->begin();
+	for (; itGrid != gridsMetadata->end(); ++itGrid)
+	{
+		const openvdb::GridBase::Ptr& baseGrid = *itGrid;
+
+		bool isVectorGrid = baseGrid->isType<openvdb::Vec3SGrid>();
+		if (!baseGrid->isType<openvdb::FloatGrid>() && !isVectorGrid)
+			continue;
+
+		// the same grids readGridsToConvert() picks - the mapped ones, or density and temperature, or the only grid
+		const std::string& gridName = baseGrid->getName();
+		bool gridUsed = m_gridMappings.empty() ? (gridName == "density" || gridName == "temperature" || gridsMetadata->size() == 1) :
+												 !getMappedChannelName(gridName).empty();
+		if (!gridUsed)
+			continue;
+
+		openvdb::Int64Metadata::Ptr memBytes = baseGrid->getMetadata<openvdb::Int64Metadata>(openvdb::GridBase::META_FILE_MEM_BYTES);
+		openvdb::Int64Metadata::Ptr voxelCount = baseGrid->getMetadata<openvdb::Int64Metadata>(openvdb::GridBase::META_FILE_VOXEL_COUNT);
+
+		if (memBytes)
+		{
+			memorySize += (size_t)memBytes->value();
+		}
+
+		// dense grids only depend on the bounds, so they don't need the voxel count
+		memorySize += estimateConvertedMemorySize(isVectorGrid, voxelCount ? (uint64_t)voxelCount->value() : 0, bounds);
+	}
+
+	return memorySize;
+}
+
+std::string VDBConverter::getMappedChannelName(const std::string& gridName) const
+{
+	for (unsigned int i = 0; i < m_gridMappings.size(); i++)
+	{
+		if (m_gridMappings[i].first == gridName)
+			return m_gridMappings[i].second;
+	}
+
+	return "";
+}
+
+size_t VDBConverter::estimateConvertedMemorySize(bool vectorGrid, uint64_t activeVoxelCount, const GridBounds& bounds) const
+{
+	size_t valueSize = extractAsHalf() ? sizeof(half) : sizeof(float);
+
+	// vector grids have 3 values per voxel
+	if (vectorGrid)
+		valueSize *= 3;
+
+	size_t fullResSize = 0;
+	if (!m_useSparseGrids)
+	{
+		size_t gridResX = bounds.max.x() - bounds.min.x() + 1;
+		size_t gridResY = bounds.max.y() - bounds.min.y() + 1;
+		size_t gridResZ = bounds.max.z() - bounds.min.z() + 1;
+
+		fullResSize = gridResX * gridResY * gridResZ * valueSize;
+	}
+	else
+	{
+		// we can't know how many subcells will be allocated without doing the work, so
+		// just go with the active voxels, which is the minimum it could be
+		fullResSize = activeVoxelCount * valueSize;
+	}
+
+	// each mip level is an eighth of the size of the one before it, so they add up to about a
+	// seventh of the full-res size
+	size_t mipLevelsSize = (m_mipLevels > 0) ? fullResSize / 7 : 0;
+
+	if (!m_useSparseGrids && m_streamDenseGrids)
+	{
+		return kDenseStreamBufferSize + mipLevelsSize;
+	}
+
+	return fullResSize + mipLevelsSize;
+}
+
+bool VDBConverter::saveGrid(const GridConversion& gridConversion, const GridBounds& bounds) const
+{
+	ConvertedGrid convertedGrid;
+
+	if (!convertGrid(gridConversion, bounds, convertedGrid))
+		return false;
+
+	return writeConvertedGrid(convertedGrid, gridConversion.destPath);
+}
+
+namespace
+{
+
+// a row of values, in the type they're stored as. The half conversion is timed if there are stats - floats
+// are just copied, so there's nothing to time, but they take the stats too so templated callers can use either.
+inline void storeRowValues(const float* pSrc, float* pDst, size_t count, ConversionStats*)
+{
+	memcpy(pDst, pSrc, count * sizeof(float));
+}
+
+inline void storeRowValues(const float* pSrc, half* pDst, size_t count, ConversionStats* pStats)
+{
+	if (!pStats)
+	{
+		convertFloatsToHalfs(pSrc, pDst, count);
+		return;
+	}
+
+	double startTime = ConversionStats::getWallTime();
+	convertFloatsToHalfs(pSrc, pDst, count);
+	pStats->addHalfConversionTime(ConversionStats::getWallTime() - startTime);
+}
+
+// reads the values of a converted grid (in its local voxel coordinates) for building the next mip level
+// from it. This holds an accessor for streamed grids, so each task needs its own one.
+class MipLevelSampler
+{
+public:
+	MipLevelSampler(const ConvertedGrid& grid) : m_grid(grid)
+	{
+		if (grid.isStreamed)
+		{
+			m_pAccessor.reset(new openvdb::FloatGrid::ConstAccessor(grid.pStreamGrid->getConstAccessor()));
+		}
+	}
+
+	// dense grids only ever have one component
+	float getValue(unsigned int i, unsigned int j, unsigned int k, unsigned int component) const
+	{
+		if (m_grid.isSparse)
+		{
+			return m_grid.sparseGrid.getVoxelValue(i, j, k, component);
+		}
+		else if (m_grid.isStreamed)
+		{
+			openvdb::Coord ijk((int)m_grid.bounds.min.x() + (int)i, (int)m_grid.bounds.min.y() + (int)j,
+							   (int)m_grid.bounds.min.z() + (int)k);
+			return m_pAccessor->getValue(ijk) * m_grid.valueMultiplier;
+		}
+
+		size_t index = (size_t)i + (size_t)j * m_grid.resX + (size_t)k * m_grid.resX * m_grid.resY;
+
+		return m_grid.isHalf ? (float)m_grid.pDenseHalfValues[index] : m_grid.pDenseFloatValues[index];
+	}
+
+	// the box-filtered or max value of the 2x2x2 voxels which voxel i, j, k of the next level covers.
+	// at the edges of odd-resolution grids, only the voxels which exist are used. For vector grids, each
+	// component is filtered separately.
+	float getFilteredValue(unsigned int i, unsigned int j, unsigned int k, unsigned int component, unsigned char filter) const
+	{
+		float sum = 0.0f;
+		float maxValue = 0.0f;
+		unsigned int count = 0;
+
+		for (unsigned int z = k * 2; z < std::min(k * 2 + 2, m_grid.resZ); z++)
+		{
+			for (unsigned int y = j * 2; y < std::min(j * 2 + 2, m_grid.resY); y++)
+			{
+				for (unsigned int x = i * 2; x < std::min(i * 2 + 2, m_grid.resX); x++)
+				{
+					float value = getValue(x, y, z, component);
+
+					sum += value;
+					maxValue = (count == 0) ? value : std::max(maxValue, value);
+					count++;
+				}
+			}
+		}
+
+		if (filter == eIVVMipFilterMax)
+			return maxValue;
+
+		return sum / (float)count;
+	}
+
+protected:
+	const ConvertedGrid&	m_grid;
+	std::unique_ptr<openvdb::FloatGrid::ConstAccessor>	m_pAccessor;
+};
+
+} // namespace
+
+bool VDBConverter::convertGrid(const GridConversion& gridConversion, const GridBounds& bounds, ConvertedGrid& convertedGrid) const
+{
+	bool result = false;
+
+	ScopedPhaseTimer timer(m_pStats, eConversionPhaseExtract);
+
+	convertedGrid.bounds = bounds;
+
+	if (gridConversion.vectorGrid)
+	{
+		result = convertVectorGrid(gridConversion.vectorGrid, bounds, convertedGrid);
+	}
+	else
+	{
+		result = convertFloatGrid(gridConversion.grid, bounds, convertedGrid);
+	}
+
+	if (result)
+	{
+		buildMipLevels(convertedGrid);
+	}
+
+	return result;
+}
+
+bool VDBConverter::convertFloatGrid(openvdb::FloatGrid::Ptr grid, const GridBounds& bounds, ConvertedGrid& convertedGrid) const
+{
+	convertedGrid.freeData();
+
+	convertedGrid.resX = bounds.max.x() - bounds.min.x() + 1;
+	convertedGrid.resY = bounds.max.y() - bounds.min.y() + 1;
+	convertedGrid.resZ = bounds.max.z() - bounds.min.z() + 1;
+
+	convertedGrid.isSparse = m_useSparseGrids;
+	convertedGrid.isHalf = extractAsHalf();
+	convertedGrid.quantizeBits = m_quantizeBits;
+
+	if (!m_useSparseGrids)
+	{
+		size_t totalNumVoxels = (size_t)convertedGrid.resX * (size_t)convertedGrid.resY * (size_t)convertedGrid.resZ;
+
+		if (m_streamDenseGrids)
+		{
+			// the values will be extracted a slab at a time as they're written, so we just
+			// need to hold on to the grid until then
+			convertedGrid.isStreamed = true;
+			convertedGrid.pStreamGrid = grid;
+			convertedGrid.valueMultiplier = m_valueMultiplier;
+		}
+		else if (!convertedGrid.isHalf)
+		{
+			convertedGrid.pDenseFloatValues = new float[totalNumVoxels];
+			memset(convertedGrid.pDenseFloatValues, 0, sizeof(float) * totalNumVoxels);
+
+			fillDenseValues(grid, bounds, bounds.min.z(), bounds.max.z(), convertedGrid.pDenseFloatValues, m_valueMultiplier);
+		}
+		else
+		{
+			convertedGrid.pDenseHalfValues = new half[totalNumVoxels];
+			memset(convertedGrid.pDenseHalfValues, 0, sizeof(half) * totalNumVoxels);
+
+			fillDenseValues(grid, bounds, bounds.min.z(), bounds.max.z(), convertedGrid.pDenseHalfValues, m_valueMultiplier);
+		}
+	}
+	else
+	{
+		SparseGrid& sparseGrid = convertedGrid.sparseGrid;
+		sparseGrid.resizeGrid(convertedGrid.resX, convertedGrid.resY, convertedGrid.resZ, m_subCellSize, m_subCellLayout,
+							  1, m_cellStorage);
+
+		fillSparseGrid<openvdb::FloatGrid>(grid, bounds, sparseGrid);
+	}
+
+	return true;
+}
+
+bool VDBConverter::convertVectorGrid(openvdb::Vec3SGrid::Ptr grid, const GridBounds& bounds, ConvertedGrid& convertedGrid) const
+{
+	convertedGrid.freeData();
+
+	convertedGrid.resX = bounds.max.x() - bounds.min.x() + 1;
+	convertedGrid.resY = bounds.max.y() - bounds.min.y() + 1;
+	convertedGrid.resZ = bounds.max.z() - bounds.min.z() + 1;
+	convertedGrid.numComponents = 3;
+
+	convertedGrid.isSparse = true;
+	convertedGrid.isHalf = extractAsHalf();
+	convertedGrid.quantizeBits = m_quantizeBits;
+
+	SparseGrid& sparseGrid = convertedGrid.sparseGrid;
+	sparseGrid.resizeGrid(convertedGrid.resX, convertedGrid.resY, convertedGrid.resZ, m_subCellSize, m_subCellLayout,
+						  convertedGrid.numComponents, m_cellStorage);
+
+	fillSparseGrid<openvdb::Vec3SGrid>(grid, bounds, sparseGrid);
+
+	return true;
+}
+
+void VDBConverter::buildMipLevels(ConvertedGrid& convertedGrid) const
+{
+	ScopedPhaseTimer timer(m_pStats, eConversionPhaseMipLevels);
+
+	// each mip level is built from the one before it, stopping early if we get down to a single voxel
+	const ConvertedGrid* pSrcLevel = &convertedGrid;
+	for (unsigned int level = 0; level < m_mipLevels; level++)
+	{
+		if (pSrcLevel->resX == 1 && pSrcLevel->resY == 1 && pSrcLevel->resZ == 1)
+			break;
+
+		ConvertedGrid* pMipLevel = new ConvertedGrid();
+		buildMipLevel(*pSrcLevel, *pMipLevel);
+
+		convertedGrid.mipLevels.push_back(pMipLevel);
+		pSrcLevel = pMipLevel;
+	}
+}
+
+void VDBConverter::buildMipLevel(const ConvertedGrid& srcLevel, ConvertedGrid& mipLevel) const
+{
+	mipLevel.resX = (srcLevel.resX + 1) / 2;
+	mipLevel.resY = (srcLevel.resY + 1) / 2;
+	mipLevel.resZ = (srcLevel.resZ + 1) / 2;
+	mipLevel.numComponents = srcLevel.numComponents;
+
+	mipLevel.isSparse = srcLevel.isSparse;
+	mipLevel.isHalf = srcLevel.isHalf;
+	mipLevel.quantizeBits = srcLevel.quantizeBits;
+
+	if (!mipLevel.isSparse)
+	{
+		size_t totalNumVoxels = (size_t)mipLevel.resX * (size_t)mipLevel.resY * (size_t)mipLevel.resZ;
+
+		if (!mipLevel.isHalf)
+		{
+			mipLevel.pDenseFloatValues = new float[totalNumVoxels];
+		}
+		else
+		{
+			mipLevel.pDenseHalfValues = new half[totalNumVoxels];
+		}
+
+		size_t numRows = (size_t)mipLevel.resY * (size_t)mipLevel.resZ;
+
+		m_taskArena.execute([&]()
+		{
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, numRows), [&](const tbb::blocked_range<size_t>& range)
+			{
+				MipLevelSampler sampler(srcLevel);
+
+				std::vector<float> rowValues(mipLevel.resX);
+
+				for (size_t row = range.begin(); row != range.end(); row++)
+				{
+					unsigned int j = (unsigned int)(row % mipLevel.resY);
+					unsigned int k = (unsigned int)(row / mipLevel.resY);
+
+					size_t rowStart = row * mipLevel.resX;
+
+					for (unsigned int i = 0; i < mipLevel.resX; i++)
+					{
+						rowValues[i] = sampler.getFilteredValue(i, j, k, 0, m_mipFilter);
+					}
+
+					if (!mipLevel.isHalf)
+					{
+						storeRowValues(&rowValues[0], mipLevel.pDenseFloatValues + rowStart, mipLevel.resX, m_pStats);
+					}
+					else
+					{
+						storeRowValues(&rowValues[0], mipLevel.pDenseHalfValues + rowStart, mipLevel.resX, m_pStats);
+					}
+				}
+			});
+		});
+
+		return;
+	}
+
+	SparseGrid& sparseGrid = mipLevel.sparseGrid;
+	const SparseGrid& srcSparseGrid = srcLevel.sparseGrid;
+
+	unsigned int cellSize = srcSparseGrid.getSubCellSize();
+	sparseGrid.resizeGrid(mipLevel.resX, mipLevel.resY, mipLevel.resZ, cellSize, srcSparseGrid.getSubCellLayout(),
+						  mipLevel.numComponents, srcSparseGrid.getCellStorage());
+
+	unsigned int numCellRows = sparseGrid.getCellCountY() * sparseGrid.getCellCountZ();
+
+	// each task does whole rows of subcells along x, so they never touch the same subcell
+	m_taskArena.execute([&]()
+	{
+		tbb::parallel_for(tbb::blocked_range<unsigned int>(0, numCellRows), [&](const tbb::blocked_range<unsigned int>& range)
+		{
+			MipLevelSampler sampler(srcLevel);
+
+			std::vector<float> rowValues(cellSize * mipLevel.numComponents);
+
+			for (unsigned int cellRow = range.begin(); cellRow != range.end(); cellRow++)
+			{
+				unsigned int cellJ = cellRow % sparseGrid.getCellCountY();
+				unsigned int cellK = cellRow / sparseGrid.getCellCountY();
+
+				for (unsigned int cellI = 0; cellI < sparseGrid.getCellCountX(); cellI++)
+				{
+					// as the subcell size is the same for each level, each subcell covers 2x2x2 subcells
+					// of the source level, so if none of those are allocated, there's nothing to do
+					bool haveSrcValues = false;
+					for (unsigned int srcCell = 0; srcCell < 8 && !haveSrcValues; srcCell++)
+					{
+						unsigned int srcCellI = cellI * 2 + (srcCell & 1);
+						unsigned int srcCellJ = cellJ * 2 + ((srcCell >> 1) & 1);
+						unsigned int srcCellK = cellK * 2 + ((srcCell >> 2) & 1);
+
+						if (srcCellI < srcSparseGrid.getCellCountX() && srcCellJ < srcSparseGrid.getCellCountY() &&
+							srcCellK < srcSparseGrid.getCellCountZ())
+						{
+							haveSrcValues = srcSparseGrid.isSubCellAllocated(srcCellI, srcCellJ, srcCellK);
+						}
+					}
+
+					if (!haveSrcValues)
+						continue;
+
+					unsigned int startI = cellI * cellSize;
+					unsigned int startJ = cellJ * cellSize;
+					unsigned int startK = cellK * cellSize;
+					unsigned int endI = std::min(startI + cellSize, mipLevel.resX);
+					unsigned int endJ = std::min(startJ + cellSize, mipLevel.resY);
+					unsigned int endK = std::min(startK + cellSize, mipLevel.resZ);
+
+					for (unsigned int k = startK; k < endK; k++)
+					{
+						for (unsigned int j = startJ; j < endJ; j++)
+						{
+							float* pRowValue = &rowValues[0];
+							for (unsigned int i = startI; i < endI; i++)
+							{
+								for (unsigned int component = 0; component < mipLevel.numComponents; component++)
+								{
+									*(pRowValue++) = sampler.getFilteredValue(i, j, k, component, m_mipFilter);
+								}
+							}
+
+							setSparseGridRow(sparseGrid, startI, j, k, &rowValues[0], endI - startI);
+						}
+					}
+				}
+			}
+		});
+	});
+}
+
+bool VDBConverter::writeConvertedGrid(const ConvertedGrid& convertedGrid, const std::string& path) const
+{
+	std::vector<const ConvertedGrid*> channels(1, &convertedGrid);
+
+	return writeConvertedChannels(channels, std::vector<std::string>(), path);
+}
+
+bool VDBConverter::writeConvertedChannels(const std::vector<const ConvertedGrid*>& channels, const std::vector<std::string>& channelNames,
+										  const std::string& path) const
+{
+	const ConvertedGrid& convertedGrid = *channels[0];
+
+	bool multiChannel = !channelNames.empty();
+
+	if (multiChannel && !convertedGrid.isSparse)
+	{
+		fprintf(stderr, "Multi-channel files are only supported for sparse grids: %s\n", path.c_str());
+		return false;
+	}
+
+	if (m_pStats && convertedGrid.isSparse)
+	{
+		// this is done before the write timing starts, so it doesn't count towards it
+		for (unsigned int channel = 0; channel < channels.size(); channel++)
+		{
+			m_pStats->addSparseGrid(channels[channel]->sparseGrid);
+		}
+	}
+
+	ScopedPhaseTimer timer(m_pStats, eConversionPhaseWrite);
+
+	FILE* pFinalFile = fopen(path.c_str(), "wb");
+
+	if (!pFinalFile)
+	{
+		fprintf(stderr, "Couldn't open file: %s for writing.\n", path.c_str());
+		return false;
+	}
+
+	unsigned int formatFlags = getFormatFlags(convertedGrid);
+
+	if (multiChannel)
+	{
+		// the subcell index isn't supported for multi-channel files, and channels which are empty in
+		// a subcell that other channels have values in are stored as constant subcells
+		formatFlags &= ~eIVVFlagSubCellIndex;
+		formatFlags |= eIVVFlagMultiChannel | eIVVFlagConstantSubCells;
+
+		for (unsigned int channel = 0; channel < channels.size(); channel++)
+		{
+			if (channels[channel]->numComponents > 1)
+				formatFlags |= eIVVFlagVectorValues;
+		}
+	}
+
+	long mipOffsetsPos = 0;
+	writeFileHeader(pFinalFile, channels, formatFlags, mipOffsetsPos, channelNames);
+
+	float maxQuantizeError = multiChannel ? writeSparseChannelValues(pFinalFile, channels, formatFlags) :
+											writeGridValues(pFinalFile, convertedGrid, formatFlags);
+
+	if (!convertedGrid.mipLevels.empty())
+	{
+		// each level has its own resolution and then its values in the same layout as the full-res
+		// level, and the header has the offset to each of them, so they can be read on their own
+		std::vector<uint64_t> aMipOffsets;
+
+		for (unsigned int i = 0; i < convertedGrid.mipLevels.size(); i++)
+		{
+			const ConvertedGrid& mipLevel = *convertedGrid.mipLevels[i];
+
+			aMipOffsets.push_back((uint64_t)ftell(pFinalFile));
+
+			fwrite(&mipLevel.resX, sizeof(unsigned int), 1, pFinalFile);
+			fwrite(&mipLevel.resY, sizeof(unsigned int), 1, pFinalFile);
+			fwrite(&mipLevel.resZ, sizeof(unsigned int), 1, pFinalFile);
+
+			float levelError = 0.0f;
+
+			if (multiChannel)
+			{
+				// all the channels have the same resolution, so the same number of mip levels
+				std::vector<const ConvertedGrid*> levelChannels;
+				for (unsigned int channel = 0; channel < channels.size(); channel++)
+				{
+					levelChannels.push_back(channels[channel]->mipLevels[i]);
+				}
+
+				levelError = writeSparseChannelValues(pFinalFile, levelChannels, formatFlags);
+			}
+			else
+			{
+				levelError = writeGridValues(pFinalFile, mipLevel, formatFlags);
+			}
+
+			maxQuantizeError = std::max(maxQuantizeError, levelError);
+		}
+
+		fseek(pFinalFile, mipOffsetsPos, SEEK_SET);
+		fwrite(&aMipOffsets[0], sizeof(uint64_t), aMipOffsets.size(), pFinalFile);
+	}
+
+	if (m_pStats)
+	{
+		fseek(pFinalFile, 0, SEEK_END);
+		m_pStats->addBytesWritten((uint64_t)ftell(pFinalFile));
+	}
+
+	fclose(pFinalFile);
+
+	if (convertedGrid.quantizeBits != 0)
+	{
+		fprintf(stderr, "Max quantization error for %s: %g\n", path.c_str(), maxQuantizeError);
+	}
+
+	return true;
+}
+
+float VDBConverter::writeGridValues(FILE* pFile, const ConvertedGrid& convertedGrid, unsigned int formatFlags) const
+{
+	if (!convertedGrid.isSparse)
+	{
+		return writeDenseGridValues(pFile, convertedGrid);
+	}
+	else
+	{
+		return writeSparseGridValues(pFile, convertedGrid, formatFlags);
+	}
+}
+
+float VDBConverter::writeDenseGridValues(FILE* pFile, const ConvertedGrid& convertedGrid) const
+{
+	if (convertedGrid.isStreamed)
+	{
+		if (!convertedGrid.isHalf)
+		{
+			return writeDenseGridStreamed<float>(convertedGrid, pFile);
+		}
+		else
+		{
+			return writeDenseGridStreamed<half>(convertedGrid, pFile);
+		}
+	}
+	else if (!convertedGrid.isHalf)
+	{
+		return writeDenseSlices(pFile, convertedGrid, convertedGrid.pDenseFloatValues, convertedGrid.resZ);
+	}
+	else
+	{
+		return writeDenseSlices(pFile, convertedGrid, convertedGrid.pDenseHalfValues, convertedGrid.resZ);
+	}
+}
+
+float VDBConverter::writeDenseSlices(FILE* pFile, const ConvertedGrid& convertedGrid, const float* pValues, unsigned int numSlices) const
+{
+	size_t sliceSize = (size_t)convertedGrid.resX * (size_t)convertedGrid.resY;
+
+	if (convertedGrid.quantizeBits == 0)
+	{
+		fwrite(pValues, sizeof(float) * sliceSize * numSlices, 1, pFile);
+		return 0.0f;
+	}
+
+	size_t quantizedValueSize = convertedGrid.quantizeBits / 8;
+
+	std::vector<unsigned char> aQuantizedValues(sliceSize * quantizedValueSize * numSlices);
+	std::vector<float> aOffsets(numSlices);
+	std::vector<float> aScales(numSlices);
+	std::vector<float> aErrors(numSlices);
+
+	// each slice has its own range, so they can be quantized in parallel
+	m_taskArena.execute([&]()
+	{
+		tbb::parallel_for(tbb::blocked_range<unsigned int>(0, numSlices), [&](const tbb::blocked_range<unsigned int>& range)
+		{
+			for (unsigned int slice = range.begin(); slice != range.end(); slice++)
+			{
+				const float* pSliceValues = pValues + sliceSize * slice;
+
+				getQuantizeRange(pSliceValues, sliceSize, convertedGrid.quantizeBits, aOffsets[slice], aScales[slice]);
+				aErrors[slice] = quantizeValues(pSliceValues, sliceSize, convertedGrid.quantizeBits, aOffsets[slice], aScales[slice],
+												&aQuantizedValues[sliceSize * quantizedValueSize * slice]);
+			}
+		});
+	});
+
+	float maxError = 0.0f;
+
+	for (unsigned int slice = 0; slice < numSlices; slice++)
+	{
+		fwrite(&aOffsets[slice], sizeof(float), 1, pFile);
+		fwrite(&aScales[slice], sizeof(float), 1, pFile);
+		fwrite(&aQuantizedValues[sliceSize * quantizedValueSize * slice], quantizedValueSize, sliceSize, pFile);
+
+		maxError = std::max(maxError, aErrors[slice]);
+	}
+
+	return maxError;
+}
+
+float VDBConverter::writeDenseSlices(FILE* pFile, const ConvertedGrid& convertedGrid, const half* pValues, unsigned int numSlices) const
+{
+	size_t sliceSize = (size_t)convertedGrid.resX * (size_t)convertedGrid.resY;
+
+	fwrite(pValues, sizeof(half) * sliceSize * numSlices, 1, pFile);
+
+	return 0.0f;
+}
+
+unsigned int VDBConverter::getFormatFlags(const ConvertedGrid& convertedGrid) const
+{
+	unsigned int formatFlags = 0;
+
+	// compression is only supported for sparse subcells
+	if (convertedGrid.isSparse && m_compressionCodec != eIVVCodecNone)
+		formatFlags |= eIVVFlagCompressed;
+
+	if (convertedGrid.quantizeBits != 0)
+		formatFlags |= eIVVFlagQuantized;
+
+	if (convertedGrid.isSparse && m_collapseConstantSubCells)
+		formatFlags |= eIVVFlagConstantSubCells;
+
+	if (convertedGrid.isSparse && m_maskSubCells)
+		formatFlags |= eIVVFlagMaskedSubCells;
+
+	if (!convertedGrid.mipLevels.empty())
+		formatFlags |= eIVVFlagMipLevels;
+
+	if (convertedGrid.isSparse && convertedGrid.sparseGrid.getSubCellLayout() == SparseGrid::eSubCellLayoutMorton)
+		formatFlags |= eIVVFlagMortonOrder;
+
+	if (convertedGrid.isSparse && m_writeSubCellIndex)
+		formatFlags |= eIVVFlagSubCellIndex;
+
+	if (convertedGrid.numComponents > 1)
+		formatFlags |= eIVVFlagVectorValues;
+
+	if (convertedGrid.isSparse && convertedGrid.temporalDelta)
+		formatFlags |= eIVVFlagTemporalDelta;
+
+	if (convertedGrid.hasFrameOffset)
+		formatFlags |= eIVVFlagFrameOffset;
+
+	return formatFlags;
+}
+
+void VDBConverter::writeFileHeader(FILE* pFile, const std::vector<const ConvertedGrid*>& channels, unsigned int formatFlags,
+								   long& mipOffsetsPos, const std::vector<std::string>& channelNames) const
+{
+	const ConvertedGrid& convertedGrid = *channels[0];
+
+	// only use the extended format if we actually need it, so older readers can still read the files
+	unsigned char version = (formatFlags == 0) ? eIVVVersionOriginal : eIVVVersionExtended;
+
+	unsigned int gridResX = convertedGrid.resX;
+	unsigned int gridResY = convertedGrid.resY;
+	unsigned int gridResZ = convertedGrid.resZ;
+
+	openvdb::Vec3f extent((float)gridResX, (float)gridResY, (float)gridResZ);
+	extent.normalize();
+
+	extent *= m_sizeMultiplier;
+
+	float bbMinX = -extent.x();
+	float bbMinY = -extent.y();
+	float bbMinZ = -extent.z();
+
+	float bbMaxX = extent.x();
+	float bbMaxY = extent.y();
+	float bbMaxZ = extent.z();
+
+	// the offset of the grid within the sequence's bounds, in voxels
+	int frameOffset[3] = { 0, 0, 0 };
+	unsigned int sequenceRes[3] = { gridResX, gridResY, gridResZ };
+
+	if (convertedGrid.hasFrameOffset)
+	{
+		// the bbox is the grid's part of the whole sequence's one
+		const GridBounds& sequenceBounds = convertedGrid.sequenceBounds;
+
+		for (unsigned int axis = 0; axis < 3; axis++)
+		{
+			frameOffset[axis] = (int)(convertedGrid.bounds.min[axis] - sequenceBounds.min[axis]);
+			sequenceRes[axis] = (unsigned int)(sequenceBounds.max[axis] - sequenceBounds.min[axis]) + 1;
+		}
+
+		openvdb::Vec3f sequenceExtent((float)sequenceRes[0], (float)sequenceRes[1], (float)sequenceRes[2]);
+		sequenceExtent.normalize();
+
+		sequenceExtent *= m_sizeMultiplier;
+
+		openvdb::Vec3f voxelSize(sequenceExtent.x() * 2.0f / (float)sequenceRes[0], sequenceExtent.y() * 2.0f / (float)sequenceRes[1],
+								 sequenceExtent.z() * 2.0f / (float)sequenceRes[2]);
+
+		bbMinX = -sequenceExtent.x() + (float)frameOffset[0] * voxelSize.x();
+		bbMinY = -sequenceExtent.y() + (float)frameOffset[1] * voxelSize.y();
+		bbMinZ = -sequenceExtent.z() + (float)frameOffset[2] * voxelSize.z();
+
+		bbMaxX = bbMinX + (float)gridResX * voxelSize.x();
+		bbMaxY = bbMinY + (float)gridResY * voxelSize.y();
+		bbMaxZ = bbMinZ + (float)gridResZ * voxelSize.z();
+	}
+
+	fwrite(&version, 1, 1, pFile);
+
+	unsigned char dataType = eIVVDataFloat;
+	if (convertedGrid.quantizeBits == 8)
+		dataType = eIVVDataUInt8;
+	else if (convertedGrid.quantizeBits == 16)
+		dataType = eIVVDataUInt16;
+	else if (convertedGrid.isHalf)
+		dataType = eIVVDataHalf;
+
+	fwrite(&dataType, 1, 1, pFile);
+
+	unsigned char gridType = convertedGrid.isSparse ? eIVVGridSparse : eIVVGridDense;
+	fwrite(&gridType, sizeof(unsigned char), 1, pFile);
+
+	if (convertedGrid.isSparse)
+	{
+		unsigned short subCellSize = convertedGrid.sparseGrid.getSubCellSize();
+		fwrite(&subCellSize, sizeof(unsigned short), 1, pFile);
+	}
+
+	fwrite(&gridResX, sizeof(unsigned int), 1, pFile);
+	fwrite(&gridResY, sizeof(unsigned int), 1, pFile);
+	fwrite(&gridResZ, sizeof(unsigned int), 1, pFile);
+
+	fwrite(&bbMinX, sizeof(float), 1, pFile);
+	fwrite(&bbMinY, sizeof(float), 1, pFile);
+	fwrite(&bbMinZ, sizeof(float), 1, pFile);
+
+	fwrite(&bbMaxX, sizeof(float), 1, pFile);
+	fwrite(&bbMaxY, sizeof(float), 1, pFile);
+	fwrite(&bbMaxZ, sizeof(float), 1, pFile);
+
+	if (version < eIVVVersionExtended)
+		return;
+
+	uint32_t flags = formatFlags;
+	fwrite(&flags, sizeof(uint32_t), 1, pFile);
+
+	if (formatFlags & eIVVFlagCompressed)
+	{
+		unsigned char codec = m_compressionCodec;
+		unsigned char filter = m_compressionFilter;
+
+		fwrite(&codec, sizeof(unsigned char), 1, pFile);
+		fwrite(&filter, sizeof(unsigned char), 1, pFile);
+	}
+
+	if (formatFlags & eIVVFlagMipLevels)
+	{
+		unsigned char numMipLevels = (unsigned char)convertedGrid.mipLevels.size();
+		unsigned char mipFilter = m_mipFilter;
+
+		fwrite(&numMipLevels, sizeof(unsigned char), 1, pFile);
+		fwrite(&mipFilter, sizeof(unsigned char), 1, pFile);
+
+		// the offsets of the levels aren't known until they've been written, so this is just
+		// reserving space for them
+		mipOffsetsPos = ftell(pFile);
+
+		std::vector<uint64_t> aMipOffsets(numMipLevels, 0);
+		fwrite(&aMipOffsets[0], sizeof(uint64_t), numMipLevels, pFile);
+	}
+
+	if (formatFlags & eIVVFlagMultiChannel)
+	{
+		unsigned char numChannels = (unsigned char)channelNames.size();
+		fwrite(&numChannels, sizeof(unsigned char), 1, pFile);
+
+		for (unsigned int i = 0; i < channelNames.size(); i++)
+		{
+			unsigned char nameLength = (unsigned char)std::min(channelNames[i].size(), (size_t)255);
+			fwrite(&nameLength, sizeof(unsigned char), 1, pFile);
+			fwrite(channelNames[i].c_str(), sizeof(char), nameLength, pFile);
+		}
+	}
+
+	if (formatFlags & eIVVFlagVectorValues)
+	{
+		for (unsigned int i = 0; i < channels.size(); i++)
+		{
+			unsigned char numComponents = (unsigned char)channels[i]->numComponents;
+			fwrite(&numComponents, sizeof(unsigned char), 1, pFile);
+		}
+	}
+
+	if (formatFlags & eIVVFlagTemporalDelta)
+	{
+		uint32_t frame = convertedGrid.frame;
+		uint32_t referenceFrame = convertedGrid.referenceFrame;
+
+		fwrite(&frame, sizeof(uint32_t), 1, pFile);
+		fwrite(&referenceFrame, sizeof(uint32_t), 1, pFile);
+	}
+
+	if (formatFlags & eIVVFlagFrameOffset)
+	{
+		int32_t offset[3] = { frameOffset[0], frameOffset[1], frameOffset[2] };
+		uint32_t resolution[3] = { sequenceRes[0], sequenceRes[1], sequenceRes[2] };
+
+		fwrite(offset, sizeof(int32_t), 3, pFile);
+		fwrite(resolution, sizeof(uint32_t), 3, pFile);
+	}
+}
+
+void VDBConverter::encodeSubCells(const SparseGrid& sparseGrid, size_t valueSize, unsigned int quantizeBits,
+								  const std::vector<unsigned char>& temporalReferences, std::vector<EncodedSubCell>& encodedSubCells) const
+{
+	ScopedPhaseTimer timer(m_pStats, eConversionPhaseEncode);
+
+	std::vector<SparseGrid::AllocatedSubCell> allocatedSubCells;
+	sparseGrid.getAllocatedSubCells(allocatedSubCells);
+
+	encodedSubCells.resize(allocatedSubCells.size());
+
+	m_taskArena.execute([&]()
+	{
+		tbb::parallel_for(tbb::blocked_range<size_t>(0, allocatedSubCells.size()), [&](const tbb::blocked_range<size_t>& range)
+		{
+			for (size_t i = range.begin(); i != range.end(); i++)
+			{
+				const SparseGrid::SparseSubCell* pSubCell = allocatedSubCells[i].pSubCell;
+				EncodedSubCell& encodedSubCell = encodedSubCells[i];
+
+				if (!temporalReferences.empty() && temporalReferences[i])
+				{
+					encodedSubCell.encoding = eIVVSubCellReference;
+					continue;
+				}
+
+				size_t numCellValues = pSubCell->getNumValues();
+				size_t numComponents = pSubCell->getNumComponents();
+				size_t cellValueSize = valueSize;
+				const void* pCellData = (valueSize == sizeof(float)) ? (const void*)pSubCell->getRawFloatData() :
+																		 (const void*)pSubCell->getRawHalfData();
+
+				std::vector<unsigned char> quantizedData;
+
+				if (quantizeBits != 0)
+				{
+					// quantized grids are always extracted as floats
+					const float* pCellFloatData = pSubCell->getRawFloatData();
+
+					cellValueSize = quantizeBits / 8;
+					quantizedData.resize(numCellValues * cellValueSize);
+
+					getQuantizeRange(pCellFloatData, numCellValues, quantizeBits, encodedSubCell.quantizeOffset, encodedSubCell.quantizeScale);
+					encodedSubCell.quantizeError = quantizeValues(pCellFloatData, numCellValues, quantizeBits, encodedSubCell.quantizeOffset,
+																  encodedSubCell.quantizeScale, &quantizedData[0]);
+
+					pCellData = &quantizedData[0];
+				}
+
+				size_t cellDataSize = numCellValues * cellValueSize;
+
+				encodedSubCell.encoding = eIVVSubCellRaw;
+
+				// this is done on the values as they'd be written, so for quantized grids it also catches
+				// subcells which only differ by less than the quantization step. For vector grids, it's
+				// each voxel's components together which need to be the same.
+				size_t voxelDataSize = cellValueSize * numComponents;
+
+				if (m_collapseConstantSubCells && isConstantSubCellData(pCellData, numCellValues / numComponents, voxelDataSize))
+				{
+					encodedSubCell.encoding = eIVVSubCellConstant;
+					const unsigned char* pFirstValue = (const unsigned char*)pCellData;
+					encodedSubCell.data.assign(pFirstValue, pFirstValue + voxelDataSize);
+				}
+				else
+				{
+					if (m_compressionCodec != eIVVCodecNone &&
+						compressSubCellData(m_compressionCodec, m_compressionFilter, pCellData, cellDataSize, cellValueSize, encodedSubCell.data) > 0)
+					{
+						encodedSubCell.encoding = eIVVSubCellCompressed;
+					}
+
+					if (m_maskSubCells)
+					{
+						// voxels which were zero don't generally quantize to zero, so which voxels are set always
+						// comes from the subcell's own values
+						const void* pOccupancyData = (quantizeBits != 0) ? (const void*)pSubCell->getRawFloatData() : pCellData;
+						size_t occupancyVoxelSize = ((quantizeBits != 0) ? sizeof(float) : cellValueSize) * numComponents;
+
+						std::vector<unsigned char> maskedData;
+						size_t maskedSize = maskSubCellData(pOccupancyData, occupancyVoxelSize, pCellData, voxelDataSize,
+															numCellValues / numComponents, maskedData);
+
+						// whichever is smaller
+						size_t currentSize = (encodedSubCell.encoding == eIVVSubCellCompressed) ? encodedSubCell.data.size() : cellDataSize;
+						if (maskedSize < currentSize)
+						{
+							encodedSubCell.encoding = eIVVSubCellMasked;
+							encodedSubCell.data.swap(maskedData);
+						}
+					}
+
+					if (encodedSubCell.encoding == eIVVSubCellRaw && quantizeBits != 0)
+					{
+						// the quantized values aren't in the subcell, so they need to be written from here
+						encodedSubCell.data.swap(quantizedData);
+					}
+					else if (encodedSubCell.encoding == eIVVSubCellRaw)
+					{
+						// it's stored raw, so we don't need a copy of it
+						std::vector<unsigned char>().swap(encodedSubCell.data);
+					}
+				}
+			}
+		});
+	});
+}
+
+namespace
+{
+
+// whether all the values are within the tolerance of the reference ones
+template <typename T>
+bool isWithinTolerance(const T* pValues, const T* pReferenceValues, size_t numValues, float tolerance)
+{
+	for (size_t i = 0; i < numValues; i++)
+	{
+		// this way round so NaNs are never within it
+		if (!(std::fabs((float)pValues[i] - (float)pReferenceValues[i]) <= tolerance))
+			return false;
+	}
+
+	return true;
+}
+
+bool compareAllocatedCellIndex(const SparseGrid::AllocatedSubCell& a, const SparseGrid::AllocatedSubCell& b)
+{
+	return a.cellIndex < b.cellIndex;
+}
+
+} // namespace
+
+void VDBConverter::applyTemporalReference(ConvertedGrid& convertedGrid, const ConvertedGrid& referenceGrid) const
+{
+	SparseGrid& sparseGrid = convertedGrid.sparseGrid;
+	const SparseGrid& referenceSparseGrid = referenceGrid.sparseGrid;
+
+	// the flags are per allocated subcell, in the same order as the encoded ones
+	std::vector<SparseGrid::AllocatedSubCell> allocatedSubCells;
+	sparseGrid.getAllocatedSubCells(allocatedSubCells);
+
+	convertedGrid.temporalReferences.assign(allocatedSubCells.size(), 0);
+
+	// all the frames of a sequence have the same bounds and subcell size, so this shouldn't happen
+	if (!convertedGrid.isSparse || !referenceGrid.isSparse || convertedGrid.isHalf != referenceGrid.isHalf ||
+		convertedGrid.resX != referenceGrid.resX || convertedGrid.resY != referenceGrid.resY || convertedGrid.resZ != referenceGrid.resZ ||
+		convertedGrid.numComponents != referenceGrid.numComponents || sparseGrid.getSubCellSize() != referenceSparseGrid.getSubCellSize())
+		return;
+
+	// with per-frame bounds, the subcells only line up if the frames have the same bounds
+	if (convertedGrid.bounds.min.x() != referenceGrid.bounds.min.x() || convertedGrid.bounds.min.y() != referenceGrid.bounds.min.y() ||
+		convertedGrid.bounds.min.z() != referenceGrid.bounds.min.z())
+		return;
+
+	unsigned int cellCountX = sparseGrid.getCellCountX();
+	unsigned int cellCountY = sparseGrid.getCellCountY();
+	unsigned int numCellRows = cellCountY * sparseGrid.getCellCountZ();
+
+	m_taskArena.execute([&]()
+	{
+		tbb::parallel_for(tbb::blocked_range<unsigned int>(0, numCellRows), [&](const tbb::blocked_range<unsigned int>& range)
+		{
+			for (unsigned int cellRow = range.begin(); cellRow != range.end(); cellRow++)
+			{
+				unsigned int cellJ = cellRow % cellCountY;
+				unsigned int cellK = cellRow / cellCountY;
+
+				for (unsigned int cellI = 0; cellI < cellCountX; cellI++)
+				{
+					SparseGrid::SparseSubCell* pSubCell = sparseGrid.getSubCell(cellI, cellJ, cellK);
+					const SparseGrid::SparseSubCell* pReferenceSubCell = referenceSparseGrid.getSubCell(cellI, cellJ, cellK);
+
+					if (!pSubCell || !pSubCell->isAllocated() || !pReferenceSubCell || !pReferenceSubCell->isAllocated())
+						continue;
+
+					size_t numValues = pSubCell->getNumValues();
+
+					if (convertedGrid.isHalf)
+					{
+						if (!isWithinTolerance(pSubCell->getRawHalfData(), pReferenceSubCell->getRawHalfData(), numValues, m_temporalTolerance))
+							continue;
+
+						memcpy(pSubCell->getRawHalfData(), pReferenceSubCell->getRawHalfData(), numValues * sizeof(half));
+					}
+					else
+					{
+						if (!isWithinTolerance(pSubCell->getRawFloatData(), pReferenceSubCell->getRawFloatData(), numValues, m_temporalTolerance))
+							continue;
+
+						memcpy(pSubCell->getRawFloatData(), pReferenceSubCell->getRawFloatData(), numValues * sizeof(float));
+					}
+
+					// the allocated subcells are sorted by index, so we can find this one's position
+					SparseGrid::AllocatedSubCell allocatedSubCell = { sparseGrid.getSubCellIndex(cellI, cellJ, cellK), pSubCell };
+					size_t allocatedIndex = std::lower_bound(allocatedSubCells.begin(), allocatedSubCells.end(), allocatedSubCell,
+															 compareAllocatedCellIndex) - allocatedSubCells.begin();
+
+					convertedGrid.temporalReferences[allocatedIndex] = 1;
+				}
+			}
+		});
+	});
+}
+
+template <typename T>
+float VDBConverter::writeDenseGridStreamed(const ConvertedGrid& convertedGrid, FILE* pFile) const
+{
+	const GridBounds& bounds = convertedGrid.bounds;
+
+	size_t sliceSize = (size_t)convertedGrid.resX * (size_t)convertedGrid.resY;
+
+	// as many z slices as fit within the buffer size, but always at least one
+	unsigned int slabSlices = std::max((size_t)1, kDenseStreamBufferSize / (sliceSize * sizeof(T)));
+
+	T* pSlabValues = new T[sliceSize * slabSlices];
+
+	float maxQuantizeError = 0.0f;
+
+	int minZ = bounds.min.z();
+	int maxZ = bounds.max.z();
+
+	for (int startZ = minZ; startZ <= maxZ; startZ += slabSlices)
+	{
+		int endZ = std::min(startZ + (int)slabSlices - 1, maxZ);
+
+		{
+			// the values are extracted as they're written
+			ScopedPhaseTimer timer(m_pStats, eConversionPhaseExtract);
+			fillDenseValues(convertedGrid.pStreamGrid, bounds, startZ, endZ, pSlabValues, convertedGrid.valueMultiplier);
+		}
+
+		float slabError = writeDenseSlices(pFile, convertedGrid, pSlabValues, (unsigned int)(endZ - startZ + 1));
+		maxQuantizeError = std::max(maxQuantizeError, slabError);
+	}
+
+	delete [] pSlabValues;
+
+	return maxQuantizeError;
+}
+
+namespace
+{
+
+float getMaxQuantizeError(const std::vector<EncodedSubCell>& encodedSubCells)
+{
+	float maxQuantizeError = 0.0f;
+	for (unsigned int i = 0; i < encodedSubCells.size(); i++)
+	{
+		maxQuantizeError = std::max(maxQuantizeError, encodedSubCells[i].quantizeError);
+	}
+
+	return maxQuantizeError;
+}
+
+} // namespace
+
+float VDBConverter::writeSparseGridValues(FILE* pFinalFile, const ConvertedGrid& convertedGrid, unsigned int formatFlags) const
+{
+	const SparseGrid& sparseGrid = convertedGrid.sparseGrid;
+
+	size_t valueSize = convertedGrid.isHalf ? sizeof(half) : sizeof(float);
+
+	// for the extended format, work out how each allocated subcell is going to be stored up-front,
+	// as that's where the expensive stuff (compression and quantization) happens, and can be done in parallel
+	std::vector<EncodedSubCell> encodedSubCells;
+	if (formatFlags != 0)
+	{
+		encodeSubCells(sparseGrid, valueSize, convertedGrid.quantizeBits, convertedGrid.temporalReferences, encodedSubCells);
+	}
+
+	if (formatFlags & eIVVFlagSubCellIndex)
+	{
+		writeSparseGridIndexed(pFinalFile, convertedGrid, valueSize, encodedSubCells);
+
+		return getMaxQuantizeError(encodedSubCells);
+	}
+
+	// now we need to store for each subcell whether they have data or not.
+	// because we know the subcell size and the full grid size, we can work out
+	// each subcell size on-the-fly, without having to store it
+	
+	// group the subCells into batches of 8, so we can be efficient and use an unsigned char
+	// as a bitset for the state of the next 8 subcells. The allocated subcells are in the
+	// same order, so each batch's ones are the next ones in the list.
+
+	std::vector<SparseGrid::AllocatedSubCell> allocatedSubCells;
+	sparseGrid.getAllocatedSubCells(allocatedSubCells);
+
+	uint64_t numSubCells = sparseGrid.getNumSubCells();
+	size_t allocatedIndex = 0;
+	
+	for (uint64_t cellIndex = 0; cellIndex < numSubCells; cellIndex += 8)
+	{
+		unsigned char subCellStateFlags = 0;
+		size_t batchStart = allocatedIndex;
+		
+		while (allocatedIndex < allocatedSubCells.size() && allocatedSubCells[allocatedIndex].cellIndex < cellIndex + 8)
+		{
+			subCellStateFlags |= (1 << (allocatedSubCells[allocatedIndex].cellIndex - cellIndex));
+			allocatedIndex++;
+		}
+		
+		fwrite(&subCellStateFlags, sizeof(unsigned char), 1, pFinalFile);
+		
+		// now write out the contents of any allocated cells
+		
+		for (size_t i = batchStart; i < allocatedIndex; i++)
+		{
+			const SparseGrid::SparseSubCell* pSubCell = allocatedSubCells[i].pSubCell;
+			
+			// also write the data - we don't need to write the length, as we can
+			// reverse-engineer it when reading based on info we already have...
+			unsigned int cellDataLength = pSubCell->getNumValues();
+
+			if (formatFlags != 0)
+			{
+				// the encoded subcells are in the same order as the allocated ones
+				writeEncodedSubCell(pFinalFile, convertedGrid, pSubCell, encodedSubCells[i]);
+				continue;
+			}
+
+			if (!convertedGrid.isHalf)
+			{
+				const float* pCellFloatData = pSubCell->getRawFloatData();
+				fwrite(pCellFloatData, sizeof(float), cellDataLength, pFinalFile);
+			}
+			else
+			{
+				const half* pCellHalfData = pSubCell->getRawHalfData();
+				fwrite(pCellHalfData, sizeof(half), cellDataLength, pFinalFile);
+			}
+		}
+	}
+
+	return getMaxQuantizeError(encodedSubCells);
+}
+
+void VDBConverter::writeEncodedSubCell(FILE* pFile, const ConvertedGrid& convertedGrid, const SparseGrid::SparseSubCell* pSubCell,
+									   const EncodedSubCell& encodedSubCell) const
+{
+	fwrite(&encodedSubCell.encoding, sizeof(unsigned char), 1, pFile);
+
+	if (convertedGrid.quantizeBits != 0)
+	{
+		fwrite(&encodedSubCell.quantizeOffset, sizeof(float), 1, pFile);
+		fwrite(&encodedSubCell.quantizeScale, sizeof(float), 1, pFile);
+	}
+
+	if (encodedSubCell.encoding == eIVVSubCellCompressed || encodedSubCell.encoding == eIVVSubCellMasked)
+	{
+		// these are variable-sized, so need their size
+		uint32_t dataSize = encodedSubCell.data.size();
+		fwrite(&dataSize, sizeof(uint32_t), 1, pFile);
+		fwrite(&encodedSubCell.data[0], sizeof(unsigned char), dataSize, pFile);
+	}
+	else if (!encodedSubCell.data.empty())
+	{
+		// the constant value, or quantized values
+		fwrite(&encodedSubCell.data[0], sizeof(unsigned char), encodedSubCell.data.size(), pFile);
+	}
+	else if (encodedSubCell.encoding == eIVVSubCellReference)
+	{
+		// the values are in the reference frame
+	}
+	else if (!convertedGrid.isHalf)
+	{
+		fwrite(pSubCell->getRawFloatData(), sizeof(float), pSubCell->getNumValues(), pFile);
+	}
+	else
+	{
+		fwrite(pSubCell->getRawHalfData(), sizeof(half), pSubCell->getNumValues(), pFile);
+	}
+}
+
+float VDBConverter::writeSparseChannelValues(FILE* pFile, const std::vector<const ConvertedGrid*>& channels, unsigned int formatFlags) const
+{
+	const ConvertedGrid& firstChannel = *channels[0];
+	size_t valueSize = firstChannel.isHalf ? sizeof(half) : sizeof(float);
+
+	std::vector<std::vector<EncodedSubCell> > aChannelEncodedSubCells(channels.size());
+	for (unsigned int channel = 0; channel < channels.size(); channel++)
+	{
+		encodeSubCells(channels[channel]->sparseGrid, valueSize, firstChannel.quantizeBits, channels[channel]->temporalReferences,
+					   aChannelEncodedSubCells[channel]);
+	}
+
+	// channels which don't have any values in a subcell that others do just get a constant zero, with a value
+	// for each of the channel's components
+	std::vector<EncodedSubCell> aEmptySubCells(channels.size());
+	for (unsigned int channel = 0; channel < channels.size(); channel++)
+	{
+		size_t emptyValueSize = (firstChannel.quantizeBits != 0) ? firstChannel.quantizeBits / 8 : valueSize;
+
+		aEmptySubCells[channel].encoding = eIVVSubCellConstant;
+		aEmptySubCells[channel].data.resize(emptyValueSize * channels[channel]->numComponents, 0);
+	}
+
+	std::vector<std::vector<SparseGrid::AllocatedSubCell> > aChannelAllocatedSubCells(channels.size());
+	for (unsigned int channel = 0; channel < channels.size(); channel++)
+	{
+		channels[channel]->sparseGrid.getAllocatedSubCells(aChannelAllocatedSubCells[channel]);
+	}
+
+	// the position of each channel in its list of allocated (and encoded) subcells
+	std::vector<size_t> aAllocatedIndices(channels.size(), 0);
+
+	uint64_t numSubCells = firstChannel.sparseGrid.getNumSubCells();
+
+	// the batches are the same as for single grids, but a subcell is allocated if it's allocated in any of the
+	// channels, and then has the data for each channel in turn
+	for (uint64_t cellIndex = 0; cellIndex < numSubCells; cellIndex += 8)
+	{
+		unsigned char subCellStateFlags = 0;
+
+		for (unsigned int channel = 0; channel < channels.size(); channel++)
+		{
+			const std::vector<SparseGrid::AllocatedSubCell>& allocatedSubCells = aChannelAllocatedSubCells[channel];
+
+			for (size_t i = aAllocatedIndices[channel]; i < allocatedSubCells.size() && allocatedSubCells[i].cellIndex < cellIndex + 8; i++)
+			{
+				subCellStateFlags |= (1 << (allocatedSubCells[i].cellIndex - cellIndex));
+			}
+		}
+
+		fwrite(&subCellStateFlags, sizeof(unsigned char), 1, pFile);
+
+		for (unsigned int batchIndex = 0; batchIndex < 8; batchIndex++)
+		{
+			if (!(subCellStateFlags & (1 << batchIndex)))
+				continue;
+
+			for (unsigned int channel = 0; channel < channels.size(); channel++)
+			{
+				const std::vector<SparseGrid::AllocatedSubCell>& allocatedSubCells = aChannelAllocatedSubCells[channel];
+				size_t& allocatedIndex = aAllocatedIndices[channel];
+
+				if (allocatedIndex < allocatedSubCells.size() && allocatedSubCells[allocatedIndex].cellIndex == cellIndex + batchIndex)
+				{
+					writeEncodedSubCell(pFile, *channels[channel], allocatedSubCells[allocatedIndex].pSubCell,
+										aChannelEncodedSubCells[channel][allocatedIndex]);
+					allocatedIndex++;
+				}
+				else
+				{
+					// the empty subcell is always a constant, so there's no subcell data to write
+					writeEncodedSubCell(pFile, *channels[channel], NULL, aEmptySubCells[channel]);
+				}
+			}
+		}
+	}
+
+	float maxQuantizeError = 0.0f;
+	for (unsigned int channel = 0; channel < channels.size(); channel++)
+	{
+		maxQuantizeError = std::max(maxQuantizeError, getMaxQuantizeError(aChannelEncodedSubCells[channel]));
+	}
+
+	return maxQuantizeError;
+}
+
+void VDBConverter::writeSparseGridIndexed(FILE* pFile, const ConvertedGrid& convertedGrid, size_t valueSize,
+										  const std::vector<EncodedSubCell>& encodedSubCells) const
+{
+	std::vector<SparseGrid::AllocatedSubCell> aAllocatedSubCells;
+	convertedGrid.sparseGrid.getAllocatedSubCells(aAllocatedSubCells);
+
+	std::vector<unsigned char> aOccupancy((convertedGrid.sparseGrid.getNumSubCells() + 7) / 8, 0);
+
+	for (size_t i = 0; i < aAllocatedSubCells.size(); i++)
+	{
+		uint64_t cellIndex = aAllocatedSubCells[i].cellIndex;
+		aOccupancy[cellIndex / 8] |= (1 << (cellIndex % 8));
+	}
+
+	size_t numAllocated = aAllocatedSubCells.size();
+
+	// the size of each subcell's payload, as it will be written
+	std::vector<uint32_t> aDataSizes(numAllocated);
+	for (size_t i = 0; i < numAllocated; i++)
+	{
+		const SparseGrid::SparseSubCell* pSubCell = aAllocatedSubCells[i].pSubCell;
+		const EncodedSubCell& encodedSubCell = encodedSubCells[i];
+
+		if (!encodedSubCell.data.empty() || encodedSubCell.encoding == eIVVSubCellReference)
+		{
+			aDataSizes[i] = (uint32_t)encodedSubCell.data.size();
+		}
+		else
+		{
+			aDataSizes[i] = (uint32_t)((size_t)pSubCell->getNumValues() * valueSize);
+		}
+	}
+
+	// now we know the size of everything before the payloads, we can work out where each of them will go
+	size_t subCellInfoSize = sizeof(unsigned char) + sizeof(uint32_t);
+	if (convertedGrid.quantizeBits != 0)
+		subCellInfoSize += sizeof(float) * 2;
+
+	uint64_t position = (uint64_t)ftell(pFile) + aOccupancy.size() + numAllocated * (sizeof(uint64_t) + subCellInfoSize);
+
+	std::vector<uint64_t> aOffsets(numAllocated);
+	for (size_t i = 0; i < numAllocated; i++)
+	{
+		position = (position + kIndexedPayloadAlignment - 1) & ~(uint64_t)(kIndexedPayloadAlignment - 1);
+		aOffsets[i] = position;
+		position += aDataSizes[i];
+	}
+
+	if (!aOccupancy.empty())
+	{
+		fwrite(&aOccupancy[0], sizeof(unsigned char), aOccupancy.size(), pFile);
+	}
+
+	if (numAllocated == 0)
+		return;
+
+	fwrite(&aOffsets[0], sizeof(uint64_t), numAllocated, pFile);
+
+	for (size_t i = 0; i < numAllocated; i++)
+	{
+		const EncodedSubCell& encodedSubCell = encodedSubCells[i];
+
+		fwrite(&encodedSubCell.encoding, sizeof(unsigned char), 1, pFile);
+		fwrite(&aDataSizes[i], sizeof(uint32_t), 1, pFile);
+
+		if (convertedGrid.quantizeBits != 0)
+		{
+			fwrite(&encodedSubCell.quantizeOffset, sizeof(float), 1, pFile);
+			fwrite(&encodedSubCell.quantizeScale, sizeof(float), 1, pFile);
+		}
+	}
+
+	static const unsigned char kPadding[kIndexedPayloadAlignment] = { 0 };
+
+	for (size_t i = 0; i < numAllocated; i++)
+	{
+		const SparseGrid::SparseSubCell* pSubCell = aAllocatedSubCells[i].pSubCell;
+		const EncodedSubCell& encodedSubCell = encodedSubCells[i];
+
+		size_t paddingSize = (size_t)(aOffsets[i] - (uint64_t)ftell(pFile));
+		if (paddingSize > 0)
+		{
+			fwrite(kPadding, sizeof(unsigned char), paddingSize, pFile);
+		}
+
+		if (!encodedSubCell.data.empty())
+		{
+			fwrite(&encodedSubCell.data[0], sizeof(unsigned char), encodedSubCell.data.size(), pFile);
+		}
+		else if (encodedSubCell.encoding == eIVVSubCellReference)
+		{
+			// the values are in the reference frame
+		}
+		else if (!convertedGrid.isHalf)
+		{
+			fwrite(pSubCell->getRawFloatData(), sizeof(unsigned char), aDataSizes[i], pFile);
+		}
+		else
+		{
+			fwrite(pSubCell->getRawHalfData(), sizeof(unsigned char), aDataSizes[i], pFile);
+		}
+	}
+}
+
+void VDBConverter::initTaskArena()
+{
+	if (!m_taskArena.is_active())
+	{
+		m_taskArena.initialize(m_numThreads > 0 ? (int)m_numThreads : (int)tbb::task_arena::automatic);
+	}
+}
+
+template <typename T>
+void VDBConverter::fillDenseValues(openvdb::FloatGrid::Ptr grid, const GridBounds& bounds, int startZ, int endZ, T* pValues,
+								   float multiplier) const
+{
+	int minX = bounds.min.x();
+	int maxX = bounds.max.x();
+	int minY = bounds.min.y();
+
+	unsigned int gridResX = bounds.max.x() - bounds.min.x() + 1;
+	unsigned int gridResY = bounds.max.y() - bounds.min.y() + 1;
+
+	size_t numRows = (size_t)gridResY * (size_t)(endZ - startZ + 1);
+
+	// split the work up by rows along x (rather than by z slices, as when streaming there might only
+	// be a single slice), each of which maps to a disjoint part of the output buffer.
+	// accessors cache nodes, so each task needs its own one.
+	m_taskArena.execute([&]()
+	{
+		tbb::parallel_for(tbb::blocked_range<size_t>(0, numRows), [&](const tbb::blocked_range<size_t>& range)
+		{
+			openvdb::FloatGrid::ConstAccessor accessor = grid->getConstAccessor();
+
+			openvdb::Coord ijk;
+			int &i = ijk[0];
+			int &j = ijk[1];
+			int &k = ijk[2];
+
+			std::vector<float> rowValues(gridResX);
+
+			for (size_t row = range.begin(); row != range.end(); row++)
+			{
+				k = startZ + (int)(row / gridResY);
+				j = minY + (int)(row % gridResY);
+
+				float* pRowValue = &rowValues[0];
+
+				for (i = minX; i <= maxX; i++)
+				{
+					*(pRowValue++) = accessor.getValue(ijk) * multiplier;
+				}
+
+				storeRowValues(&rowValues[0], pValues + row * gridResX, gridResX, m_pStats);
+			}
+		});
+	});
+}
+
+namespace
+{
+
+inline bool isZeroValue(float value)
+{
+	return value == 0.0f;
+}
+
+inline bool isZeroValue(const openvdb::Vec3s& value)
+{
+	return value.x() == 0.0f && value.y() == 0.0f && value.z() == 0.0f;
+}
+
+// copies the components of the value, returning how many there are
+inline unsigned int getValueComponents(float value, float* pComponents)
+{
+	pComponents[0] = value;
+	return 1;
+}
+
+inline unsigned int getValueComponents(const openvdb::Vec3s& value, float* pComponents)
+{
+	pComponents[0] = value.x();
+	pComponents[1] = value.y();
+	pComponents[2] = value.z();
+	return 3;
+}
+
+} // namespace
+
+template <typename GridType>
+void VDBConverter::fillSparseGrid(typename GridType::Ptr grid, const GridBounds& bounds, SparseGrid& sparseGrid) const
+{
+	// if the background value is zero (which it should be for fog volumes), only the leaf nodes and
+	// tiles which actually exist in the tree can contribute non-zero values, so we only need to visit
+	// those. Otherwise, every voxel in the bounds will have a value, so we need to visit all of them.
+	if (isZeroValue(grid->background() * m_valueMultiplier))
+	{
+		fillSparseGridFromTree<GridType>(grid, bounds, sparseGrid);
+	}
+	else
+	{
+		fillSparseGridFromBounds<GridType>(grid, bounds, sparseGrid);
+	}
+}
+
+template <typename GridType>
+void VDBConverter::fillSparseGridFromBounds(typename GridType::Ptr grid, const GridBounds& bounds, SparseGrid& sparseGrid) const
+{
+	openvdb::Coord boundsMin((int)bounds.min.x(), (int)bounds.min.y(), (int)bounds.min.z());
+	openvdb::Coord boundsMax((int)bounds.max.x(), (int)bounds.max.y(), (int)bounds.max.z());
+	openvdb::CoordBBox boundsBBox(boundsMin, boundsMax);
+
+	// split the work up into rows of subcells along x, so that each task only touches
+	// its own subcells, meaning they can be allocated and written to without locking
+	unsigned int numCellRows = sparseGrid.getCellCountY() * sparseGrid.getCellCountZ();
+
+	m_taskArena.execute([&]()
+	{
+		tbb::parallel_for(tbb::blocked_range<unsigned int>(0, numCellRows), [&](const tbb::blocked_range<unsigned int>& range)
+		{
+			typename GridType::ConstAccessor accessor = grid->getConstAccessor();
+
+			openvdb::Coord ijk;
+			int &i = ijk[0];
+			int &j = ijk[1];
+			int &k = ijk[2];
+
+			// the cell rows are the full width of the bounds
+			std::vector<float> rowValues((size_t)(boundsMax.x() - boundsMin.x() + 1) * sparseGrid.getNumComponents());
+
+			for (unsigned int cellRow = range.begin(); cellRow != range.end(); cellRow++)
+			{
+				openvdb::CoordBBox rowBBox = getCellRowBBox(sparseGrid, boundsBBox, cellRow);
+
+				for (k = rowBBox.min().z(); k <= rowBBox.max().z(); k++)
+				{
+					unsigned int kIndex = k - boundsMin.z();
+					for (j = rowBBox.min().y(); j <= rowBBox.max().y(); j++)
+					{
+						unsigned int jIndex = j - boundsMin.y();
+
+						float* pRowValue = &rowValues[0];
+						for (i = rowBBox.min().x(); i <= rowBBox.max().x(); i++)
+						{
+							typename GridType::ValueType value = accessor.getValue(ijk) * m_valueMultiplier;
+
+							pRowValue += getValueComponents(value, pRowValue);
+						}
+
+						setSparseGridRow(sparseGrid, rowBBox.min().x() - boundsMin.x(), jIndex, kIndex, &rowValues[0],
+										 rowBBox.max().x() - rowBBox.min().x() + 1);
+					}
+				}
+			}
+		});
+	});
+}
+
+namespace
+{
+
+template <typename ValueType>
+struct TileRegion
+{
+	TileRegion(const openvdb::CoordBBox& _bbox, const ValueType& _value) : bbox(_bbox), value(_value)
+	{
+	}
+
+	openvdb::CoordBBox	bbox;
+	ValueType			value;
+};
+
+} // namespace
+
+template <typename GridType>
+void VDBConverter::fillSparseGridFromTree(typename GridType::Ptr grid, const GridBounds& bounds, SparseGrid& sparseGrid) const
+{
+	typedef typename GridType::TreeType TreeType;
+	typedef typename GridType::ValueType ValueType;
+	typedef typename TreeType::LeafNodeType LeafType;
+
+	const TreeType& tree = grid->tree();
+
+	openvdb::Coord boundsMin((int)bounds.min.x(), (int)bounds.min.y(), (int)bounds.min.z());
+	openvdb::Coord boundsMax((int)bounds.max.x(), (int)bounds.max.y(), (int)bounds.max.z());
+	openvdb::CoordBBox boundsBBox(boundsMin, boundsMax);
+
+	unsigned int cellSize = sparseGrid.getSubCellSize();
+	unsigned int cellCountY = sparseGrid.getCellCountY();
+	unsigned int numCellRows = cellCountY * sparseGrid.getCellCountZ();
+
+	// bin the leaf nodes and tiles by the rows of subcells (along x) they overlap, so that
+	// each row can then be filled in by a separate task without any locking.
+
+	std::vector<std::vector<const LeafType*> > rowLeaves(numCellRows);
+	std::vector<std::vector<TileRegion<ValueType> > > rowTiles(numCellRows);
+
+	// leaf nodes - we need the inactive values within them as well as the active ones, as
+	// they'd be picked up by the full bounds path, and we want identical results
+	for (typename TreeType::LeafCIter itLeaf = tree.cbeginLeaf(); itLeaf; ++itLeaf)
+	{
+		const LeafType* pLeaf = itLeaf.getLeaf();
+
+		openvdb::CoordBBox leafBBox = pLeaf->getNodeBoundingBox();
+		leafBBox.intersect(boundsBBox);
+		if (leafBBox.empty())
+			continue;
+
+		unsigned int startCellJ = (leafBBox.min().y() - boundsMin.y()) / cellSize;
+		unsigned int endCellJ = (leafBBox.max().y() - boundsMin.y()) / cellSize;
+		unsigned int startCellK = (leafBBox.min().z() - boundsMin.z()) / cellSize;
+		unsigned int endCellK = (leafBBox.max().z() - boundsMin.z()) / cellSize;
+
+		for (unsigned int cellK = startCellK; cellK <= endCellK; cellK++)
+		{
+			for (unsigned int cellJ = startCellJ; cellJ <= endCellJ; cellJ++)
+			{
+				rowLeaves[cellJ + cellK * cellCountY].push_back(pLeaf);
+			}
+		}
+	}
+
+	// tiles - limit the iteration to the internal node levels, as we've got the leaf voxels above
+	typename TreeType::ValueAllCIter itTile = tree.cbeginValueAll();
+	itTile.setMaxDepth(itTile.getLeafDepth() - 1);
+
+	for (; itTile; ++itTile)
+	{
+		ValueType value = itTile.getValue() * m_valueMultiplier;
+		if (isZeroValue(value))
+			continue;
+
+		openvdb::CoordBBox tileBBox;
+		itTile.getBoundingBox(tileBBox);
+		tileBBox.intersect(boundsBBox);
+		if (tileBBox.empty())
+			continue;
+
+		unsigned int startCellJ = (tileBBox.min().y() - boundsMin.y()) / cellSize;
+		unsigned int endCellJ = (tileBBox.max().y() - boundsMin.y()) / cellSize;
+		unsigned int startCellK = (tileBBox.min().z() - boundsMin.z()) / cellSize;
+		unsigned int endCellK = (tileBBox.max().z() - boundsMin.z()) / cellSize;
+
+		for (unsigned int cellK = startCellK; cellK <= endCellK; cellK++)
+		{
+			for (unsigned int cellJ = startCellJ; cellJ <= endCellJ; cellJ++)
+			{
+				rowTiles[cellJ + cellK * cellCountY].push_back(TileRegion<ValueType>(tileBBox, value));
+			}
+		}
+	}
+
+	m_taskArena.execute([&]()
+	{
+		tbb::parallel_for(tbb::blocked_range<unsigned int>(0, numCellRows), [&](const tbb::blocked_range<unsigned int>& range)
+		{
+			for (unsigned int cellRow = range.begin(); cellRow != range.end(); cellRow++)
+			{
+				openvdb::CoordBBox rowBBox = getCellRowBBox(sparseGrid, boundsBBox, cellRow);
+
+				const std::vector<const LeafType*>& leaves = rowLeaves[cellRow];
+				for (unsigned int leafIndex = 0; leafIndex < leaves.size(); leafIndex++)
+				{
+					const LeafType* pLeaf = leaves[leafIndex];
+
+					openvdb::CoordBBox leafBBox = pLeaf->getNodeBoundingBox();
+					leafBBox.intersect(rowBBox);
+
+					fillSparseGridLeaf(sparseGrid, *pLeaf, leafBBox, boundsMin);
+				}
+
+				const std::vector<TileRegion<ValueType> >& tiles = rowTiles[cellRow];
+				for (unsigned int tileIndex = 0; tileIndex < tiles.size(); tileIndex++)
+				{
+					const TileRegion<ValueType>& tile = tiles[tileIndex];
+
+					openvdb::CoordBBox tileBBox = tile.bbox;
+					tileBBox.intersect(rowBBox);
+
+					fillSparseGridRegion(sparseGrid, tileBBox, boundsMin, tile.value);
+				}
+			}
+		});
+	});
+}
+
+template <typename LeafType>
+void VDBConverter::fillSparseGridLeaf(SparseGrid& sparseGrid, const LeafType& leaf, const openvdb::CoordBBox& region,
+									  const openvdb::Coord& boundsMin) const
+{
+	openvdb::Coord ijk;
+	int &i = ijk[0];
+	int &j = ijk[1];
 	int &k = ijk[2];
 
-	unsigned char version = 3;
+	// a row of the leaf, with up to 3 components per voxel
+	float rowValues[LeafType::DIM * 3];
+
+	for (k = region.min().z(); k <= region.max().z(); k++)
+	{
+		unsigned int kIndex = k - boundsMin.z();
+		for (j = region.min().y(); j <= region.max().y(); j++)
+		{
+			unsigned int jIndex = j - boundsMin.y();
+
+			float* pRowValue = rowValues;
+			for (i = region.min().x(); i <= region.max().x(); i++)
+			{
+				typename LeafType::ValueType value = leaf.getValue(ijk) * m_valueMultiplier;
+
+				pRowValue += getValueComponents(value, pRowValue);
+			}
+
+			setSparseGridRow(sparseGrid, region.min().x() - boundsMin.x(), jIndex, kIndex, rowValues,
+							 region.max().x() - region.min().x() + 1);
+		}
+	}
+}
+
+template <typename ValueType>
+void VDBConverter::fillSparseGridRegion(SparseGrid& sparseGrid, const openvdb::CoordBBox& region, const openvdb::Coord& boundsMin,
+										const ValueType& value) const
+{
+	unsigned int minI = region.min().x() - boundsMin.x();
+	unsigned int minJ = region.min().y() - boundsMin.y();
+	unsigned int minK = region.min().z() - boundsMin.z();
+
+	unsigned int maxI = region.max().x() - boundsMin.x();
+	unsigned int maxJ = region.max().y() - boundsMin.y();
+	unsigned int maxK = region.max().z() - boundsMin.z();
 
-	unsigned int gridResX = bounds.max.x() - bounds.min.x() + 1;
-	unsigned int gridResY = bounds.max.y() - bounds.min.y() + 1;
-	unsigned int gridResZ = bounds.max.z() - bounds.min.z() + 1;
+	// every row is the same
+	unsigned int numComponents = sparseGrid.getNumComponents();
+	std::vector<float> rowValues((size_t)(maxI - minI + 1) * numComponents);
 
-	openvdb::Vec3f extent((float)gridResX, (float)gridResY, (float)gridResZ);
-	extent.normalize();
+	for (unsigned int i = 0; i <= maxI - minI; i++)
+	{
+		getValueComponents(value, &rowValues[i * numComponents]);
+	}
 
-	extent *= m_sizeMultiplier;
+	for (unsigned int kIndex = minK; kIndex <= maxK; kIndex++)
+	{
+		for (unsigned int jIndex = minJ; jIndex <= maxJ; jIndex++)
+		{
+			setSparseGridRow(sparseGrid, minI, jIndex, kIndex, &rowValues[0], maxI - minI + 1);
+		}
+	}
+}
 
-	float bbMinX = -extent.x();
-	float bbMinY = -extent.y();
-	float bbMinZ = -extent.z();
+void VDBConverter::setSparseGridRow(SparseGrid& sparseGrid, unsigned int startI, unsigned int j, unsigned int k, const float* pValues,
+									unsigned int numVoxels) const
+{
+	unsigned int numComponents = sparseGrid.getNumComponents();
+	unsigned int numValues = numVoxels * numComponents;
 
-	float bbMaxX = extent.x();
-	float bbMaxY = extent.y();
-	float bbMaxZ = extent.z();
+	if (!extractAsHalf())
+	{
+		for (unsigned int v = 0; v < numValues; v++)
+		{
+			sparseGrid.setVoxelValueFloat(startI + v / numComponents, j, k, pValues[v], v % numComponents);
+		}
 
-	FILE* pFinalFile = fopen(path.c_str(), "wb");
+		return;
+	}
 
-	if (!pFinalFile)
+	// rows can be the full width of the grid, so they're converted in chunks
+	const unsigned int kChunkSize = 256;
+	half halfValues[kChunkSize];
+
+	for (unsigned int chunkStart = 0; chunkStart < numValues; chunkStart += kChunkSize)
 	{
-		fprintf(stderr, "Couldn't open file: %s for writing.\n", path.c_str());
-		return false;
+		unsigned int chunkSize = std::min(kChunkSize, numValues - chunkStart);
+		storeRowValues(pValues + chunkStart, halfValues, chunkSize, m_pStats);
+
+		for (unsigned int v = 0; v < chunkSize; v++)
+		{
+			unsigned int valueIndex = chunkStart + v;
+			sparseGrid.setVoxelValueHalf(startI + valueIndex / numComponents, j, k, halfValues[v], valueIndex % numComponents);
+		}
 	}
+}
+
+namespace
+{
+
+// rounds towards negative infinity, so source voxels either side of zero go to different resampled voxels
+inline int floorDivide(int value, int divisor)
+{
+	return (value >= 0) ? value / divisor : -((-value + divisor - 1) / divisor);
+}
 
-	fwrite(&version, 1, 1, pFinalFile);
+inline float maxComponents(float value1, float value2)
+{
+	return std::max(value1, value2);
+}
 
-	unsigned char dataType = 0;
-	if (m_storeAsHalf)
-		dataType = 1;
+inline openvdb::Vec3s maxComponents(const openvdb::Vec3s& value1, const openvdb::Vec3s& value2)
+{
+	return openvdb::Vec3s(std::max(value1.x(), value2.x()), std::max(value1.y(), value2.y()), std::max(value1.z(), value2.z()));
+}
 
-	fwrite(&dataType, 1, 1, pFinalFile);
+// adds the origins of the resampled leaf nodes which a bbox of source voxels covers
+inline void addResampledLeafOrigins(const openvdb::CoordBBox& bbox, int factor, int leafDim, std::vector<openvdb::Coord>& leafOrigins)
+{
+	// leaf origins are multiples of leafDim, which masking gets for negative coords too
+	const int leafMask = ~(leafDim - 1);
 
-	unsigned char gridType = 1; // sparse
-	fwrite(&gridType, sizeof(unsigned char), 1, pFinalFile);
+	openvdb::Coord leafMin(floorDivide(bbox.min().x(), factor) & leafMask, floorDivide(bbox.min().y(), factor) & leafMask,
+						   floorDivide(bbox.min().z(), factor) & leafMask);
+	openvdb::Coord leafMax(floorDivide(bbox.max().x(), factor) & leafMask, floorDivide(bbox.max().y(), factor) & leafMask,
+						   floorDivide(bbox.max().z(), factor) & leafMask);
 
-	unsigned short subCellSize = m_subCellSize;
-	fwrite(&subCellSize, sizeof(unsigned short), 1, pFinalFile);
+	for (int z = leafMin.z(); z <= leafMax.z(); z += leafDim)
+	{
+		for (int y = leafMin.y(); y <= leafMax.y(); y += leafDim)
+		{
+			for (int x = leafMin.x(); x <= leafMax.x(); x += leafDim)
+			{
+				leafOrigins.push_back(openvdb::Coord(x, y, z));
+			}
+		}
+	}
+}
 
-	fwrite(&gridResX, sizeof(unsigned int), 1, pFinalFile);
-	fwrite(&gridResY, sizeof(unsigned int), 1, pFinalFile);
-	fwrite(&gridResZ, sizeof(unsigned int), 1, pFinalFile);
+} // namespace
 
-	fwrite(&bbMinX, sizeof(float), 1, pFinalFile);
-	fwrite(&bbMinY, sizeof(float), 1, pFinalFile);
-	fwrite(&bbMinZ, sizeof(float), 1, pFinalFile);
+template <typename GridType>
+typename GridType::Ptr VDBConverter::resampleGrid(typename GridType::Ptr grid) const
+{
+	typedef typename GridType::TreeType TreeType;
+	typedef typename GridType::ValueType ValueType;
+	typedef typename TreeType::LeafNodeType LeafType;
 
-	fwrite(&bbMaxX, sizeof(float), 1, pFinalFile);
-	fwrite(&bbMaxY, sizeof(float), 1, pFinalFile);
-	fwrite(&bbMaxZ, sizeof(float), 1, pFinalFile);
+	ScopedPhaseTimer timer(m_pStats, eConversionPhaseResample);
 
-	// create a sparse grid structure to temporarily store the data
+	const TreeType& tree = grid->tree();
+	const ValueType background = tree.background();
 
-	SparseGrid sparseGrid;
-	sparseGrid.resizeGrid(gridResX, gridResY, gridResZ, (unsigned int)subCellSize);
+	const int factor = (int)m_resampleFactor;
+	const int leafDim = (int)LeafType::DIM;
 
-	// now write to the grid subcells
+	// everywhere outside the source's leaf nodes and tiles is the background, so the resampled grid only
+	// needs leaf nodes where those are
+	std::vector<openvdb::Coord> leafOrigins;
 
-	// indices for local access to subcells...
-	unsigned int iIndex = 0;
-	unsigned int jIndex = 0;
-	unsigned int kIndex = 0;
+	for (typename TreeType::LeafCIter itLeaf = tree.cbeginLeaf(); itLeaf; ++itLeaf)
+	{
+		addResampledLeafOrigins(itLeaf->getNodeBoundingBox(), factor, leafDim, leafOrigins);
+	}
 
-	float value = 0.0f;
+	typename TreeType::ValueAllCIter itTile = tree.cbeginValueAll();
+	itTile.setMaxDepth(itTile.getLeafDepth() - 1);
 
-	if (!m_storeAsHalf)
+	for (; itTile; ++itTile)
 	{
-		// full float
+		if (!itTile.isValueOn() && itTile.getValue() == background)
+			continue;
+
+		openvdb::CoordBBox tileBBox;
+		itTile.getBoundingBox(tileBBox);
+
+		addResampledLeafOrigins(tileBBox, factor, leafDim, leafOrigins);
+	}
+
+	std::sort(leafOrigins.begin(), leafOrigins.end());
+	leafOrigins.erase(std::unique(leafOrigins.begin(), leafOrigins.end()), leafOrigins.end());
 
-		for (k = bounds.min.z(), kIndex = 0; k <= bounds.max.z(); k++, kIndex++)
+	// each task builds its own leaf nodes, which are added to the tree afterwards, as the tree can't be
+	// changed from multiple threads
+	std::vector<LeafType*> leaves(leafOrigins.size(), NULL);
+
+	m_taskArena.execute([&]()
+	{
+		tbb::parallel_for(tbb::blocked_range<size_t>(0, leafOrigins.size()), [&](const tbb::blocked_range<size_t>& range)
 		{
-			for (j = bounds.min.y(), jIndex = 0; j <= bounds.max.y(); j++, jIndex++)
+			typename GridType::ConstAccessor accessor = grid->getConstAccessor();
+
+			const float boxWeight = 1.0f / (float)(factor * factor * factor);
+
+			for (size_t leafIndex = range.begin(); leafIndex != range.end(); leafIndex++)
 			{
-				for (i = bounds.min.x(), iIndex = 0; i <= bounds.max.x(); i++, iIndex++)
+				LeafType* pLeaf = new LeafType(leafOrigins[leafIndex], background);
+				bool haveValues = false;
+
+				for (openvdb::Index offset = 0; offset < LeafType::NUM_VALUES; offset++)
 				{
-					value = accessor.getValue(ijk) * m_valueMultiplier;
+					openvdb::Coord resampledCoord = pLeaf->offsetToGlobalCoord(offset);
+					openvdb::Coord srcMin(resampledCoord.x() * factor, resampledCoord.y() * factor, resampledCoord.z() * factor);
+
+					// voxels outside the source's tree are the background, which the box filter includes, so
+					// the edges of the volume fade out rather than being stretched
+					ValueType sum = openvdb::zeroVal<ValueType>();
+					ValueType maxValue = background;
+					bool isActive = false;
+					bool firstValue = true;
+
+					openvdb::Coord srcCoord;
+					for (srcCoord.z() = srcMin.z(); srcCoord.z() < srcMin.z() + factor; srcCoord.z()++)
+					{
+						for (srcCoord.y() = srcMin.y(); srcCoord.y() < srcMin.y() + factor; srcCoord.y()++)
+						{
+							for (srcCoord.x() = srcMin.x(); srcCoord.x() < srcMin.x() + factor; srcCoord.x()++)
+							{
+								const ValueType& value = accessor.getValue(srcCoord);
+
+								sum = sum + value;
+								maxValue = firstValue ? value : maxComponents(maxValue, value);
+								firstValue = false;
+
+								isActive |= accessor.isValueOn(srcCoord);
+							}
+						}
+					}
+
+					ValueType resampledValue = (m_resampleFilter == eIVVMipFilterMax) ? maxValue : sum * boxWeight;
+
+					if (isActive)
+					{
+						pLeaf->setValueOn(offset, resampledValue);
+						haveValues = true;
+					}
+					else if (resampledValue != background)
+					{
+						pLeaf->setValueOff(offset, resampledValue);
+						haveValues = true;
+					}
+				}
 
-					sparseGrid.setVoxelValueFloat(iIndex, jIndex, kIndex, value);
+				if (haveValues)
+				{
+					leaves[leafIndex] = pLeaf;
+				}
+				else
+				{
+					delete pLeaf;
 				}
 			}
+		});
+	});
+
+	typename GridType::Ptr resampledGrid = GridType::create(background);
+	resampledGrid->setName(grid->getName());
+	resampledGrid->setGridClass(grid->getGridClass());
+
+	// the conversion only uses the index space, but keep the world space size the same
+	openvdb::math::Transform::Ptr transform = grid->transform().copy();
+	transform->preScale((double)factor);
+	resampledGrid->setTransform(transform);
+
+	for (size_t leafIndex = 0; leafIndex < leaves.size(); leafIndex++)
+	{
+		if (leaves[leafIndex])
+		{
+			resampledGrid->tree().addLeaf(leaves[leafIndex]);
 		}
 	}
-	else
+
+	return resampledGrid;
+}
+
+unsigned int VDBConverter::chooseSubCellSize(const std::vector<GridConversion>& grids, const GridBounds& bounds) const
+{
+	std::vector<SubCellSizeEstimate> estimates;
+	for (unsigned int i = 0; i < kNumAutoSubCellSizes; i++)
+	{
+		estimates.push_back(SubCellSizeEstimate(kAutoSubCellSizes[i]));
+	}
+
+	for (unsigned int i = 0; i < grids.size(); i++)
+	{
+		if (grids[i].vectorGrid)
+		{
+			estimateSubCellSizes<openvdb::Vec3SGrid>(grids[i].vectorGrid, bounds, estimates);
+		}
+		else
+		{
+			estimateSubCellSizes<openvdb::FloatGrid>(grids[i].grid, bounds, estimates);
+		}
+	}
+
+	unsigned int bestIndex = 0;
+
+	fprintf(stderr, "Sub cell size estimates:\n");
+	for (unsigned int i = 0; i < estimates.size(); i++)
+	{
+		const SubCellSizeEstimate& estimate = estimates[i];
+
+		fprintf(stderr, "  %u: %llu/%llu subcells, file: %.1f MB, memory: %.1f MB\n", estimate.cellSize,
+				(unsigned long long)estimate.numAllocatedSubCells, (unsigned long long)estimate.numSubCells,
+				(double)estimate.fileSize / (1024.0 * 1024.0), (double)estimate.memorySize / (1024.0 * 1024.0));
+
+		const SubCellSizeEstimate& best = estimates[bestIndex];
+		if (estimate.fileSize + estimate.memorySize < best.fileSize + best.memorySize)
+		{
+			bestIndex = i;
+		}
+	}
+
+	fprintf(stderr, "Using sub cell size: %u\n", estimates[bestIndex].cellSize);
+
+	return estimates[bestIndex].cellSize;
+}
+
+template <typename GridType>
+void VDBConverter::estimateSubCellSizes(typename GridType::Ptr grid, const GridBounds& bounds, std::vector<SubCellSizeEstimate>& estimates) const
+{
+	typedef typename GridType::TreeType TreeType;
+	typedef typename GridType::ValueType ValueType;
+	typedef typename TreeType::LeafNodeType LeafType;
+
+	const TreeType& tree = grid->tree();
+
+	openvdb::Coord boundsMin((int)bounds.min.x(), (int)bounds.min.y(), (int)bounds.min.z());
+	openvdb::Coord boundsMax((int)bounds.max.x(), (int)bounds.max.y(), (int)bounds.max.z());
+	openvdb::CoordBBox boundsBBox(boundsMin, boundsMax);
+
+	unsigned int resX = boundsMax.x() - boundsMin.x() + 1;
+	unsigned int resY = boundsMax.y() - boundsMin.y() + 1;
+	unsigned int resZ = boundsMax.z() - boundsMin.z() + 1;
+
+	unsigned int numComponents = (unsigned int)(sizeof(ValueType) / sizeof(float));
+	size_t memoryValueSize = (extractAsHalf() ? sizeof(half) : sizeof(float)) * numComponents;
+	size_t fileValueSize = ((m_quantizeBits > 0) ? m_quantizeBits / 8 : (extractAsHalf() ? sizeof(half) : sizeof(float))) * numComponents;
+
+	// a subcell's allocated if any voxel within it has a non-zero value, so with a non-zero background,
+	// every one is
+	bool allAllocated = !isZeroValue(grid->background() * m_valueMultiplier);
+
+	std::vector<const LeafType*> leaves;
+	if (!allAllocated)
 	{
-		// half
+		for (typename TreeType::LeafCIter itLeaf = tree.cbeginLeaf(); itLeaf; ++itLeaf)
+		{
+			leaves.push_back(itLeaf.getLeaf());
+		}
+	}
+
+	// all the sizes are at least the leaf size, so each leaf's voxels fall within at most 2x2x2 subcells of each
+	// size. For each leaf and size, work out which of those have non-zero values within them, as a bit each.
+	unsigned int numSizes = (unsigned int)estimates.size();
+	std::vector<unsigned char> leafSubCellMasks(leaves.size() * numSizes, 0);
 
-		for (k = bounds.min.z(), kIndex = 0; k <= bounds.max.z(); k++, kIndex++)
+	m_taskArena.execute([&]()
+	{
+		tbb::parallel_for(tbb::blocked_range<size_t>(0, leaves.size()), [&](const tbb::blocked_range<size_t>& range)
 		{
-			for (j = bounds.min.y(), jIndex = 0; j <= bounds.max.y(); j++, jIndex++)
+			for (size_t leafIndex = range.begin(); leafIndex != range.end(); leafIndex++)
 			{
-				for (i = bounds.min.x(), iIndex = 0; i <= bounds.max.x(); i++, iIndex++)
+				const LeafType* pLeaf = leaves[leafIndex];
+
+				openvdb::CoordBBox leafBBox = pLeaf->getNodeBoundingBox();
+				leafBBox.intersect(boundsBBox);
+				if (leafBBox.empty())
+					continue;
+
+				unsigned char* pMasks = &leafSubCellMasks[leafIndex * numSizes];
+
+				for (openvdb::Index offset = 0; offset < LeafType::NUM_VALUES; offset++)
 				{
-					value = accessor.getValue(ijk) * m_valueMultiplier;
+					if (isZeroValue(pLeaf->getValue(offset) * m_valueMultiplier))
+						continue;
+
+					openvdb::Coord ijk = pLeaf->offsetToGlobalCoord(offset);
+					if (!boundsBBox.isInside(ijk))
+						continue;
+
+					for (unsigned int sizeIndex = 0; sizeIndex < numSizes; sizeIndex++)
+					{
+						int cellSize = (int)estimates[sizeIndex].cellSize;
+
+						// relative to the subcell the min corner of the leaf's within
+						unsigned int x = (ijk.x() - boundsMin.x()) / cellSize - (leafBBox.min().x() - boundsMin.x()) / cellSize;
+						unsigned int y = (ijk.y() - boundsMin.y()) / cellSize - (leafBBox.min().y() - boundsMin.y()) / cellSize;
+						unsigned int z = (ijk.z() - boundsMin.z()) / cellSize - (leafBBox.min().z() - boundsMin.z()) / cellSize;
 
-					sparseGrid.setVoxelValueHalf(iIndex, jIndex, kIndex, (half)value);
+						pMasks[sizeIndex] |= 1 << (x + y * 2 + z * 4);
+					}
 				}
 			}
+		});
+	});
+
+	// tiles - as with fillSparseGridFromTree, only the internal node levels
+	std::vector<openvdb::CoordBBox> tileBBoxes;
+	if (!allAllocated)
+	{
+		typename TreeType::ValueAllCIter itTile = tree.cbeginValueAll();
+		itTile.setMaxDepth(itTile.getLeafDepth() - 1);
+
+		for (; itTile; ++itTile)
+		{
+			if (isZeroValue(itTile.getValue() * m_valueMultiplier))
+				continue;
+
+			openvdb::CoordBBox tileBBox;
+			itTile.getBoundingBox(tileBBox);
+			tileBBox.intersect(boundsBBox);
+			if (!tileBBox.empty())
+			{
+				tileBBoxes.push_back(tileBBox);
+			}
 		}
 	}
 
-	// now we need to store for each subcell whether they have data or not.
-	// because we know the subcell size and the full grid size, we can work out
-	// each subcell size on-the-fly, without having to store it
-	
-	// group the subCells into batches of 8, so we can be efficient and use an unsigned char
-	// as a bitset for the state of the next 8 subcells
-
-	const SparseGrid::SparseSubCell* nextBatch[8];
-	memset(nextBatch, 0, sizeof(void*) * 8);
-	
-	const std::vector<SparseGrid::SparseSubCell*>& subCells = sparseGrid.getSubCells();
-	
-	unsigned int cellsRemaining = subCells.size();
-	
-	for (unsigned int cellIndex = 0; cellIndex < subCells.size(); )
+	for (unsigned int sizeIndex = 0; sizeIndex < numSizes; sizeIndex++)
 	{
-		unsigned int batchSize = std::min(cellsRemaining, 8u);
-		
-		unsigned char subCellStateFlags = 0;
-		unsigned int batchCount = 0;
-		
-		for (unsigned int batchIndex = 0; batchIndex < batchSize; batchIndex++)
+		SubCellSizeEstimate& estimate = estimates[sizeIndex];
+		unsigned int cellSize = estimate.cellSize;
+
+		uint64_t cellCountX = (resX + cellSize - 1) / cellSize;
+		uint64_t cellCountY = (resY + cellSize - 1) / cellSize;
+		uint64_t cellCountZ = (resZ + cellSize - 1) / cellSize;
+		uint64_t numSubCells = cellCountX * cellCountY * cellCountZ;
+
+		// the linear indices of the allocated subcells
+		std::vector<uint64_t> allocatedCells;
+
+		for (size_t leafIndex = 0; leafIndex < leaves.size(); leafIndex++)
 		{
-			const SparseGrid::SparseSubCell* pSubCell = subCells[cellIndex + batchIndex];
-			
-			bool isAllocated = pSubCell->isAllocated();
-			
-			subCellStateFlags |= (isAllocated << batchIndex);
-			
-			if (isAllocated)
+			unsigned char mask = leafSubCellMasks[leafIndex * numSizes + sizeIndex];
+			if (mask == 0)
+				continue;
+
+			openvdb::CoordBBox leafBBox = leaves[leafIndex]->getNodeBoundingBox();
+			leafBBox.intersect(boundsBBox);
+
+			uint64_t cellI = (leafBBox.min().x() - boundsMin.x()) / cellSize;
+			uint64_t cellJ = (leafBBox.min().y() - boundsMin.y()) / cellSize;
+			uint64_t cellK = (leafBBox.min().z() - boundsMin.z()) / cellSize;
+
+			for (unsigned int bit = 0; bit < 8; bit++)
 			{
-				nextBatch[batchCount++] = pSubCell;
+				if (mask & (1 << bit))
+				{
+					allocatedCells.push_back((cellI + (bit & 1)) + (cellJ + ((bit >> 1) & 1)) * cellCountX +
+											 (cellK + (bit >> 2)) * cellCountX * cellCountY);
+				}
 			}
 		}
-		
-		fwrite(&subCellStateFlags, sizeof(unsigned char), 1, pFinalFile);
-		
-		// now write out the contents of any allocated cells
-		
-		for (unsigned int batchIndex = 0; batchIndex < batchCount; batchIndex++)
+
+		for (size_t tileIndex = 0; tileIndex < tileBBoxes.size(); tileIndex++)
 		{
-			const SparseGrid::SparseSubCell* pSubCell = nextBatch[batchIndex];
-			
-			// also write the data - we don't need to write the length, as we can
-			// reverse-engineer it when reading based on info we already have...
-			unsigned int cellDataLength = pSubCell->getResXY() * pSubCell->getResZ();
+			const openvdb::CoordBBox& tileBBox = tileBBoxes[tileIndex];
 
-			if (!m_storeAsHalf)
+			for (uint64_t cellK = (tileBBox.min().z() - boundsMin.z()) / cellSize; cellK <= (tileBBox.max().z() - boundsMin.z()) / cellSize; cellK++)
 			{
-				const float* pCellFloatData = pSubCell->getRawFloatData();
-				fwrite(pCellFloatData, sizeof(float), cellDataLength, pFinalFile);
+				for (uint64_t cellJ = (tileBBox.min().y() - boundsMin.y()) / cellSize; cellJ <= (tileBBox.max().y() - boundsMin.y()) / cellSize; cellJ++)
+				{
+					for (uint64_t cellI = (tileBBox.min().x() - boundsMin.x()) / cellSize; cellI <= (tileBBox.max().x() - boundsMin.x()) / cellSize; cellI++)
+					{
+						allocatedCells.push_back(cellI + cellJ * cellCountX + cellK * cellCountX * cellCountY);
+					}
+				}
 			}
-			else
+		}
+
+		std::sort(allocatedCells.begin(), allocatedCells.end());
+		allocatedCells.erase(std::unique(allocatedCells.begin(), allocatedCells.end()), allocatedCells.end());
+
+		uint64_t numAllocated = allAllocated ? numSubCells : allocatedCells.size();
+
+		// the subcells at the max edges are clipped to the grid
+		uint64_t allocatedVoxels = 0;
+		if (allAllocated)
+		{
+			allocatedVoxels = (uint64_t)resX * resY * resZ;
+		}
+		else
+		{
+			for (size_t i = 0; i < allocatedCells.size(); i++)
 			{
-				const half* pCellHalfData = pSubCell->getRawHalfData();
-				fwrite(pCellHalfData, sizeof(half), cellDataLength, pFinalFile);
+				uint64_t cellI = allocatedCells[i] % cellCountX;
+				uint64_t cellJ = (allocatedCells[i] / cellCountX) % cellCountY;
+				uint64_t cellK = allocatedCells[i] / (cellCountX * cellCountY);
+
+				allocatedVoxels += std::min((uint64_t)cellSize, resX - cellI * cellSize) *
+								   std::min((uint64_t)cellSize, resY - cellJ * cellSize) *
+								   std::min((uint64_t)cellSize, resZ - cellK * cellSize);
 			}
 		}
-		
-		cellIndex += 8;
-		cellsRemaining -= batchSize;
+
+		// the file has the allocated flag bits for every subcell, and the values of the allocated ones. Compression
+		// etc can't be known without doing it, so this is the raw size.
+		uint64_t fileSize = (numSubCells + 7) / 8 + allocatedVoxels * fileValueSize;
+		if (m_writeSubCellIndex)
+		{
+			fileSize += numAllocated * sizeof(uint64_t);
+		}
+
+		// in memory, there's the subcells themselves as well as their values
+		uint64_t memorySize = allocatedVoxels * memoryValueSize;
+		if (m_cellStorage == SparseGrid::eCellStorageActive)
+		{
+			// the subcells are created in blocks of 4x4x4
+			uint64_t blockCountX = (cellCountX + 3) / 4;
+			uint64_t blockCountY = (cellCountY + 3) / 4;
+			uint64_t blockCountZ = (cellCountZ + 3) / 4;
+
+			std::vector<uint64_t> allocatedBlocks;
+			for (size_t i = 0; i < allocatedCells.size(); i++)
+			{
+				uint64_t cellI = allocatedCells[i] % cellCountX;
+				uint64_t cellJ = (allocatedCells[i] / cellCountX) % cellCountY;
+				uint64_t cellK = allocatedCells[i] / (cellCountX * cellCountY);
+
+				allocatedBlocks.push_back(cellI / 4 + (cellJ / 4) * blockCountX + (cellK / 4) * blockCountX * blockCountY);
+			}
+
+			std::sort(allocatedBlocks.begin(), allocatedBlocks.end());
+			uint64_t numBlocks = allAllocated ? blockCountX * blockCountY * blockCountZ :
+											   std::unique(allocatedBlocks.begin(), allocatedBlocks.end()) - allocatedBlocks.begin();
+
+			memorySize += blockCountX * blockCountY * blockCountZ * sizeof(void*) + numBlocks * 64 * sizeof(SparseGrid::SparseSubCell);
+		}
+		else
+		{
+			memorySize += numSubCells * sizeof(SparseGrid::SparseSubCell);
+			if (m_subCellLayout == SparseGrid::eSubCellLayoutMorton)
+			{
+				memorySize += numSubCells * sizeof(uint64_t);
+			}
+		}
+
+		estimate.numSubCells += numSubCells;
+		estimate.numAllocatedSubCells += numAllocated;
+		estimate.allocatedVoxels += allocatedVoxels;
+		estimate.fileSize += fileSize;
+		estimate.memorySize += memorySize;
 	}
+}
 
-	fclose(pFinalFile);
+openvdb::CoordBBox VDBConverter::getCellRowBBox(const SparseGrid& sparseGrid, const openvdb::CoordBBox& boundsBBox, unsigned int cellRow)
+{
+	unsigned int cellSize = sparseGrid.getSubCellSize();
+	unsigned int cellCountY = sparseGrid.getCellCountY();
 
-	return true;
+	unsigned int cellJ = cellRow % cellCountY;
+	unsigned int cellK = cellRow / cellCountY;
+
+	openvdb::Coord rowMin(boundsBBox.min().x(), boundsBBox.min().y() + cellJ * cellSize, boundsBBox.min().z() + cellK * cellSize);
+	openvdb::Coord rowMax(boundsBBox.max().x(), std::min(rowMin.y() + (int)cellSize - 1, boundsBBox.max().y()),
+						  std::min(rowMin.z() + (int)cellSize - 1, boundsBBox.max().z()));
+
+	return openvdb::CoordBBox(rowMin, rowMax);
+}
+
+bool VDBConverter::findSequenceFrameRange(const std::string& fileName, unsigned int& startFrame, unsigned int& endFrame)
+{
+	size_t sequenceCharStart = fileName.find_first_of("#");
+	if (sequenceCharStart == std::string::npos)
+		return false;
+
+	size_t sequenceCharEnd = fileName.find_first_not_of("#", sequenceCharStart);
+
+	std::string prefix = fileName.substr(0, sequenceCharStart);
+	std::string suffix = (sequenceCharEnd == std::string::npos) ? "" : fileName.substr(sequenceCharEnd);
+
+	size_t paddingWidth = ((sequenceCharEnd == std::string::npos) ? fileName.size() : sequenceCharEnd) - sequenceCharStart;
+
+	std::string directory = ".";
+	size_t slashPos = prefix.find_last_of("/");
+	if (slashPos != std::string::npos)
+	{
+		directory = (slashPos == 0) ? "/" : prefix.substr(0, slashPos);
+		prefix = prefix.substr(slashPos + 1);
+	}
+
+	DIR* pDir = opendir(directory.c_str());
+	if (!pDir)
+		return false;
+
+	bool foundFrame = false;
+
+	struct dirent* pEntry = NULL;
+	while ((pEntry = readdir(pDir)) != NULL)
+	{
+		std::string entryName = pEntry->d_name;
+
+		if (entryName.size() <= prefix.size() + suffix.size())
+			continue;
+
+		if (entryName.compare(0, prefix.size(), prefix) != 0 ||
+			entryName.compare(entryName.size() - suffix.size(), suffix.size(), suffix) != 0)
+		{
+			continue;
+		}
+
+		std::string frameString = entryName.substr(prefix.size(), entryName.size() - prefix.size() - suffix.size());
+		if (frameString.find_first_not_of("0123456789") != std::string::npos)
+			continue;
+
+		// only the file names getFrameFileName() would give - frame numbers padded to the number of #s, or
+		// longer ones which overflow the padding, so never have leading zeros. Otherwise "fluid.####.vdb"
+		// would pick up other sequences like "fluid.01.vdb" in the same directory.
+		if (frameString.size() < paddingWidth || (frameString.size() > paddingWidth && frameString[0] == '0'))
+			continue;
+
+		unsigned int frame = atoi(frameString.c_str());
+
+		if (!foundFrame)
+		{
+			startFrame = frame;
+			endFrame = frame;
+			foundFrame = true;
+		}
+		else
+		{
+			startFrame = std::min(startFrame, frame);
+			endFrame = std::max(endFrame, frame);
+		}
+	}
+
+	closedir(pDir);
+
+	return foundFrame;
+}
+
+std::string VDBConverter::getDefaultBoundsManifestPath(const std::string& dstPath)
+{
+	// strip the frame number part and anything after it, so it's the same for every frame
+	std::string manifestPath = dstPath.substr(0, dstPath.find_first_of("#"));
+
+	size_t endPos = manifestPath.find_last_not_of("._");
+	if (endPos == std::string::npos || manifestPath[endPos] == '/')
+	{
+		manifestPath += "sequence";
+	}
+	else
+	{
+		manifestPath = manifestPath.substr(0, endPos + 1);
+	}
+
+	return manifestPath + ".bounds";
 }
 
 std::string VDBConverter::getFrameFileName(const std::string& fileName, unsigned int frame)
@@ -23,42 +23,140 @@
 
 #include <OpenEXR/half.h>
 
-struct GridBounds
+#include <tbb/task_arena.h>
+
+#include "grid_bounds.h"
+#include "ivv_format.h"
+#include "sparse_grid.h"
+
+// how an allocated subcell's data will be written in the extended format
+struct EncodedSubCell
 {
-	GridBounds() : min(5000.0f), max(-5000.0f)
+	EncodedSubCell() : encoding(eIVVSubCellRaw), quantizeOffset(0.0f), quantizeScale(0.0f), quantizeError(0.0f)
 	{
-
 	}
 
-	void mergeGrid(openvdb::FloatGrid::Ptr grid)
+	unsigned char				encoding;
+	// for quantized grids
+	float						quantizeOffset;
+	float						quantizeScale;
+	float						quantizeError;
+	// empty for raw subcells of non-quantized grids, which are written directly from the subcell.
+	// for constant subcells, it's the single value
+	std::vector<unsigned char>	data;
+};
+
+// the estimated cost of converting grids with a particular subcell size, for choosing it automatically
+struct SubCellSizeEstimate
+{
+	SubCellSizeEstimate(unsigned int _cellSize = 0) : cellSize(_cellSize), numSubCells(0), numAllocatedSubCells(0),
+		allocatedVoxels(0), fileSize(0), memorySize(0)
 	{
-		// work out bbox
-		openvdb::CoordBBox bbox = grid->evalActiveVoxelBoundingBox();
+	}
 
-		openvdb::Coord voxelMin = bbox.min();
-		openvdb::Coord voxelMax = bbox.max();
+	unsigned int	cellSize;
+	uint64_t		numSubCells;
+	uint64_t		numAllocatedSubCells;
+	// the number of voxels within the allocated subcells (which can be clipped at the edges of the grid)
+	uint64_t		allocatedVoxels;
+	uint64_t		fileSize;
+	uint64_t		memorySize;
+};
 
-		openvdb::Vec3d gridMin = voxelMin.asVec3d();
-		openvdb::Vec3d gridMax = voxelMax.asVec3d();
-/*
-		fprintf(stderr, "rr: %f, %f, %f - %f, %f, %f\n", gridMin.x(), gridMin.y(), gridMin.z(), gridMax.x(), gridMax.y(), gridMax.z());
+// a grid within a VDB file which is to be converted, and the path it should be saved to
+struct GridConversion
+{
+	// the source grid, whichever type it is
+	openvdb::GridBase::Ptr getGrid() const
+	{
+		if (vectorGrid)
+			return vectorGrid;
 
-		grid->transform().print(std::cout, " ");
-*/
-		min.x() = std::min(min.x(), (float)gridMin.x());
-		min.y() = std::min(min.y(), (float)gridMin.y());
-		min.z() = std::min(min.z(), (float)gridMin.z());
+		return grid;
+	}
 
-		max.x() = std::max(max.x(), (float)gridMax.x());
-		max.y() = std::max(max.y(), (float)gridMax.y());
-		max.z() = std::max(max.z(), (float)gridMax.z());
+	void resetGrid()
+	{
+		grid.reset();
+		vectorGrid.reset();
 	}
 
-	openvdb::Vec3f min;
-	openvdb::Vec3f max;
+	std::string					gridName;
+	// the name used for the channel in multi-channel files
+	std::string					channelName;
+	std::string					destPath;
+
+	// only one of these is set
+	openvdb::FloatGrid::Ptr		grid;
+	openvdb::Vec3SGrid::Ptr		vectorGrid;
 };
 
+// the voxel values extracted from a grid within the bounds, either as a dense array or as a
+// sparse grid, ready to be written out
+class ConvertedGrid
+{
+public:
+	ConvertedGrid() : resX(0), resY(0), resZ(0), numComponents(1), isSparse(false), isHalf(false), quantizeBits(0), isStreamed(false),
+		valueMultiplier(1.0f), pDenseFloatValues(NULL), pDenseHalfValues(NULL), temporalDelta(false), frame(0), referenceFrame(0),
+		hasFrameOffset(false)
+	{
+	}
+
+	~ConvertedGrid()
+	{
+		freeData();
+	}
+
+	void freeData();
+
+	size_t getMemorySize() const;
+
+	unsigned int	resX;
+	unsigned int	resY;
+	unsigned int	resZ;
+	// 3 for vector grids, which are always sparse
+	unsigned int	numComponents;
+
+	bool			isSparse;
+	bool			isHalf;
+	// 0 if not quantized, otherwise 8 or 16 - the values are extracted as floats, and quantized as they're written
+	unsigned int	quantizeBits;
+
+	// the voxel bounds the grid was converted with
+	GridBounds		bounds;
+
+	// for streamed dense grids, the values are extracted from the source grid as they're written
+	bool			isStreamed;
+	openvdb::FloatGrid::Ptr	pStreamGrid;
+	float			valueMultiplier;
+
+	float*			pDenseFloatValues;
+	half*			pDenseHalfValues;
+
+	SparseGrid		sparseGrid;
 
+	// successively half-resolution versions of the grid, which are owned by it
+	std::vector<ConvertedGrid*>	mipLevels;
+
+	// for temporal delta encoding of sparse sequences - the frame this is, the frame it refers to (itself for
+	// keyframes), and for each allocated subcell (in order) whether it's written as a reference to that frame's subcell
+	bool			temporalDelta;
+	unsigned int	frame;
+	unsigned int	referenceFrame;
+	std::vector<unsigned char>	temporalReferences;
+
+	// for sequences converted with per-frame bounds, the bounds of the whole sequence, which the grid's
+	// bounds are within
+	bool			hasFrameOffset;
+	GridBounds		sequenceBounds;
+
+private:
+	// not copyable
+	ConvertedGrid(const ConvertedGrid& rhs);
+	ConvertedGrid& operator=(const ConvertedGrid& rhs);
+};
+
+class ConversionStats;
 
 class VDBConverter
 {
@@ -68,29 +166,284 @@ public:
 	void setSizeMultiplier(float sizeMultipler) { m_sizeMultiplier = sizeMultipler; }
 	void setValueMultiplier(float valueMultiplier) { m_valueMultiplier = valueMultiplier; }
 	void setSparseSubCellSize(unsigned int subCellSize) { m_subCellSize = subCellSize; }
+	// pick the subcell size from the grid topology, as whichever of kAutoSubCellSizes is estimated to need
+	// the least file size and memory. For sequences, it's chosen once for all frames.
+	void setAutoSparseSubCellSize(bool autoSize) { m_autoSubCellSize = autoSize; }
+	// the Morton layout means the extended file format will be written
+	void setSparseSubCellLayout(SparseGrid::SubCellLayout layout) { m_subCellLayout = layout; }
+	// eCellStorageActive only creates the subcells which have values, for huge, very sparse domains - it
+	// always uses the linear layout
+	void setSparseCellStorage(SparseGrid::CellStorage storage) { m_cellStorage = storage; }
+	// 0 means use all available cores. Must be set before any conversion.
+	void setNumThreads(unsigned int numThreads) { m_numThreads = numThreads; }
+	// limits for the sequence conversion pipeline - 0 means use the defaults (one frame per
+	// thread, and half the physical memory)
+	void setMaxFramesInFlight(unsigned int maxFrames) { m_maxFramesInFlight = maxFrames; }
+	void setMemoryLimit(size_t memoryLimit) { m_memoryLimit = memoryLimit; }
+
+	// compression of sparse subcells - setting a codec other than eIVVCodecNone means the extended
+	// file format will be written
+	void setCompression(unsigned char codec, unsigned char filter) { m_compressionCodec = codec; m_compressionFilter = filter; }
+	// store sparse subcells where every voxel has the same value as a single value - this also means
+	// the extended file format will be written
+	void setCollapseConstantSubCells(bool collapse) { m_collapseConstantSubCells = collapse; }
+	// store sparse subcells as a mask of which voxels are non-zero and just their values, where that's
+	// smaller - this also means the extended file format will be written
+	void setMaskSubCells(bool maskSubCells) { m_maskSubCells = maskSubCells; }
+	// write sparse grids with an offset for each allocated subcell and aligned payloads, so readers
+	// can seek to (or mmap) any subcell directly - this also means the extended file format will be written
+	void setWriteSubCellIndex(bool writeIndex) { m_writeSubCellIndex = writeIndex; }
+	// write all the grids converted from a file into one multi-channel file (sparse grids only),
+	// rather than a file per grid
+	void setWriteMultiChannel(bool multiChannel) { m_writeMultiChannel = multiChannel; }
+	// converts the grid with this name (float or vector) to a channel or file of this name. If any mappings are
+	// added, only those grids are converted, rather than the default of density and temperature (or the only grid)
+	void addGridMapping(const std::string& gridName, const std::string& channelName)
+	{
+		m_gridMappings.push_back(std::make_pair(gridName, channelName));
+	}
+	// the number of extra half-resolution levels to generate and store after the full-res one,
+	// with the filter (IVVMipFilter) used to build them
+	void setMipLevels(unsigned int mipLevels, unsigned char mipFilter) { m_mipLevels = mipLevels; m_mipFilter = mipFilter; }
+	// filter the grids down to a voxel size this many times larger as they're read, before converting them (1 to
+	// not resample), with the filter (IVVMipFilter) used to combine each block of source voxels
+	void setResample(unsigned int factor, unsigned char filter) { m_resampleFactor = factor; m_resampleFilter = filter; }
+
+	// for sequences - the frames to convert (by default, all frames found on disk), and the
+	// shard of those frames to convert, so that conversion can be split across multiple machines.
+	// the bounds are always worked out for the whole sequence.
+	void setFrameRange(unsigned int startFrame, unsigned int endFrame)
+	{
+		m_haveFrameRange = true;
+		m_startFrame = startFrame;
+		m_endFrame = endFrame;
+	}
+	void setShard(unsigned int shardIndex, unsigned int shardCount) { m_shardIndex = shardIndex; m_shardCount = shardCount; }
+	// by default the bounds manifest is saved next to the destination files
+	void setBoundsManifestPath(const std::string& manifestPath) { m_boundsManifestPath = manifestPath; }
+	// just work out the bounds of the sequence and save the manifest, without converting anything
+	void setBoundsOnly(bool boundsOnly) { m_boundsOnly = boundsOnly; }
 
 	void setStoreAsHalf(bool storeHalf) { m_storeAsHalf = storeHalf; }
+	// 0 to disable, otherwise 8 or 16 bits. Overrides storing as half.
+	void setQuantizeBits(unsigned int quantizeBits) { m_quantizeBits = quantizeBits; }
 	void setUseSparseGrid(bool useSparse) { m_useSparseGrids = useSparse; }
+	void setStreamDenseGrids(bool streamDense) { m_streamDenseGrids = streamDense; }
+	// if set, the time of each phase of the conversion, the bytes read and written, and the sparse grid
+	// occupancy are added to this (which isn't owned)
+	void setStats(ConversionStats* pStats) { m_pStats = pStats; }
+
+	// the size of the buffer used to write streamed dense grids a slab of z slices at a time
+	static const size_t kDenseStreamBufferSize = 4 * 1024 * 1024;
+	// for sequences of sparse grids, store subcells which are within the tolerance of the previous frame's as a
+	// reference to it, with a keyframe (with no references) every keyframeInterval frames
+	void setTemporalDelta(bool temporalDelta, float tolerance, unsigned int keyframeInterval)
+	{
+		m_temporalDelta = temporalDelta;
+		m_temporalTolerance = tolerance;
+		m_keyframeInterval = keyframeInterval;
+	}
+
+	// for sequences, convert each frame with its own bounds rather than the bounds of the whole sequence, storing
+	// where they are within the sequence's bounds
+	void setPerFrameBounds(bool perFrameBounds) { m_perFrameBounds = perFrameBounds; }
+
+	// the alignment of subcell payloads within the file when writing the subcell index
+	static const size_t kIndexedPayloadAlignment = 64;
+	// the subcell sizes considered when choosing it automatically - VDB leaf nodes are 8 voxels
+	// across, so the topology can't tell us anything about smaller ones
+	static const unsigned int kNumAutoSubCellSizes = 4;
+	static const unsigned int kAutoSubCellSizes[kNumAutoSubCellSizes];
 
 	bool convertSingle(const std::string& srcPath, const std::string& dstPath);
+	// frames which can't be read, converted or written are skipped, and make this return false once the rest are done
 	bool convertSequence(const std::string& srcPath, const std::string& dstPath);
 
 protected:
 
-	bool saveGrid(openvdb::FloatGrid::Ptr grid, const GridBounds& bounds, const std::string& path) const;
+	// gets the bounds of all frames in the range, using the bounds manifest for any frames
+	// which have up-to-date bounds in it, and updating it with any which didn't
+	bool getSequenceBounds(const std::string& srcPath, const std::string& dstPath, unsigned int startFrame,
+						   unsigned int endFrame, GridBounds& bounds) const;
+
+	void getShardFrames(unsigned int startFrame, unsigned int endFrame, std::vector<unsigned int>& frames) const;
+
+	// identifies the settings which change the bounds mergeFileBounds() works out, for the bounds manifest
+	std::string getBoundsSettingsKey() const;
+
+	// merges the bounds of all the float grids (and any mapped vector grids) in the file, using the bbox
+	// metadata where possible
+	void mergeFileBounds(openvdb::io::File& file, GridBounds& bounds) const;
+
+	// works out which grids in the file need converting and the paths to save them to, and reads them
+	bool readGridsToConvert(openvdb::io::File& file, const std::string& dstPath, std::vector<GridConversion>& grids) const;
+	// reads the grid and checks it's a type we can convert
+	bool readGridToConvert(openvdb::io::File& file, GridConversion& gridConversion) const;
+
+	// converts source voxel bounds to the bounds of the resampled grids
+	void resampleBounds(GridBounds& bounds) const;
+	// returns a new grid with each voxel covering m_resampleFactor^3 of the source grid's, built a leaf node at a time
+	// in parallel. Only the regions covered by the source's leaf nodes and tiles are visited.
+	template <typename GridType>
+	typename GridType::Ptr resampleGrid(typename GridType::Ptr grid) const;
+
+	// the channel name a grid's mapped to, or an empty string if it's not
+	std::string getMappedChannelName(const std::string& gridName) const;
+
+	// the memory the converted data of a grid with this many active voxels will take
+	size_t estimateConvertedMemorySize(bool vectorGrid, uint64_t activeVoxelCount, const GridBounds& bounds) const;
+	// estimates the memory a file's grids will need (the source grids and the converted data) from their
+	// metadata, before they're read. Grids without the metadata count as nothing.
+	size_t estimateFileMemorySize(openvdb::io::File& file, const GridBounds& bounds) const;
+
+	// estimates the sparse output for each of kAutoSubCellSizes from the grids' topology, without
+	// converting anything, and returns the size with the smallest file size plus memory
+	unsigned int chooseSubCellSize(const std::vector<GridConversion>& grids, const GridBounds& bounds) const;
+	// adds the estimates for this grid to those for each of the sizes
+	template <typename GridType>
+	void estimateSubCellSizes(typename GridType::Ptr grid, const GridBounds& bounds, std::vector<SubCellSizeEstimate>& estimates) const;
+
+	bool saveGrid(const GridConversion& gridConversion, const GridBounds& bounds) const;
+
+	bool convertGrid(const GridConversion& gridConversion, const GridBounds& bounds, ConvertedGrid& convertedGrid) const;
+	bool convertFloatGrid(openvdb::FloatGrid::Ptr grid, const GridBounds& bounds, ConvertedGrid& convertedGrid) const;
+	// vector grids are always converted to sparse grids
+	bool convertVectorGrid(openvdb::Vec3SGrid::Ptr grid, const GridBounds& bounds, ConvertedGrid& convertedGrid) const;
+	void buildMipLevels(ConvertedGrid& convertedGrid) const;
+	void buildMipLevel(const ConvertedGrid& srcLevel, ConvertedGrid& mipLevel) const;
+
+	bool writeConvertedGrid(const ConvertedGrid& convertedGrid, const std::string& path) const;
+	// writes several sparse grids of the same resolution into one file as named channels
+	bool writeConvertedChannels(const std::vector<const ConvertedGrid*>& channels, const std::vector<std::string>& channelNames,
+								const std::string& path) const;
+	// these write just the values of the grid (or a mip level of it), and return the max quantization error
+	float writeGridValues(FILE* pFile, const ConvertedGrid& convertedGrid, unsigned int formatFlags) const;
+	float writeDenseGridValues(FILE* pFile, const ConvertedGrid& convertedGrid) const;
+	float writeSparseGridValues(FILE* pFile, const ConvertedGrid& convertedGrid, unsigned int formatFlags) const;
+	float writeSparseChannelValues(FILE* pFile, const std::vector<const ConvertedGrid*>& channels, unsigned int formatFlags) const;
+	// writes an allocated subcell's data in the extended format
+	void writeEncodedSubCell(FILE* pFile, const ConvertedGrid& convertedGrid, const SparseGrid::SparseSubCell* pSubCell,
+							 const EncodedSubCell& encodedSubCell) const;
+	void writeSparseGridIndexed(FILE* pFile, const ConvertedGrid& convertedGrid, size_t valueSize,
+								const std::vector<EncodedSubCell>& encodedSubCells) const;
+
+	unsigned int getFormatFlags(const ConvertedGrid& convertedGrid) const;
+	// mipOffsetsPos is set to the position of the mip level offsets, which need filling in once they're written.
+	// the resolution etc are taken from the first channel, and channelNames are only needed for multi-channel files
+	void writeFileHeader(FILE* pFile, const std::vector<const ConvertedGrid*>& channels, unsigned int formatFlags, long& mipOffsetsPos,
+						 const std::vector<std::string>& channelNames) const;
+
+	// works out how each allocated subcell (in order) will be stored. temporalReferences flag the allocated subcells
+	// (in the same order) to store as references to the previous frame, and can be empty.
+	void encodeSubCells(const SparseGrid& sparseGrid, size_t valueSize, unsigned int quantizeBits,
+						const std::vector<unsigned char>& temporalReferences, std::vector<EncodedSubCell>& encodedSubCells) const;
+
+	// works out which of the grid's subcells are within the tolerance of the reference frame's ones, and replaces their
+	// values with the reference ones, so later frames are compared against what will actually be read back
+	void applyTemporalReference(ConvertedGrid& convertedGrid, const ConvertedGrid& referenceGrid) const;
 
-	bool saveDenseGrid(openvdb::FloatGrid::Ptr grid, const GridBounds& bounds, const std::string& path) const;
-	bool saveSparseGrid(openvdb::FloatGrid::Ptr grid, const GridBounds& bounds, const std::string& path) const;
+	template <typename T>
+	float writeDenseGridStreamed(const ConvertedGrid& convertedGrid, FILE* pFile) const;
+	// writes numSlices z slices of values, quantizing each slice if needed
+	float writeDenseSlices(FILE* pFile, const ConvertedGrid& convertedGrid, const float* pValues, unsigned int numSlices) const;
+	float writeDenseSlices(FILE* pFile, const ConvertedGrid& convertedGrid, const half* pValues, unsigned int numSlices) const;
+
+	void initTaskArena();
+
+	// fills in the dense values for z slices startZ to endZ (inclusive) of the bounds
+	template <typename T>
+	void fillDenseValues(openvdb::FloatGrid::Ptr grid, const GridBounds& bounds, int startZ, int endZ, T* pValues,
+						 float multiplier) const;
+
+	// quantized values are always extracted as floats
+	bool extractAsHalf() const
+	{
+		return m_storeAsHalf && m_quantizeBits == 0;
+	}
+
+	// the sparse fill functions work for both float and vector grids
+	template <typename GridType>
+	void fillSparseGrid(typename GridType::Ptr grid, const GridBounds& bounds, SparseGrid& sparseGrid) const;
+	// fills in the sparse grid by visiting every voxel within the bounds
+	template <typename GridType>
+	void fillSparseGridFromBounds(typename GridType::Ptr grid, const GridBounds& bounds, SparseGrid& sparseGrid) const;
+	// fills in the sparse grid by only visiting the leaf nodes and tiles which exist in the grid's tree,
+	// so is only valid if the background value is zero
+	template <typename GridType>
+	void fillSparseGridFromTree(typename GridType::Ptr grid, const GridBounds& bounds, SparseGrid& sparseGrid) const;
+
+	template <typename LeafType>
+	void fillSparseGridLeaf(SparseGrid& sparseGrid, const LeafType& leaf, const openvdb::CoordBBox& region,
+							const openvdb::Coord& boundsMin) const;
+	template <typename ValueType>
+	void fillSparseGridRegion(SparseGrid& sparseGrid, const openvdb::CoordBBox& region, const openvdb::Coord& boundsMin,
+							  const ValueType& value) const;
+
+	// sets a row of voxels along x from startI, with the components of each voxel interleaved. Values stored
+	// as half are converted a row at a time, which is much faster than doing them individually.
+	void setSparseGridRow(SparseGrid& sparseGrid, unsigned int startI, unsigned int j, unsigned int k, const float* pValues,
+						  unsigned int numVoxels) const;
+
+	// returns the voxel bounds of a row of subcells along x
+	static openvdb::CoordBBox getCellRowBBox(const SparseGrid& sparseGrid, const openvdb::CoordBBox& boundsBBox, unsigned int cellRow);
 
 	static std::string getFrameFileName(const std::string& fileName, unsigned int frame);
+	// finds the first and last frames on disk matching the sequence filename
+	static bool findSequenceFrameRange(const std::string& fileName, unsigned int& startFrame, unsigned int& endFrame);
+	static std::string getDefaultBoundsManifestPath(const std::string& dstPath);
 
 protected:
 	float			m_sizeMultiplier;
 	float			m_valueMultiplier;
 	unsigned int	m_subCellSize;
+	bool			m_autoSubCellSize;
+	SparseGrid::SubCellLayout	m_subCellLayout;
+	SparseGrid::CellStorage		m_cellStorage;
+	unsigned int	m_numThreads;
+
+	unsigned int	m_maxFramesInFlight;
+	size_t			m_memoryLimit;
+
+	bool			m_haveFrameRange;
+	unsigned int	m_startFrame;
+	unsigned int	m_endFrame;
+	unsigned int	m_shardIndex;
+	unsigned int	m_shardCount;
+
+	std::string		m_boundsManifestPath;
+	bool			m_boundsOnly;
+
+	unsigned char	m_compressionCodec;
+	unsigned char	m_compressionFilter;
+	bool			m_collapseConstantSubCells;
+	bool			m_maskSubCells;
+	bool			m_writeSubCellIndex;
+	bool			m_writeMultiChannel;
+
+	unsigned int	m_mipLevels;
+	unsigned char	m_mipFilter;
+
+	unsigned int	m_resampleFactor;
+	unsigned char	m_resampleFilter;
+
+	bool			m_perFrameBounds;
+
+	bool			m_temporalDelta;
+	float			m_temporalTolerance;
+	unsigned int	m_keyframeInterval;
+
+	// VDB grid name -> channel name
+	std::vector<std::pair<std::string, std::string> >	m_gridMappings;
+
+	// all multi-threaded work goes through this, so it's limited to m_numThreads
+	mutable tbb::task_arena	m_taskArena;
 
 	bool		m_storeAsHalf;
+	unsigned int	m_quantizeBits;
 	bool		m_useSparseGrids;
+	bool		m_streamDenseGrids;
+
+	ConversionStats*	m_pStats;
 };
 
 #endif // VDB_CONVERTER_H
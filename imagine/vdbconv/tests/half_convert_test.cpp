@@ -0,0 +1,196 @@
+/*
+ vdbconv
+ Copyright 2014-2017 Peter Pearson.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ You may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ ---------
+*/
+
+// checks the batch float to half conversion (both the F16C and scalar paths) gives exactly the
+// same halfs as converting each value with the half class
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "half_convert.h"
+
+namespace
+{
+
+// the values are built from their bits, so -ffast-math can't change them
+float floatFromBits(uint32_t bits)
+{
+	float value;
+	memcpy(&value, &bits, sizeof(float));
+	return value;
+}
+
+void getEdgeValues(std::vector<float>& values)
+{
+	// zeros
+	values.push_back(floatFromBits(0x00000000));
+	values.push_back(floatFromBits(0x80000000));
+
+	// half denormals: the smallest, the largest, and values halfway between them, which round to even
+	values.push_back(floatFromBits(0x33800000)); // 2^-24, the smallest half denormal
+	values.push_back(floatFromBits(0xb3800000));
+	values.push_back(floatFromBits(0x387fc000)); // the largest half denormal
+	values.push_back(floatFromBits(0x33000000)); // 2^-25, halfway between 0 and the smallest denormal
+	values.push_back(floatFromBits(0x33000001)); // just above that
+	values.push_back(floatFromBits(0x33c00000)); // 3 * 2^-25, halfway between the first and second denormals
+	values.push_back(floatFromBits(0x34200000)); // 5 * 2^-25, halfway between the second and third denormals
+	values.push_back(floatFromBits(0x387fe000)); // halfway between the largest denormal and the smallest normal
+	values.push_back(floatFromBits(0x38800000)); // 2^-14, the smallest normal half
+	values.push_back(floatFromBits(0x00000001)); // float denormals, which flush to zero
+	values.push_back(floatFromBits(0x807fffff));
+	values.push_back(floatFromBits(0x0da24260)); // 1e-30
+
+	// exact halfway values between normal halfs
+	values.push_back(floatFromBits(0x3f801000)); // 1 + 2^-11, which rounds down to 1
+	values.push_back(floatFromBits(0x3f803000)); // 1 + 3 * 2^-11, which rounds up to 1 + 2^-9
+	values.push_back(floatFromBits(0xbf803000));
+	values.push_back(floatFromBits(0x3f801001)); // just above halfway
+	values.push_back(floatFromBits(0x3f800fff)); // just below halfway
+	values.push_back(floatFromBits(0x3fffe000)); // halfway between the largest half below 2 and 2
+
+	// the largest finite half, and values around it which round to it or overflow to infinity
+	values.push_back(floatFromBits(0x477fe000)); // 65504
+	values.push_back(floatFromBits(0xc77fe000));
+	values.push_back(floatFromBits(0x477fefff)); // just below 65520, which rounds down to 65504
+	values.push_back(floatFromBits(0x477ff000)); // 65520, halfway to the next exponent, which rounds to infinity
+	values.push_back(floatFromBits(0xc77ff000));
+	values.push_back(floatFromBits(0x501502f9)); // 1e10
+	values.push_back(floatFromBits(0x7f7fffff)); // the largest float
+
+	// infinities and NaNs
+	values.push_back(floatFromBits(0x7f800000));
+	values.push_back(floatFromBits(0xff800000));
+	values.push_back(floatFromBits(0x7fc00000));
+	values.push_back(floatFromBits(0xffc00000));
+	values.push_back(floatFromBits(0x7fc02000)); // a quiet NaN with a payload which fits in a half
+
+	// ordinary values
+	values.push_back(floatFromBits(0x3f800000)); // 1
+	values.push_back(floatFromBits(0x3eaaaaab)); // 1/3
+	values.push_back(floatFromBits(0xc2c80000)); // -100
+}
+
+void getPseudoRandomValues(std::vector<float>& values, size_t count)
+{
+	// an LCG, so the values are the same every run. The exponents are limited to the range around the
+	// half's, so most of them are finite halfs, but they still cover denormals and overflow
+	uint32_t state = 12345;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		state = state * 1664525 + 1013904223;
+		uint32_t sign = state & 0x80000000;
+		uint32_t exponent = 127 - 28 + ((state >> 23) % 48);
+		uint32_t mantissa = (state * 2654435761u) & 0x007fffff;
+
+		values.push_back(floatFromBits(sign | (exponent << 23) | mantissa));
+	}
+}
+
+bool isSameHalf(half a, half b)
+{
+	// NaNs only need to still be NaNs, as the payload bits aren't meaningful
+	if (a.isNan() || b.isNan())
+		return a.isNan() && b.isNan();
+
+	return a.bits() == b.bits();
+}
+
+typedef void (*ConvertFunction)(const float* pSrc, half* pDst, size_t count);
+
+// converts the values in rows of rowLength (the last one can be shorter), starting at offset, so
+// that the batch conversion has both full batches of 8 and a remainder, and unaligned pointers
+bool checkConversion(const char* pathName, ConvertFunction convertFunction, const std::vector<float>& values,
+					 size_t offset, size_t rowLength)
+{
+	std::vector<half> converted(values.size());
+
+	for (size_t rowStart = offset; rowStart < values.size(); rowStart += rowLength)
+	{
+		size_t count = std::min(rowLength, values.size() - rowStart);
+		convertFunction(&values[rowStart], &converted[rowStart], count);
+	}
+
+	bool success = true;
+
+	for (size_t i = offset; i < values.size(); i++)
+	{
+		half expected = (half)values[i];
+
+		if (!isSameHalf(converted[i], expected))
+		{
+			uint32_t floatBits;
+			memcpy(&floatBits, &values[i], sizeof(float));
+
+			fprintf(stderr, "%s conversion with row length %u: float 0x%08x gave half 0x%04x, rather than 0x%04x\n", pathName,
+					(unsigned int)rowLength, floatBits, (unsigned int)converted[i].bits(), (unsigned int)expected.bits());
+			success = false;
+		}
+	}
+
+	return success;
+}
+
+} // namespace
+
+int main()
+{
+	std::vector<float> values;
+	getEdgeValues(values);
+	getPseudoRandomValues(values, 10000);
+
+	// none of these are multiples of 8, apart from the last, which has a remainder as the value count isn't
+	static const size_t kRowLengths[] = { 1, 3, 7, 9, 13, 31, 67, 1001, 8 };
+	static const size_t kNumRowLengths = sizeof(kRowLengths) / sizeof(kRowLengths[0]);
+
+	bool useF16C = isF16CAvailable();
+	if (!useF16C)
+	{
+		fprintf(stderr, "F16C isn't available on this CPU, so only the scalar conversion is tested.\n");
+	}
+
+	unsigned int numFailed = 0;
+
+	for (size_t offset = 0; offset < 3; offset++)
+	{
+		for (size_t i = 0; i < kNumRowLengths; i++)
+		{
+			if (!checkConversion("Scalar", convertFloatsToHalfsScalar, values, offset, kRowLengths[i]))
+				numFailed++;
+
+			if (useF16C && !checkConversion("F16C", convertFloatsToHalfsF16C, values, offset, kRowLengths[i]))
+				numFailed++;
+
+			if (!checkConversion("Batch", convertFloatsToHalfs, values, offset, kRowLengths[i]))
+				numFailed++;
+		}
+	}
+
+	if (numFailed > 0)
+	{
+		fprintf(stderr, "%u half conversion checks failed.\n", numFailed);
+		return 1;
+	}
+
+	fprintf(stderr, "All half conversion checks passed.\n");
+	return 0;
+}